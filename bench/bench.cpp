@@ -0,0 +1,510 @@
+//---------------------------------------------------------------------------
+// bench/bench.cpp
+//
+// Microbenchmarks for the entity storage.  Run without arguments for
+// the default sizes, or pass a filter to only run the benchmarks whose
+// name contains it:
+//
+//     es_bench [--large] [--reps N] [filter]
+//
+// Every benchmark runs a number of times, and the fastest run is
+// reported, in nanoseconds per entity.  Memory is the entity data that
+// was allocated, plus the fixed cost of a slot, divided by the number
+// of entities.
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <es/archetype_storage.hpp>
+#include <es/storage.hpp>
+
+using namespace es;
+
+struct vec
+{
+    float x, y, z;
+
+    void operator+=(const vec& a)
+    {
+        x += a.x;
+        y += a.y;
+        z += a.z;
+    }
+};
+
+namespace es
+{
+template <>
+struct is_flat<vec>
+{
+    static constexpr bool value = true;
+};
+}
+
+namespace
+{
+
+/** Keeps track of the entity data a storage allocates. */
+class counting_allocator : public allocator
+{
+public:
+    counting_allocator()
+        : in_use_(0)
+    {
+    }
+
+    void* allocate(size_t size) override
+    {
+        in_use_ += size;
+        return std::malloc(size);
+    }
+
+    void deallocate(void* ptr, size_t size) override
+    {
+        in_use_ -= size;
+        std::free(ptr);
+    }
+
+    size_t in_use() const { return in_use_; }
+
+private:
+    size_t in_use_;
+};
+
+/** The memory a slot costs, whether it has data on the heap or not. */
+const size_t slot_bytes
+    = sizeof(entity) + 2 * sizeof(component_mask) + sizeof(small_buffer);
+
+struct options
+{
+    std::vector<size_t> sizes;
+    size_t reps;
+    std::string filter;
+};
+
+/** Stops the optimizer from throwing away results. */
+volatile float sink;
+
+class benchmark_runner
+{
+public:
+    explicit benchmark_runner(const options& opt)
+        : opt_(opt)
+    {
+        std::printf("%-28s %10s %12s %12s\n", "benchmark", "entities",
+                    "ns/entity", "bytes/entity");
+    }
+
+    bool wanted(const std::string& name) const
+    {
+        return opt_.filter.empty()
+               || name.find(opt_.filter) != std::string::npos;
+    }
+
+    /** Time a benchmark.
+     * @param setup  Called before every run, not timed
+     * @param run    The part that is timed
+     * @param memory Called after the last run, returns the bytes used */
+    void run(const std::string& name, size_t n, std::function<void()> setup,
+             std::function<void()> run,
+             std::function<size_t()> memory = nullptr)
+    {
+        if (!wanted(name))
+            return;
+
+        double best = 0;
+        for (size_t i = 0; i < opt_.reps; ++i) {
+            setup();
+            auto start = clock::now();
+            run();
+            auto elapsed = std::chrono::duration<double, std::nano>(
+                               clock::now() - start).count();
+            if (i == 0 || elapsed < best)
+                best = elapsed;
+        }
+
+        if (memory)
+            std::printf("%-28s %10zu %12.2f %12.1f\n", name.c_str(), n,
+                        best / n, double(memory()) / n);
+        else
+            std::printf("%-28s %10zu %12.2f %12s\n", name.c_str(), n,
+                        best / n, "-");
+        std::fflush(stdout);
+    }
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    const options& opt_;
+};
+
+/** A storage with position, velocity, and mass components.  Every
+ *  entity has a position; only one in \a sparse has the rest. */
+struct world
+{
+    counting_allocator alloc;
+    storage s;
+    storage::component_id pos, vel, mass, name;
+
+    world()
+        : s(&alloc)
+    {
+        pos = s.register_component<vec>("position");
+        vel = s.register_component<vec>("velocity");
+        mass = s.register_component<float>("mass");
+        name = s.register_component<std::string>("name");
+    }
+
+    void fill(size_t n, size_t sparse = 1)
+    {
+        std::mt19937 rng(1234);
+        std::uniform_real_distribution<float> dist(-1.f, 1.f);
+        for (size_t i = 0; i < n; ++i) {
+            auto e = s.new_entity();
+            s.set(e, pos, vec{dist(rng), dist(rng), dist(rng)});
+            if (i % sparse == 0) {
+                s.set(e, vel, vec{dist(rng), dist(rng), dist(rng)});
+                s.set(e, mass, 1.f + dist(rng));
+            }
+        }
+        s.clear_changes();
+    }
+
+    size_t memory() const { return alloc.in_use() + s.size() * slot_bytes; }
+};
+
+void bench_churn(benchmark_runner& b, size_t n)
+{
+    std::unique_ptr<world> w;
+    std::vector<entity> ids(n);
+    b.run("create_delete", n, [&] { w.reset(new world); },
+          [&] {
+              for (size_t i = 0; i < n; ++i)
+                  ids[i] = w->s.new_entity();
+              for (size_t i = 0; i < n; i += 2)
+                  w->s.delete_entity(ids[i]);
+              for (size_t i = 0; i < n; i += 2)
+                  ids[i] = w->s.new_entity();
+          });
+}
+
+void bench_set_get(benchmark_runner& b, size_t n)
+{
+    std::unique_ptr<world> w;
+    std::vector<entity> ids;
+    auto setup = [&] {
+        w.reset(new world);
+        ids.clear();
+        for (size_t i = 0; i < n; ++i)
+            ids.push_back(w->s.new_entity());
+        std::shuffle(ids.begin(), ids.end(), std::mt19937(42));
+    };
+
+    b.run("set_by_id", n, setup,
+          [&] {
+              for (auto e : ids)
+                  w->s.set(e, w->pos, vec{1, 2, 3});
+          },
+          [&] { return w->memory(); });
+
+    b.run("get_by_id", n, [] {},
+          [&] {
+              float total = 0;
+              for (auto e : ids)
+                  total += w->s.get<vec>(e, w->pos).x;
+              sink = total;
+          });
+}
+
+void bench_for_each(benchmark_runner& b, size_t n, size_t sparse,
+                    const char* suffix)
+{
+    world w;
+    w.fill(n, sparse);
+    auto memory = [&] { return w.memory(); };
+    auto none = [] {};
+
+    b.run(std::string("for_each_1") + suffix, n, none,
+          [&] {
+              float total = 0;
+              w.s.for_each<vec>(w.pos, [&](storage::iterator, vec& p) {
+                  total += p.x;
+              });
+              sink = total;
+          },
+          memory);
+
+    b.run(std::string("for_each_2") + suffix, n, none,
+          [&] {
+              w.s.for_each<vec, vec>(w.pos, w.vel,
+                                     [](storage::iterator, vec& p, vec& v) {
+                                         p += v;
+                                     });
+          },
+          memory);
+
+    b.run(std::string("for_each_3") + suffix, n, none,
+          [&] {
+              w.s.for_each<vec, vec, float>(
+                  w.pos, w.vel, w.mass,
+                  [](storage::iterator, vec& p, vec& v, float& m) {
+                      p.x += v.x * m;
+                      p.y += v.y * m;
+                      p.z += v.z * m;
+                  });
+          },
+          memory);
+}
+
+void bench_chunks(benchmark_runner& b, size_t n)
+{
+    archetype_storage s;
+    auto pos = s.register_component<vec>("position");
+    auto vel = s.register_component<vec>("velocity");
+    auto range = s.new_entities(n);
+    for (auto e = range.first; e != range.second; ++e) {
+        s.set(e, pos, vec{0, 0, 0});
+        s.set(e, vel, vec{0.1f, 0.1f, 0.1f});
+    }
+
+    b.run("archetype_for_each_2", n, [] {}, [&] {
+        s.for_each<vec, vec>(pos, vel, [](entity, vec& p, vec& v) { p += v; });
+    });
+
+    b.run("archetype_chunk_2", n, [] {}, [&] {
+        s.for_each_chunk<vec, vec>(
+            pos, vel, [](size_t count, const entity*, vec* p, vec* v) {
+                for (size_t i = 0; i < count; ++i) {
+                    p[i].x += v[i].x;
+                    p[i].y += v[i].y;
+                    p[i].z += v[i].z;
+                }
+            });
+    });
+}
+
+void bench_compact(benchmark_runner& b, size_t n)
+{
+    world w;
+    w.fill(n);
+
+    // Shuffle the heap: delete and recreate half the entities at random.
+    std::mt19937 rng(99);
+    std::vector<entity> ids;
+    for (auto i = w.s.begin(); i != w.s.end(); ++i)
+        ids.push_back(i->first);
+    std::shuffle(ids.begin(), ids.end(), rng);
+    for (size_t i = 0; i < n / 2; ++i)
+        w.s.delete_entity(ids[i]);
+    for (size_t i = 0; i < n / 2; ++i) {
+        auto e = w.s.new_entity();
+        w.s.set(e, w.pos, vec{0, 0, 0});
+        w.s.set(e, w.vel, vec{1, 1, 1});
+        w.s.set(e, w.mass, 1.f);
+    }
+
+    auto loop = [&] {
+        w.s.for_each<vec, vec>(w.pos, w.vel,
+                               [](storage::iterator, vec& p, vec& v) {
+                                   p += v;
+                               });
+    };
+    b.run("for_each_2_churned", n, [] {}, loop);
+    b.run("compact", n, [] {}, [&] { w.s.compact(); });
+    b.run("for_each_2_compacted", n, [] {}, loop);
+}
+
+void bench_toggle(benchmark_runner& b, size_t n)
+{
+    world w;
+    w.fill(n);
+    auto packed = w.s.register_component<int>("stunned");
+    auto sparse = w.s.register_component<int>("slowed", storage::sparse);
+    std::vector<entity> ids;
+    for (auto i = w.s.begin(); i != w.s.end(); ++i)
+        ids.push_back(i->first);
+
+    auto toggle = [&](storage::component_id c) {
+        for (auto e : ids)
+            w.s.set(e, c, 1);
+        for (auto e : ids)
+            w.s.remove_component_from_entity(w.s.find(e), c);
+    };
+    b.run("toggle_packed", n, [] {}, [&] { toggle(packed); });
+    b.run("toggle_sparse", n, [] {}, [&] { toggle(sparse); });
+
+    // A status effect that only a few entities have.
+    for (size_t i = 0; i < ids.size(); i += 100)
+        w.s.set(ids[i], sparse, 1);
+    b.run("for_each_sparse_set", n, [] {}, [&] {
+        w.s.for_each<vec, int>(w.pos, sparse,
+                               [](storage::iterator, vec& p, int& t) {
+                                   p.x += float(t);
+                               });
+    });
+}
+
+void bench_clone(benchmark_runner& b, size_t n)
+{
+    std::unique_ptr<world> w;
+    entity original;
+    b.run("clone", n,
+          [&] {
+              w.reset(new world);
+              original = w->s.new_entity();
+              w->s.set(original, w->pos, vec{1, 2, 3});
+              w->s.set(original, w->vel, vec{1, 2, 3});
+              w->s.set(original, w->name, std::string("a rather long name"));
+          },
+          [&] {
+              auto i = w->s.find(original);
+              for (size_t k = 0; k < n; ++k)
+                  w->s.clone_entity(i);
+          },
+          [&] { return w->memory(); });
+}
+
+/** A large value that entities made from the same prototype only read. */
+struct stat_table
+{
+    float values[64];
+};
+
+void bench_prefab(benchmark_runner& b, size_t n)
+{
+    for (auto how : {storage::packed, storage::shared}) {
+        std::unique_ptr<world> w;
+        std::unique_ptr<storage::prototype> proto;
+        storage::component_id stats = 0;
+        b.run(how == storage::packed ? "spawn_packed" : "spawn_shared", n,
+              [&] {
+                  proto.reset();
+                  w.reset(new world);
+                  stats = w->s.register_component<stat_table>("stats", how);
+                  proto.reset(new storage::prototype(w->s));
+                  proto->set(w->pos, vec{1, 2, 3});
+                  proto->set(stats, stat_table());
+              },
+              [&] { w->s.new_entities(n, *proto); },
+              [&] { return w->memory(); });
+        proto.reset();
+    }
+}
+
+void bench_observe(benchmark_runner& b, size_t n)
+{
+    std::unique_ptr<world> w;
+    std::unique_ptr<storage::prototype> proto;
+    size_t seen = 0;
+    b.run("spawn_observed", n,
+          [&] {
+              proto.reset();
+              w.reset(new world);
+              w->s.observe(w->pos, storage::on_add | storage::on_change,
+                           [&](const storage::event_batch& batch) {
+                               seen += batch.size();
+                           });
+              proto.reset(new storage::prototype(w->s));
+              proto->set(w->pos, vec{1, 2, 3});
+          },
+          [&] {
+              w->s.new_entities(n, *proto);
+              w->s.for_each<vec>(w->pos,
+                                 [](storage::iterator, vec& p) { p.x += 1; });
+              w->s.dispatch_events();
+          });
+    proto.reset();
+}
+
+void bench_tracking(benchmark_runner& b, size_t n)
+{
+    for (bool tracked : {true, false}) {
+        std::unique_ptr<world> w;
+        b.run(tracked ? "fill_tracked" : "fill_untracked", n,
+              [&] {
+                  w.reset(new world);
+                  w->s.track_changes(tracked);
+              },
+              [&] { w->fill(n); },
+              [&] {
+                  auto usage = w->s.memory_stats();
+                  return w->alloc.in_use() + usage.slot_bytes
+                         + usage.change_bytes + usage.index_bytes;
+              });
+    }
+}
+
+void bench_serialize(benchmark_runner& b, size_t n)
+{
+    world w;
+    w.fill(n, 2);
+    std::vector<std::vector<char>> buffers(n);
+
+    b.run("serialize", n, [&] {
+        for (auto& buf : buffers)
+            buf.clear();
+    }, [&] {
+        size_t k = 0;
+        for (auto i = w.s.begin(); i != w.s.end(); ++i)
+            w.s.serialize(i, buffers[k++]);
+    });
+
+    b.run("deserialize", n, [] {}, [&] {
+        size_t k = 0;
+        for (auto i = w.s.begin(); i != w.s.end(); ++i)
+            w.s.deserialize(i, buffers[k++]);
+    });
+}
+
+options parse(int argc, char** argv)
+{
+    options opt;
+    opt.sizes = {10000, 100000, 1000000};
+    opt.reps = 5;
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--large") == 0) {
+            opt.sizes.push_back(10000000);
+        } else if (std::strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+            opt.reps = std::max(1, std::atoi(argv[++i]));
+        } else {
+            opt.filter = argv[i];
+        }
+    }
+    return opt;
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv)
+{
+    auto opt = parse(argc, argv);
+    benchmark_runner b(opt);
+
+    for (auto n : opt.sizes) {
+        bench_churn(b, n);
+        bench_set_get(b, n);
+        bench_for_each(b, n, 1, "_dense");
+        bench_for_each(b, n, 10, "_sparse");
+        bench_chunks(b, n);
+        bench_compact(b, n);
+        bench_toggle(b, n);
+        bench_clone(b, n);
+        bench_prefab(b, n);
+        bench_observe(b, n);
+        bench_tracking(b, n);
+        bench_serialize(b, n);
+    }
+    return 0;
+}
@@ -0,0 +1,155 @@
+//---------------------------------------------------------------------------
+// es/allocator.cpp
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+
+#include "allocator.hpp"
+
+#include <cassert>
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+
+namespace es
+{
+
+pool_allocator::pool_allocator(size_t chunk_size)
+    : chunk_size_(chunk_size)
+    , current_(0)
+    , cursor_(0)
+    , allocated_(0)
+    , large_(0)
+{
+    if (chunk_size_ < max_block_size)
+        throw std::logic_error("chunk size is too small");
+
+    free_.fill(nullptr);
+}
+
+pool_allocator::~pool_allocator()
+{
+}
+
+void* pool_allocator::allocate(size_t size)
+{
+    if (size > max_block_size) {
+        auto ptr = std::malloc(size);
+        if (ptr == nullptr)
+            throw std::bad_alloc();
+
+        std::lock_guard<std::mutex> lock(lock_);
+        allocated_ += size;
+        large_ += size;
+        return ptr;
+    }
+
+    auto index = size_class(size);
+    std::lock_guard<std::mutex> lock(lock_);
+    void* result;
+    auto& head = free_[index];
+    if (head != nullptr) {
+        result = head;
+        head = head->next;
+    } else {
+        result = carve(class_size(index));
+    }
+    allocated_ += class_size(index);
+    return result;
+}
+
+void pool_allocator::deallocate(void* ptr, size_t size)
+{
+    if (ptr == nullptr)
+        return;
+
+    if (size > max_block_size) {
+        std::free(ptr);
+        std::lock_guard<std::mutex> lock(lock_);
+        allocated_ -= size;
+        large_ -= size;
+        return;
+    }
+
+    auto index = size_class(size);
+    auto block = static_cast<free_block*>(ptr);
+    std::lock_guard<std::mutex> lock(lock_);
+    assert(allocated_ >= class_size(index));
+    allocated_ -= class_size(index);
+    block->next = free_[index];
+    free_[index] = block;
+}
+
+void pool_allocator::reset()
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    forget_blocks();
+}
+
+void pool_allocator::release()
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    forget_blocks();
+    chunks_.clear();
+}
+
+size_t pool_allocator::allocated() const
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    return allocated_;
+}
+
+size_t pool_allocator::reserved() const
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    return chunks_.size() * chunk_size_ + large_;
+}
+
+size_t pool_allocator::size_class(size_t size)
+{
+    assert(size <= max_block_size);
+
+    // Steps of 16 bytes up to 256, then powers of two.
+    if (size <= 256)
+        return size == 0 ? 0 : (size - 1) / 16;
+
+    size_t index = 16;
+    for (size_t limit = 512; limit < size; limit *= 2)
+        ++index;
+
+    return index;
+}
+
+size_t pool_allocator::class_size(size_t index)
+{
+    return index < 16 ? (index + 1) * 16 : size_t(256) << (index - 15);
+}
+
+char* pool_allocator::carve(size_t size)
+{
+    if (current_ >= chunks_.size() || cursor_ + size > chunk_size_) {
+        // The rest of the current chunk is lost, but as the blocks are
+        // small compared to the chunks, this is never much.
+        if (current_ < chunks_.size())
+            ++current_;
+
+        if (current_ == chunks_.size())
+            chunks_.emplace_back(new char[chunk_size_]);
+
+        cursor_ = 0;
+    }
+
+    auto result = chunks_[current_].get() + cursor_;
+    cursor_ += size;
+    return result;
+}
+
+void pool_allocator::forget_blocks()
+{
+    free_.fill(nullptr);
+    allocated_ = large_;
+    current_ = 0;
+    cursor_ = 0;
+}
+
+} // namespace es
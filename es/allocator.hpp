@@ -0,0 +1,102 @@
+//---------------------------------------------------------------------------
+/// \file   es/allocator.hpp
+/// \brief  Pluggable memory allocation for entity data
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace es
+{
+/** The interface for the allocators that a storage can use for its
+ *  entity data. */
+class allocator
+{
+public:
+    virtual ~allocator() {}
+
+    /** Allocate a block of memory.  Throws std::bad_alloc on failure. */
+    virtual void* allocate(size_t size) = 0;
+
+    /** Give back a block.
+     * @param ptr   A block returned by allocate()
+     * @param size  The size that was passed to allocate() */
+    virtual void deallocate(void* ptr, size_t size) = 0;
+};
+
+/** An allocator for lots of small blocks.
+ *  Small blocks are rounded up to a size class, and carved out of large
+ *  chunks of memory.  Freed blocks go on a free list for their size class,
+ *  so long-running programs do not fragment the heap.  Blocks larger than
+ *  max_block_size are passed on to malloc.
+ *
+ *  Allocating and deallocating is thread safe. */
+class pool_allocator : public allocator
+{
+public:
+    static const size_t max_block_size = 4096;
+
+    /** @param chunk_size  The amount of memory that is requested from the
+     *                     system at once */
+    explicit pool_allocator(size_t chunk_size = 64 * 1024);
+
+    pool_allocator(const pool_allocator&) = delete;
+    pool_allocator& operator=(const pool_allocator&) = delete;
+
+    ~pool_allocator();
+
+    void* allocate(size_t size) override;
+
+    void deallocate(void* ptr, size_t size) override;
+
+    /** Forget about all small blocks at once.  The chunks are kept, and
+     *  handed out again from the start.  This is meant for unloading a
+     *  level: clear the storage, then reset its allocator.  Any block
+     *  that is still in use becomes invalid. */
+    void reset();
+
+    /** Like reset(), but also give the chunks back to the system. */
+    void release();
+
+    /** The number of bytes handed out and not given back yet. */
+    size_t allocated() const;
+
+    /** The number of bytes requested from the system, including the
+     *  large blocks. */
+    size_t reserved() const;
+
+private:
+    static const size_t class_count = 20;
+
+    static size_t size_class(size_t size);
+
+    static size_t class_size(size_t index);
+
+    char* carve(size_t size);
+
+    void forget_blocks();
+
+private:
+    struct free_block
+    {
+        free_block* next;
+    };
+
+    size_t chunk_size_;
+    mutable std::mutex lock_;
+    std::array<free_block*, class_count> free_;
+    std::vector<std::unique_ptr<char[]>> chunks_;
+    /** The chunk new blocks are carved from. */
+    size_t current_;
+    size_t cursor_;
+    size_t allocated_;
+    size_t large_;
+};
+
+} // namespace es
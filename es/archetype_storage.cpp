@@ -0,0 +1,197 @@
+//---------------------------------------------------------------------------
+// es/archetype_storage.cpp
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+
+#include "archetype_storage.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace es
+{
+
+archetype_storage::archetype_storage()
+    : size_(0)
+{
+    find_archetype(component_mask());
+}
+
+archetype_storage::~archetype_storage()
+{
+    for (auto& a : archetypes_) {
+        for (auto c : a->ids) {
+            if (components_[c].is_flat())
+                continue;
+
+            for (size_t row = 0; row < a->size; ++row)
+                destroy(c, cell(*a, row, c));
+        }
+    }
+}
+
+archetype_storage::component_id
+archetype_storage::find_component(const std::string& name) const
+{
+    auto found = std::find(components_.begin(), components_.end(), name);
+    if (found == components_.end())
+        throw std::logic_error("component does not exist");
+
+    return std::distance(components_.begin(), found);
+}
+
+entity archetype_storage::new_entity()
+{
+    entity en = locations_.size();
+    locations_.push_back({0, add_row(*archetypes_[0], en)});
+    ++size_;
+    return en;
+}
+
+std::pair<entity, entity> archetype_storage::new_entities(size_t count)
+{
+    entity range_begin = locations_.size();
+    locations_.reserve(locations_.size() + count);
+    for (; count > 0; --count)
+        new_entity();
+
+    return {range_begin, entity(locations_.size())};
+}
+
+bool archetype_storage::delete_entity(entity en)
+{
+    if (!exists(en))
+        return false;
+
+    location& loc = locations_[en];
+    archetype& a = *archetypes_[loc.arch];
+    for (auto c : a.ids)
+        destroy(c, cell(loc, c));
+
+    remove_row(a, loc.row);
+    loc.arch = npos;
+    --size_;
+    return true;
+}
+
+void archetype_storage::remove_component_from_entity(entity en, component_id c)
+{
+    const location& loc = find(en);
+    auto& mask = archetypes_[loc.arch]->mask;
+    if (!mask[c])
+        return;
+
+    move_entity(en, component_mask(mask).reset(c));
+}
+
+bool archetype_storage::entity_has_component(entity en, component_id c) const
+{
+    return c < components_.size() && archetypes_[find(en).arch]->mask[c];
+}
+
+const archetype_storage::location& archetype_storage::find(entity en) const
+{
+    if (!exists(en))
+        throw std::logic_error("unknown entity");
+
+    return locations_[en];
+}
+
+uint32_t archetype_storage::find_archetype(const component_mask& mask)
+{
+    auto found = archetype_index_.find(mask);
+    if (found != archetype_index_.end())
+        return found->second;
+
+    std::unique_ptr<archetype> a(new archetype);
+    a->mask = mask;
+    a->size = 0;
+    a->columns.resize(components_.size(), 0);
+
+    size_t row_size = sizeof(entity);
+    for (size_t c = 0; c < components_.size(); ++c) {
+        if (mask[c]) {
+            a->ids.push_back(c);
+            row_size += components_[c].size();
+        }
+    }
+
+    // Leave room for the padding between the columns.
+    size_t padding = (a->ids.size() + 1) * column_alignment;
+    a->capacity = chunk_size > padding + row_size
+                      ? (chunk_size - padding) / row_size
+                      : 1;
+
+    auto align = [](size_t x) {
+        return (x + column_alignment - 1) & ~(column_alignment - 1);
+    };
+    size_t off = align(a->capacity * sizeof(entity));
+    for (auto c : a->ids) {
+        a->columns[c] = off;
+        off = align(off + a->capacity * components_[c].size());
+    }
+    a->bytes = off;
+
+    uint32_t index = archetypes_.size();
+    archetypes_.push_back(std::move(a));
+    archetype_index_[mask] = index;
+
+    return index;
+}
+
+uint32_t archetype_storage::add_row(archetype& a, entity en)
+{
+    if (a.size == a.chunks.size() * a.capacity)
+        a.chunks.emplace_back(new char[a.bytes]);
+
+    uint32_t row = a.size++;
+    entity_at(a, row) = en;
+    return row;
+}
+
+void archetype_storage::remove_row(archetype& a, uint32_t row)
+{
+    uint32_t last = a.size - 1;
+    if (row != last) {
+        for (auto c : a.ids)
+            relocate(c, cell(a, last, c), cell(a, row, c));
+
+        entity moved = entity_at(a, last);
+        entity_at(a, row) = moved;
+        locations_[moved].row = row;
+    }
+    --a.size;
+    if (a.size == (a.chunks.size() - 1) * a.capacity)
+        a.chunks.pop_back();
+}
+
+void archetype_storage::move_entity(entity en, const component_mask& mask)
+{
+    uint32_t target = find_archetype(mask);
+    location& loc = locations_[en];
+    archetype& from = *archetypes_[loc.arch];
+    archetype& to = *archetypes_[target];
+
+    location moved_to{target, add_row(to, en)};
+    for (auto c : from.ids) {
+        if (mask[c])
+            relocate(c, cell(loc, c), cell(moved_to, c));
+        else
+            destroy(c, cell(loc, c));
+    }
+    remove_row(from, loc.row);
+    loc = moved_to;
+}
+
+void archetype_storage::relocate(component_id c, char* from, char* to) const
+{
+    components_[c].relocate(to, from);
+}
+
+void archetype_storage::destroy(component_id c, char* ptr) const
+{
+    components_[c].destroy(ptr);
+}
+
+} // namespace es
@@ -0,0 +1,440 @@
+//---------------------------------------------------------------------------
+/// \file   es/archetype_storage.hpp
+/// \brief  An entity/component data store that groups entities by archetype
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <typeinfo>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "component.hpp"
+#include "component_mask.hpp"
+#include "entity.hpp"
+#include "job_system.hpp"
+#include "traits.hpp"
+
+namespace es
+{
+/** An alternative to \a storage that groups entities by archetype.
+ * All entities that have exactly the same set of components share an
+ * archetype.  The data of an archetype is kept in fixed-size chunks, with
+ * a contiguous column for every component, so iterating over one or more
+ * components walks linearly through memory instead of chasing a pointer
+ * per entity.
+ *
+ * The price is paid when the set of components of an entity changes:
+ * adding or removing a component moves all of the entity's data to a
+ * different archetype.  This makes it a good fit for large numbers of
+ * entities with a stable composition, and a bad one for components that
+ * are toggled all the time.
+ *
+ * The interface follows that of \a storage, except that entities are
+ * always referred to by their ID, and there is no dirty tracking.
+ * Entities must not be created, deleted, or have components added or
+ * removed from within a for_each.
+ */
+class archetype_storage
+{
+    typedef component::placeholder placeholder;
+
+    template <typename T>
+    using holder = component::holder<T>;
+
+public:
+    typedef es::component_id component_id;
+
+private:
+    /** The size of a chunk of component data, in bytes. */
+    static const size_t chunk_size = 16384;
+
+    /** Every column in a chunk starts at a multiple of this. */
+    static const size_t column_alignment = 16;
+
+    /** All entities with a given set of components. */
+    struct archetype
+    {
+        /** The components held by entities in this archetype. */
+        component_mask mask;
+        /** The same components, as a list in ascending order. */
+        std::vector<component_id> ids;
+        /** Byte offset of the column of every component in a chunk,
+         *  indexed by component_id.  The first column holds the entity
+         *  IDs. */
+        std::vector<size_t> columns;
+        /** The maximum number of entities in a chunk. */
+        size_t capacity;
+        /** The number of bytes allocated for a chunk. */
+        size_t bytes;
+        /** The total number of entities in this archetype.  All chunks
+         *  except the last one are always full. */
+        size_t size;
+        std::vector<std::unique_ptr<char[]>> chunks;
+
+        /** The number of entities in a given chunk. */
+        size_t chunk_count(size_t chunk) const
+        {
+            return chunk + 1 < chunks.size() ? capacity
+                                             : size - chunk * capacity;
+        }
+    };
+
+    /** Where the data of an entity can be found. */
+    struct location
+    {
+        uint32_t arch;
+        uint32_t row;
+    };
+
+    /** Marks a location that does not hold an entity. */
+    static const uint32_t npos = 0xffffffff;
+
+    /** Maps any type to a component_id, so a parameter pack of types can
+     *  be turned into a list of IDs. */
+    template <typename>
+    struct id_for
+    {
+        typedef component_id type;
+    };
+
+public:
+    archetype_storage();
+    ~archetype_storage();
+
+    template <typename type>
+    component_id register_component(std::string&& name)
+    {
+        static_assert(std::alignment_of<type>::value <= column_alignment,
+                      "over-aligned components are not supported");
+        if (components_.size() >= max_components)
+            throw std::logic_error("too many components");
+
+        if (is_flat<type>::value) {
+            components_.emplace_back(std::move(name), sizeof(type),
+                                     typeid(type), nullptr);
+        } else {
+            components_.emplace_back(
+                std::move(name), sizeof(holder<type>), typeid(type),
+                std::unique_ptr<placeholder>(new holder<type>()));
+        }
+        return components_.size() - 1;
+    }
+
+    component_id find_component(const std::string& name) const;
+
+    const component& operator[](component_id id) const
+    {
+        return components_[id];
+    }
+
+    const std::vector<component>& components() const { return components_; }
+
+public:
+    entity new_entity();
+
+    /** Create a whole bunch of empty entities in one go.
+     * @param count     The number of entities to create
+     * @return The range of entities created */
+    std::pair<entity, entity> new_entities(size_t count);
+
+    size_t size() const { return size_; }
+
+    /** The number of distinct component combinations in use. */
+    size_t archetype_count() const { return archetypes_.size(); }
+
+    bool exists(entity en) const
+    {
+        return en < locations_.size() && locations_[en].arch != npos;
+    }
+
+    bool delete_entity(entity en);
+
+    void remove_component_from_entity(entity en, component_id c);
+
+    bool entity_has_component(entity en, component_id c) const;
+
+    template <typename T>
+    void set(entity en, component_id c_id, T val)
+    {
+        assert(c_id < components_.size());
+        assert(components_[c_id].is_of_type<T>());
+
+        const location& loc = find(en);
+        if (archetypes_[loc.arch]->mask[c_id]) {
+            ref<T>(cell(loc, c_id)) = std::move(val);
+            return;
+        }
+
+        move_entity(en, component_mask(archetypes_[loc.arch]->mask)
+                            .set(c_id));
+
+        char* ptr = cell(locations_[en], c_id);
+        if (is_flat<T>::value)
+            new (ptr) T(std::move(val));
+        else
+            new (ptr) holder<T>(std::move(val));
+    }
+
+    template <typename T>
+    const T& get(entity en, component_id c_id) const
+    {
+        assert(components_[c_id].is_of_type<T>());
+        const location& loc = find(en);
+        if (!archetypes_[loc.arch]->mask[c_id])
+            throw std::logic_error("entity does not have component");
+
+        return ref<T>(cell(loc, c_id));
+    }
+
+    template <typename T>
+    T& get(entity en, component_id c_id)
+    {
+        assert(components_[c_id].is_of_type<T>());
+        const location& loc = find(en);
+        if (!archetypes_[loc.arch]->mask[c_id])
+            throw std::logic_error("entity does not have component");
+
+        return ref<T>(cell(loc, c_id));
+    }
+
+    /** Call a function for every entity that has a given set of
+     *  components.
+     * @param c     The components to look for, one for every type in Ts.
+     * @param func  The function to call.  This function will be passed
+     *              the entity, and a reference to each of the component
+     *              values. */
+    template <typename... Ts, typename Func>
+    void for_each(typename id_for<Ts>::type... c, Func&& func)
+    {
+        component_mask mask;
+        for (auto i : {c...}) {
+            assert(i < components_.size());
+            mask.set(i);
+        }
+
+        for (auto& a : archetypes_) {
+            if ((a->mask & mask) != mask)
+                continue;
+
+            for (size_t k = 0; k < a->chunks.size(); ++k)
+                for_each_in_chunk<Ts...>(*a, k, func, c...);
+        }
+    }
+
+    /** Like for_each, but hands out the chunks to the threads of a
+     *  job_system.  The callback can change the values of the components
+     *  it is given, but it must not change the storage itself. */
+    template <typename... Ts, typename Func>
+    void parallel_for_each(job_system& jobs, typename id_for<Ts>::type... c,
+                           Func&& func)
+    {
+        component_mask mask;
+        for (auto i : {c...}) {
+            assert(i < components_.size());
+            mask.set(i);
+        }
+
+        std::vector<std::pair<archetype*, size_t>> work;
+        for (auto& a : archetypes_) {
+            if ((a->mask & mask) == mask) {
+                for (size_t k = 0; k < a->chunks.size(); ++k)
+                    work.emplace_back(a.get(), k);
+            }
+        }
+
+        jobs.parallel_for(work.size(), 1, [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; ++i)
+                for_each_in_chunk<Ts...>(*work[i].first, work[i].second, func,
+                                         c...);
+        });
+    }
+
+    /** Call a function for every chunk of entities that have a given
+     *  set of flat components.  The function gets the columns as plain
+     *  arrays, so a system can be written as a simple loop that the
+     *  compiler can vectorize:
+     * @code
+     * s.for_each_chunk<vec, vec>(pos, vel,
+     *     [](size_t n, const entity*, vec* p, vec* v) {
+     *     for (size_t i = 0; i < n; ++i)
+     *         p[i] += v[i];
+     * });
+     * @endcode
+     * @param c     The components to look for, one for every type in Ts.
+     * @param func  The function to call.  This function will be passed
+     *              the number of entities in the chunk, their IDs, and a
+     *              pointer to the first element of each column. */
+    template <typename... Ts, typename Func>
+    void for_each_chunk(typename id_for<Ts>::type... c, Func&& func)
+    {
+        static_assert(all_flat<Ts...>::value,
+                      "chunks can only be used with flat components");
+
+        component_mask mask;
+        for (auto i : {c...}) {
+            assert(i < components_.size());
+            mask.set(i);
+        }
+
+        for (auto& a : archetypes_) {
+            if ((a->mask & mask) != mask)
+                continue;
+
+            for (size_t k = 0; k < a->chunks.size(); ++k)
+                call_with_chunk<Ts...>(*a, k, func, c...);
+        }
+    }
+
+    /** Like for_each_chunk, but hands out the chunks to the threads of a
+     *  job_system. */
+    template <typename... Ts, typename Func>
+    void parallel_for_each_chunk(job_system& jobs,
+                                 typename id_for<Ts>::type... c, Func&& func)
+    {
+        static_assert(all_flat<Ts...>::value,
+                      "chunks can only be used with flat components");
+
+        component_mask mask;
+        for (auto i : {c...}) {
+            assert(i < components_.size());
+            mask.set(i);
+        }
+
+        std::vector<std::pair<archetype*, size_t>> work;
+        for (auto& a : archetypes_) {
+            if ((a->mask & mask) == mask) {
+                for (size_t k = 0; k < a->chunks.size(); ++k)
+                    work.emplace_back(a.get(), k);
+            }
+        }
+
+        jobs.parallel_for(work.size(), 1, [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; ++i)
+                call_with_chunk<Ts...>(*work[i].first, work[i].second, func,
+                                       c...);
+        });
+    }
+
+private:
+    /** Check if all types in a pack are flat. */
+    template <typename... Ts>
+    struct all_flat
+    {
+        static const bool value = true;
+    };
+
+    template <typename T, typename... Ts>
+    struct all_flat<T, Ts...>
+    {
+        static const bool value = is_flat<T>::value && all_flat<Ts...>::value;
+    };
+
+    template <typename... Ts, typename Func>
+    void call_with_chunk(archetype& a, size_t chunk, Func& func,
+                         typename id_for<Ts>::type... c)
+    {
+        char* base = a.chunks[chunk].get();
+        func(a.chunk_count(chunk), reinterpret_cast<const entity*>(base),
+             reinterpret_cast<Ts*>(base + a.columns[c])...);
+    }
+
+    /** Interpret a pointer to component data as a value. */
+    template <typename T>
+    static T& ref(char* ptr)
+    {
+        if (is_flat<T>::value)
+            return *reinterpret_cast<T*>(ptr);
+
+        return reinterpret_cast<holder<T>*>(ptr)->held();
+    }
+
+    /** Get the i'th element of a column. */
+    template <typename T>
+    static T& element(char* column, size_t i)
+    {
+        if (is_flat<T>::value)
+            return reinterpret_cast<T*>(column)[i];
+
+        return reinterpret_cast<holder<T>*>(column)[i].held();
+    }
+
+    template <typename... Ts, typename Func>
+    void for_each_in_chunk(archetype& a, size_t chunk, Func& func,
+                           typename id_for<Ts>::type... c)
+    {
+        char* base = a.chunks[chunk].get();
+        auto ids = reinterpret_cast<const entity*>(base);
+        for (size_t i = 0, n = a.chunk_count(chunk); i < n; ++i)
+            func(ids[i], element<Ts>(base + a.columns[c], i)...);
+    }
+
+    const location& find(entity en) const;
+
+    /** Get the archetype for a set of components, or create it if it
+     *  didn't exist yet. */
+    uint32_t find_archetype(const component_mask& mask);
+
+    char* cell(const archetype& a, size_t row, component_id c) const
+    {
+        return a.chunks[row / a.capacity].get() + a.columns[c]
+               + (row % a.capacity) * components_[c].size();
+    }
+
+    char* cell(const location& loc, component_id c) const
+    {
+        return cell(*archetypes_[loc.arch], loc.row, c);
+    }
+
+    entity& entity_at(archetype& a, size_t row)
+    {
+        return reinterpret_cast<entity*>(
+            a.chunks[row / a.capacity].get())[row % a.capacity];
+    }
+
+    /** Append a row to an archetype.  The component data is left
+     *  uninitialized. */
+    uint32_t add_row(archetype& a, entity en);
+
+    /** Remove a row from an archetype by moving the last row in its place.
+     *  The component data in the row must already have been destroyed or
+     *  moved elsewhere. */
+    void remove_row(archetype& a, uint32_t row);
+
+    /** Move an entity to the archetype for a new set of components.
+     *  Components that are not in the new set are destroyed, new
+     *  components are left uninitialized. */
+    void move_entity(entity en, const component_mask& mask);
+
+    /** Move a component value to uninitialized memory. */
+    void relocate(component_id c, char* from, char* to) const;
+
+    void destroy(component_id c, char* ptr) const;
+
+private:
+    /** The list of registered components. */
+    std::vector<component> components_;
+
+    /** All archetypes in use.  The first one is for entities without
+     *  any components. */
+    std::vector<std::unique_ptr<archetype>> archetypes_;
+
+    /** Look up archetypes by their component mask. */
+    std::unordered_map<component_mask, uint32_t> archetype_index_;
+
+    /** Mapping entity IDs to the location of their data. */
+    std::vector<location> locations_;
+
+    /** The number of entities. */
+    size_t size_;
+};
+
+} // namespace es
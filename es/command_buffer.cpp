@@ -0,0 +1,158 @@
+//---------------------------------------------------------------------------
+// es/command_buffer.cpp
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+
+#include "command_buffer.hpp"
+
+#include <algorithm>
+#include <numeric>
+
+namespace es
+{
+
+command_buffer::command_buffer(storage& data)
+    : data_(data)
+    , creates_(0)
+{
+}
+
+command_buffer::handle command_buffer::create()
+{
+    return handle(creates_++, true);
+}
+
+void command_buffer::delete_entity(handle en)
+{
+    commands_.push_back({delete_op, 0, en, 0});
+}
+
+void command_buffer::add_component(handle en, component_id c)
+{
+    assert(c < data_.components().size());
+    commands_.push_back({add_op, c, en, 0});
+}
+
+void command_buffer::remove_component(handle en, component_id c)
+{
+    assert(c < data_.components().size());
+    commands_.push_back({remove_op, c, en, 0});
+}
+
+void command_buffer::clear()
+{
+    commands_.clear();
+    creates_ = 0;
+    bytes_.clear();
+    objects_.clear();
+}
+
+void command_buffer::play_back()
+{
+    created_.clear();
+    created_.reserve(creates_);
+    for (uint32_t i = 0; i < creates_; ++i)
+        created_.push_back(data_.new_entity());
+
+    // Sort the commands by slot, so the storage is walked in order.  The
+    // sort is stable, so the commands for one entity keep their order.
+    std::vector<entity> targets(commands_.size());
+    for (size_t i = 0; i < commands_.size(); ++i)
+        targets[i] = resolve(commands_[i].target);
+
+    std::vector<uint32_t> order(commands_.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        auto x = targets[a], y = targets[b];
+        return entity_index(x) != entity_index(y)
+                   ? entity_index(x) < entity_index(y)
+                   : x < y;
+    });
+
+    for (size_t first = 0; first < order.size();) {
+        auto en = targets[order[first]];
+        size_t last = first + 1;
+        while (last < order.size() && targets[order[last]] == en)
+            ++last;
+
+        apply(en, order.data() + first, order.data() + last);
+        first = last;
+    }
+    clear();
+}
+
+void command_buffer::apply(entity en, const uint32_t* first,
+                           const uint32_t* last)
+{
+    if (!data_.exists(en))
+        return;
+
+    auto i = data_.find(en);
+    auto& e = i->second;
+
+    // Work out the final set of components, and which of them get a
+    // value from a set command.
+    auto mask = e.components;
+    component_mask values;
+    for (auto k = first; k != last; ++k) {
+        auto& cmd = commands_[*k];
+        switch (cmd.op) {
+        case delete_op:
+            data_.delete_entity(i);
+            return;
+        case add_op:
+            mask.set(cmd.c);
+            break;
+        case remove_op:
+            mask.reset(cmd.c);
+            values.reset(cmd.c);
+            break;
+        case set_op:
+            mask.set(cmd.c);
+            values.set(cmd.c);
+            break;
+        }
+    }
+
+    auto added = mask & ~e.components;
+    bool changed = mask != e.components;
+    if (changed)
+        data_.change_components(i, mask);
+
+    data_.construct_defaults(e, added & ~values);
+
+    // Only the last value that was set for a component counts.
+    auto todo = values;
+    for (auto k = last; k != first && todo.any();) {
+        auto& cmd = commands_[*--k];
+        if (cmd.op != set_op || !todo[cmd.c])
+            continue;
+
+        todo.reset(cmd.c);
+        auto& info = data_[cmd.c];
+        char* ptr = data_.component_data(entity_index(en), cmd.c);
+        if (info.is_flat()) {
+            // A new buffered component gets the value in every buffer.
+            auto size = info.value_size();
+            if (added[cmd.c]) {
+                for (size_t b = 0; b < info.size(); b += size)
+                    std::memcpy(ptr + b, &bytes_[cmd.value], size);
+            } else {
+                std::memcpy(ptr + data_.write_shift_[cmd.c],
+                            &bytes_[cmd.value], size);
+            }
+        } else {
+            if (!added[cmd.c])
+                info.destroy(ptr);
+
+            objects_[cmd.value]->move_to(ptr);
+        }
+    }
+
+    data_.mark_dirty(i, values | added);
+    if (changed)
+        data_.update_queries(i);
+}
+
+} // namespace es
@@ -0,0 +1,175 @@
+//---------------------------------------------------------------------------
+/// \file   es/command_buffer.hpp
+/// \brief  Records changes to a storage, to be applied later on
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "component.hpp"
+#include "entity.hpp"
+#include "storage.hpp"
+#include "traits.hpp"
+
+namespace es
+{
+/** Records entities that are created or deleted, and components that are
+ *  added, removed, or set, and applies them all in one go.
+ *
+ *  Changing which components an entity has is not safe inside a
+ *  for_each: it moves the entity's data around under the callback, and
+ *  it can't be done at all from parallel_for_each.  Record the changes
+ *  in a command buffer instead, and play it back once the loop is done.
+ *  Playing back groups the commands by entity, so every entity has its
+ *  data laid out only once, no matter how many components were added or
+ *  removed.
+ *
+ *  A command buffer must only be used by one thread at a time.  Give
+ *  every worker its own buffer, and play them back one after the other.
+ * @code
+ * command_buffer cmds(s);
+ * s.for_each<int>(hp, [&](storage::iterator i, int& h) {
+ *     if (h <= 0)
+ *         cmds.delete_entity(i->first);
+ * });
+ * cmds.play_back();
+ * @endcode */
+class command_buffer
+{
+    typedef component::placeholder placeholder;
+
+    template <typename T>
+    using holder = component::holder<T>;
+
+    template <typename T>
+    using shared_holder = component::shared_holder<T>;
+
+public:
+    typedef storage::component_id component_id;
+
+    /** Refers to the entity a command applies to: either one that
+     *  already exists, or one that will be made by create(). */
+    class handle
+    {
+        friend class command_buffer;
+
+    public:
+        handle(entity en)
+            : id_(en)
+            , pending_(false)
+        {
+        }
+
+    private:
+        handle(uint32_t index, bool pending)
+            : id_(index)
+            , pending_(pending)
+        {
+        }
+
+        uint32_t id_;
+        bool pending_;
+    };
+
+public:
+    explicit command_buffer(storage& data);
+
+    /** Create an entity when the buffer is played back.
+     * @return A handle that can be used in the commands that follow.  Once
+     *         the buffer has been played back, created() gives the ID of
+     *         the new entity. */
+    handle create();
+
+    /** Delete an entity.  Any later commands for it are ignored. */
+    void delete_entity(handle en);
+
+    /** Add a component with its default value, unless the entity has it
+     *  already. */
+    void add_component(handle en, component_id c);
+
+    void remove_component(handle en, component_id c);
+
+    /** Set a component value, adding the component if needed. */
+    template <typename T>
+    void set(handle en, component_id c, T val)
+    {
+        assert(c < data_.components().size());
+        assert(data_[c].is_of_type<T>());
+
+        size_t value;
+        if (data_.is_shared(c)) {
+            value = objects_.size();
+            objects_.emplace_back(new shared_holder<T>(std::move(val)));
+        } else if (is_flat<T>::value) {
+            value = bytes_.size();
+            bytes_.resize(value + sizeof(T));
+            std::memcpy(&bytes_[value], &val, sizeof(T));
+        } else {
+            value = objects_.size();
+            objects_.emplace_back(new holder<T>(std::move(val)));
+        }
+        commands_.push_back({set_op, c, en, value});
+    }
+
+    /** The number of commands that were recorded. */
+    size_t size() const { return commands_.size(); }
+
+    bool empty() const { return commands_.empty(); }
+
+    /** Forget all commands without applying them. */
+    void clear();
+
+    /** Apply all commands to the storage, and clear the buffer.  Commands
+     *  for entities that no longer exist are skipped. */
+    void play_back();
+
+    /** The ID of an entity made by create(), after the buffer was played
+     *  back. */
+    entity created(handle en) const
+    {
+        assert(en.pending_ && en.id_ < created_.size());
+        return created_[en.id_];
+    }
+
+private:
+    enum op_kind : uint8_t { delete_op, add_op, remove_op, set_op };
+
+    struct command
+    {
+        op_kind op;
+        component_id c;
+        handle target;
+        /** For set_op: the position in bytes_ of a flat value, or the
+         *  index in objects_ of a non-flat one. */
+        size_t value;
+    };
+
+    /** Apply the commands for one entity, in the order they were
+     *  recorded. */
+    void apply(entity en, const uint32_t* first, const uint32_t* last);
+
+    entity resolve(const handle& en) const
+    {
+        return en.pending_ ? created_[en.id_] : en.id_;
+    }
+
+private:
+    storage& data_;
+    std::vector<command> commands_;
+    /** The number of entities to create. */
+    uint32_t creates_;
+    /** The values of flat components. */
+    std::vector<char> bytes_;
+    /** The values of non-flat components. */
+    std::vector<std::unique_ptr<placeholder>> objects_;
+    /** The entities made by the last play back. */
+    std::vector<entity> created_;
+};
+
+} // namespace es
@@ -6,16 +6,88 @@
 //---------------------------------------------------------------------------
 #pragma once
 
+#include <atomic>
+#include <cassert>
+#include <cstring>
 #include <functional>
 #include <memory>
 #include <stdexcept>
 #include <string>
 #include <typeindex>
 #include <typeinfo>
+#include <vector>
+
+#include "component_mask.hpp"
+#include "reader.hpp"
+#include "traits.hpp"
 
 namespace es
 {
 class storage;
+class archetype_storage;
+class command_buffer;
+
+// Implement these two functions for any custom data types you want to
+// (de)serialize.  You can find an example in unit_tests.cpp.  To read
+// straight from memory without a copy, also implement the version of
+// deserialize that takes an es::reader.
+
+template <typename t>
+void serialize(const t&, std::vector<char>&)
+{
+    throw std::runtime_error(std::string("es::serialize not implemented for ")
+                             + typeid(t).name());
+}
+
+template <typename t>
+std::vector<char>::const_iterator
+deserialize(t&, std::vector<char>::const_iterator,
+            std::vector<char>::const_iterator)
+{
+    throw std::runtime_error(
+        std::string("es::deserialize not implemented for ")
+        + typeid(t).name());
+}
+
+template <typename t>
+void deserialize(t& obj, reader& in)
+{
+    auto first = in.vector_pos();
+    in.seek(deserialize(obj, first, in.vector_end()));
+}
+
+//---------------------------------------------------------------------------
+
+/** A component ID that also knows the type of the component.  The
+ *  storage hands these out when components are registered, and they
+ *  turn into a plain component_id wherever one is needed.  The get()
+ *  and set() overloads that take a handle don't have to check the type
+ *  at run time, and can deduce it.
+ * @code
+ * auto pos = s.register_component<vec>("position");
+ * s.set(en, pos, vec(1, 2));
+ * vec& p = s.get(en, pos);
+ * @endcode */
+template <typename T>
+class component_handle
+{
+public:
+    typedef T type;
+
+    explicit component_handle(component_id id)
+        : id_(id)
+    {
+    }
+
+    component_id id() const { return id_; }
+
+    operator component_id() const { return id_; }
+
+private:
+    component_id id_;
+};
+
+//---------------------------------------------------------------------------
 
 /** A component is a data type that can be assigned to entities.
  * For example, an entity could have a position and a velocity.  The position
@@ -25,8 +97,48 @@ class storage;
 class component
 {
     friend class storage;
+    friend class archetype_storage;
+    friend class command_buffer;
 
 protected:
+    /** How the values of a non-flat component are copied, moved, and
+     *  destroyed.  There is one table per type, so the storage can call
+     *  them directly instead of going through a placeholder's vtable. */
+    struct value_ops
+    {
+        /** Copy-construct a value in uninitialized memory. */
+        void (*copy)(char* to, const char* from);
+        /** Move-construct a value in uninitialized memory, and destroy
+         *  the original. */
+        void (*relocate)(char* to, char* from);
+        void (*destroy)(char* at);
+    };
+
+    /** The value_ops of a placeholder type. */
+    template <typename H>
+    struct ops_for
+    {
+        static void copy(char* to, const char* from)
+        {
+            new (to) H(*reinterpret_cast<const H*>(from));
+        }
+
+        static void relocate(char* to, char* from)
+        {
+            auto ptr = reinterpret_cast<H*>(from);
+            new (to) H(std::move(*ptr));
+            ptr->~H();
+        }
+
+        static void destroy(char* at) { reinterpret_cast<H*>(at)->~H(); }
+
+        static const value_ops& table()
+        {
+            static const value_ops result = {&copy, &relocate, &destroy};
+            return result;
+        }
+    };
+
     /** Placeholder for complex data types.
      *  Some data types don't have a fixed, flat memory layout.  This
      *  class defines an interface that can be used as a placeholder in
@@ -51,8 +163,206 @@ protected:
         deserialize(buffer_t::const_iterator first,
                     buffer_t::const_iterator last) = 0;
 
+        /** Deserialize straight from memory.  The reader is left at the
+         *  end of the parsed data. */
+        virtual void deserialize(reader& in) = 0;
+
         /** Move this placeholder to a different location in memory. */
-        virtual void move_to(buffer_t::iterator pos) = 0;
+        virtual void move_to(char* pos) = 0;
+
+        /** The functions that handle values of this type. */
+        virtual const value_ops& ops() const = 0;
+    };
+
+    /** Data types that do not have a flat memory layout are kept in the
+     *  entity's data buffer in a placeholder object. */
+    template <typename T>
+    class holder : public placeholder
+    {
+    public:
+        holder() {}
+
+        holder(T&& init)
+            : held_(std::move(init))
+        {
+        }
+
+        holder(const T& init)
+            : held_(init)
+        {
+        }
+
+        const T& held() const { return held_; }
+
+        T& held() { return held_; }
+
+        placeholder* clone() const { return new holder<T>(held_); }
+
+        void serialize(std::vector<char>& buffer) const
+        {
+            es::serialize(held(), buffer);
+        }
+
+        buffer_t::const_iterator deserialize(buffer_t::const_iterator first,
+                                             buffer_t::const_iterator last)
+        {
+            return es::deserialize(held(), first, last);
+        }
+
+        void deserialize(reader& in) { es::deserialize(held(), in); }
+
+        void move_to(char* pos)
+        {
+            auto ptr = reinterpret_cast<holder<T>*>(pos);
+            auto tmp = new (ptr) holder<T>(std::move(held_));
+            assert(tmp == ptr);
+            (void)tmp;
+        }
+
+        const value_ops& ops() const { return ops_for<holder<T>>::table(); }
+
+    private:
+        T held_;
+    };
+
+    /** Keeps a reference-counted value on the heap, for components that
+     *  are registered as storage::shared.  Copies of the holder share
+     *  the value, until one of them is written to: the non-const
+     *  accessors make a private copy first if the value is shared. */
+    template <typename T>
+    class shared_holder : public placeholder
+    {
+        typedef std::integral_constant<bool, is_flat<T>::value> flat;
+
+    public:
+        shared_holder()
+            : box_(new box(T()))
+        {
+        }
+
+        explicit shared_holder(T init)
+            : box_(new box(std::move(init)))
+        {
+        }
+
+        shared_holder(const shared_holder& copy)
+            : box_(copy.box_)
+        {
+            box_->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        shared_holder(shared_holder&& move)
+            : box_(move.box_)
+        {
+            move.box_ = nullptr;
+        }
+
+        shared_holder& operator=(const shared_holder&) = delete;
+
+        ~shared_holder() { release(); }
+
+        const T& held() const { return box_->value; }
+
+        T& held()
+        {
+            if (is_shared()) {
+                auto copy = new box(box_->value);
+                release();
+                box_ = copy;
+            }
+            return box_->value;
+        }
+
+        /** Replace the value, without copying the old one first. */
+        void assign(T val)
+        {
+            if (is_shared()) {
+                auto replacement = new box(std::move(val));
+                release();
+                box_ = replacement;
+            } else {
+                box_->value = std::move(val);
+            }
+        }
+
+        /** Check if other holders have the same value. */
+        bool is_shared() const
+        {
+            return box_->refs.load(std::memory_order_acquire) != 1;
+        }
+
+        placeholder* clone() const { return new shared_holder<T>(*this); }
+
+        void serialize(std::vector<char>& buffer) const
+        {
+            write(held(), buffer, flat());
+        }
+
+        buffer_t::const_iterator deserialize(buffer_t::const_iterator first,
+                                             buffer_t::const_iterator last)
+        {
+            size_t size = last - first;
+            const char* start = size ? &*first : nullptr;
+            reader in(start, size);
+            deserialize(in);
+            return first + (in.pos() - start);
+        }
+
+        void deserialize(reader& in)
+        {
+            read(held(), in, flat());
+        }
+
+        void move_to(char* pos) { new (pos) shared_holder<T>(std::move(*this)); }
+
+        const value_ops& ops() const
+        {
+            return ops_for<shared_holder<T>>::table();
+        }
+
+    private:
+        struct box
+        {
+            explicit box(T init)
+                : refs(1)
+                , value(std::move(init))
+            {
+            }
+
+            std::atomic<size_t> refs;
+            T value;
+        };
+
+        void release()
+        {
+            if (box_
+                && box_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                delete box_;
+        }
+
+        // Flat values don't need a serialize() of their own.
+        static void write(const T& val, buffer_t& buffer, std::true_type)
+        {
+            auto bytes = reinterpret_cast<const char*>(&val);
+            buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+        }
+
+        static void write(const T& val, buffer_t& buffer, std::false_type)
+        {
+            es::serialize(val, buffer);
+        }
+
+        static void read(T& val, reader& in, std::true_type)
+        {
+            in.read(&val, sizeof(T));
+        }
+
+        static void read(T& val, reader& in, std::false_type)
+        {
+            es::deserialize(val, in);
+        }
+
+        box* box_;
     };
 
 public:
@@ -64,21 +374,29 @@ public:
      * @param type     The typeid of the component's data.
      * @param ph       Simple types should pass a nullptr here.  Complex types
      *                 should pass a pointer to a placeholder instance of
-     *                 the correct type. */
+     *                 the correct type.
+     * @param buffers  The number of copies of the value every entity
+     *                 keeps, see storage::register_buffered_component.
+     *                 The size includes all of them. */
     component(std::string name, size_t size, const std::type_info& type,
-              std::unique_ptr<placeholder> ph)
+              std::unique_ptr<placeholder> ph, size_t buffers = 1)
         : name_(std::move(name))
         , size_(size)
+        , buffers_(buffers)
         , type_info_(type)
         , ph_(std::move(ph))
+        , ops_(ph_ ? &ph_->ops() : nullptr)
     {
+        assert(buffers_ > 0 && size_ % buffers_ == 0);
     }
 
     component(component&& m)
         : name_(std::move(m.name_))
         , size_(m.size_)
+        , buffers_(m.buffers_)
         , type_info_(m.type_info_)
         , ph_(std::move(m.ph_))
+        , ops_(m.ops_)
     {
         m.size_ = 0;
     }
@@ -88,8 +406,10 @@ public:
         if (&m != this) {
             name_ = std::move(m.name_);
             size_ = m.size_;
+            buffers_ = m.buffers_;
             type_info_ = m.type_info_;
             ph_ = std::move(m.ph_);
+            ops_ = m.ops_;
             m.size_ = 0;
         }
         return *this;
@@ -97,10 +417,50 @@ public:
 
     const std::string& name() const { return name_; }
 
+    /** The bytes this component takes up in an entity's data. */
     size_t size() const { return size_; }
 
+    /** The number of buffers, 1 if the component isn't buffered. */
+    size_t buffers() const { return buffers_; }
+
+    /** The size of a single value. */
+    size_t value_size() const { return size_ / buffers_; }
+
     bool is_flat() const { return ph_ == nullptr; }
 
+    /** Construct a default value in uninitialized memory.  Flat values
+     *  are left as they are. */
+    void construct(char* at) const
+    {
+        if (ops_)
+            ops_->copy(at, reinterpret_cast<const char*>(ph_.get()));
+    }
+
+    /** Copy a value to uninitialized memory. */
+    void copy(char* to, const char* from) const
+    {
+        if (ops_)
+            ops_->copy(to, from);
+        else
+            std::memcpy(to, from, size_);
+    }
+
+    /** Move a value to uninitialized memory.  The original is gone
+     *  afterwards; flat values are simply copied. */
+    void relocate(char* to, char* from) const
+    {
+        if (ops_)
+            ops_->relocate(to, from);
+        else
+            std::memcpy(to, from, size_);
+    }
+
+    void destroy(char* at) const
+    {
+        if (ops_)
+            ops_->destroy(at);
+    }
+
     bool operator==(const std::string& compare) const
     {
         return name_ == compare;
@@ -125,30 +485,11 @@ protected:
 private:
     std::string name_;
     size_t size_;
+    size_t buffers_;
     std::type_index type_info_;
     std::unique_ptr<placeholder> ph_;
+    /** Null for flat components. */
+    const value_ops* ops_;
 };
 
-//---------------------------------------------------------------------------
-
-// Implement these two functions for any custom data types you want to
-// (de)serialize.  You can find an example in unit_tests.cpp.
-
-template <typename t>
-void serialize(const t&, std::vector<char>&)
-{
-    throw std::runtime_error(std::string("es::serialize not implemented for ")
-                             + typeid(t).name());
-}
-
-template <typename t>
-std::vector<char>::const_iterator
-deserialize(t&, std::vector<char>::const_iterator,
-            std::vector<char>::const_iterator)
-{
-    throw std::runtime_error(
-        std::string("es::deserialize not implemented for ")
-        + typeid(t).name());
-}
-
 } // namespace es
@@ -0,0 +1,103 @@
+//---------------------------------------------------------------------------
+/// \file   es/component_mask.hpp
+/// \brief  The bitmask that tells which components an entity has
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+/** The maximum number of components a storage can hold.  This has to
+ *  be a multiple of 64, and the same for the library and everything that
+ *  uses it.  Masks of more than 64 bits are a little slower to work
+ *  with, so only raise it if you need to. */
+#ifndef ES_MAX_COMPONENTS
+#define ES_MAX_COMPONENTS 64
+#endif
+
+namespace es
+{
+static_assert(ES_MAX_COMPONENTS > 0 && ES_MAX_COMPONENTS % 64 == 0,
+              "ES_MAX_COMPONENTS must be a multiple of 64");
+
+static_assert(ES_MAX_COMPONENTS <= 65536, "too many components");
+
+const size_t max_components = ES_MAX_COMPONENTS;
+
+/** The number of 64-bit words in a component mask. */
+const size_t mask_words = max_components / 64;
+
+/** A set of components, with one bit for every component ID. */
+typedef std::bitset<max_components> component_mask;
+
+/** Identifies a registered component.  This is a single byte, unless
+ *  there can be more than 256 components. */
+typedef std::conditional<(max_components <= 256), uint8_t, uint16_t>::type
+    component_id;
+
+/** Get one 64-bit word of a mask.  With the default width this is just
+ *  to_ullong(). */
+inline uint64_t mask_word(const component_mask& mask, size_t word)
+{
+#if ES_MAX_COMPONENTS == 64
+    (void)word;
+    return mask.to_ullong();
+#else
+    return ((mask >> (word * 64)) & component_mask(~uint64_t(0)))
+        .to_ullong();
+#endif
+}
+
+/** Build a mask from its 64-bit words. */
+inline component_mask mask_from_words(const uint64_t* words)
+{
+#if ES_MAX_COMPONENTS == 64
+    return component_mask(words[0]);
+#else
+    component_mask result;
+    for (size_t i = mask_words; i-- > 0;) {
+        result <<= 64;
+        result |= component_mask(words[i]);
+    }
+    return result;
+#endif
+}
+
+/** The mask of all components with an ID below \a c. */
+inline component_mask mask_below(size_t c)
+{
+#if ES_MAX_COMPONENTS == 64
+    return component_mask((uint64_t(1) << c) - 1);
+#else
+    return c == 0 ? component_mask()
+                  : ~component_mask() >> (max_components - c);
+#endif
+}
+
+/** Check if a mask has all the bits of another one. */
+inline bool includes(const component_mask& mask, const component_mask& bits)
+{
+    return (mask & bits) == bits;
+}
+
+/** Check if two masks have any bits in common. */
+inline bool intersects(const component_mask& a, const component_mask& b)
+{
+    return (a & b).any();
+}
+
+/** A cheap hash of a mask.  Zero maps to zero. */
+inline uint64_t mask_hash(const component_mask& mask)
+{
+    uint64_t folded = mask_word(mask, 0);
+    for (size_t i = 1; i < mask_words; ++i)
+        folded ^= mask_word(mask, i) * (2 * i + 1);
+
+    return folded * 0x9e3779b97f4a7c15ULL;
+}
+
+} // namespace es
@@ -18,4 +18,34 @@ namespace es
  * This coupling is done in a \a storage object. */
 typedef uint32_t entity;
 
+/** The number of bits in an entity ID that are used as an index.
+ *  The remaining high bits hold a generation counter, which is incremented
+ *  every time an index is recycled.  This way a handle to an entity that
+ *  was deleted can be told apart from whatever re-used its index. */
+const int entity_index_bits = 24;
+
+/** Bitmask for the index part of an entity ID. */
+const uint32_t entity_index_mask = (uint32_t(1) << entity_index_bits) - 1;
+
+/** Bitmask for the generation part of an entity ID, after shifting. */
+const uint32_t entity_generation_mask = ~uint32_t(0) >> entity_index_bits;
+
+/** Get the index part of an entity ID. */
+inline uint32_t entity_index(entity en)
+{
+    return en & entity_index_mask;
+}
+
+/** Get the generation part of an entity ID. */
+inline uint32_t entity_generation(entity en)
+{
+    return en >> entity_index_bits;
+}
+
+/** Build an entity ID from an index and a generation. */
+inline entity make_entity(uint32_t index, uint32_t generation)
+{
+    return (generation << entity_index_bits) | (index & entity_index_mask);
+}
+
 } // namespace es
@@ -0,0 +1,145 @@
+//---------------------------------------------------------------------------
+/// \file   es/instrumentation.hpp
+/// \brief  Optional counters for finding out where the time goes
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/** Set to 1 to keep statistics on loops, systems, and memory use.  When
+ *  this is 0, the counters are never updated and the code that does so
+ *  isn't even compiled. */
+#ifndef ES_INSTRUMENTATION
+#define ES_INSTRUMENTATION 0
+#endif
+
+/** Only compiles its argument if instrumentation is enabled. */
+#if ES_INSTRUMENTATION
+#define ES_INSTRUMENT(...) __VA_ARGS__
+#else
+#define ES_INSTRUMENT(...)
+#endif
+
+namespace es
+{
+/** Statistics on a group of for_each loops. */
+struct loop_stats
+{
+    /** The number of loops that were run. */
+    uint64_t calls;
+    /** The number of slots that were looked at. */
+    uint64_t visited;
+    /** The number of entities the callback was called for. */
+    uint64_t matched;
+    /** The total time spent in the loops. */
+    uint64_t nanoseconds;
+};
+
+/** A snapshot of the counters of a storage, see storage::stats(). */
+struct storage_stats
+{
+    static const bool enabled = ES_INSTRUMENTATION != 0;
+
+    loop_stats for_each;
+    /** The number of times an entity's data was laid out again, because
+     *  components were added or removed. */
+    uint64_t relayouts;
+    /** The number of component bytes that were moved by relayouts. */
+    uint64_t bytes_moved;
+};
+
+/** How much memory a single component takes up. */
+struct component_footprint
+{
+    std::string name;
+    /** The number of entities that have the component. */
+    size_t entities;
+    /** The bytes used in the entity data.  Non-flat components can hold
+     *  more memory on the heap, this is not included. */
+    size_t bytes;
+};
+
+/** Where the memory of a storage goes, see storage::memory_stats().
+ *  Everything is in bytes, except for the counts.  Memory held on the
+ *  heap by non-flat components is not included. */
+struct memory_usage
+{
+    /** The number of entities, and the number of slots, including the
+     *  free ones. */
+    size_t entities;
+    size_t slots;
+    /** The slots themselves: the entity ID, the component mask, and the
+     *  header of the data buffer, which can hold a few bytes of data
+     *  inline. */
+    size_t slot_bytes;
+    /** The dirty flags and the list of changes. */
+    size_t change_bytes;
+    /** The lists of free slots, query members, observed slots, and the
+     *  order of the last compact(). */
+    size_t index_bytes;
+    /** The component data on the heap, including what the allocator
+     *  keeps for every block. */
+    size_t heap_bytes;
+    /** The part of \a heap_bytes that holds no component data. */
+    size_t slack_bytes;
+    /** The memory taken up by every component, see
+     *  storage::footprint(). */
+    std::vector<component_footprint> components;
+
+    /** The fixed cost of an entity, apart from its components. */
+    double overhead_per_entity() const
+    {
+        return entities ? double(slot_bytes + change_bytes + index_bytes
+                                 + slack_bytes) / entities
+                        : 0.0;
+    }
+};
+
+/** A counter that can be updated from several threads at once. */
+class stat_counter
+{
+public:
+    stat_counter()
+        : value_(0)
+    {
+    }
+
+    void add(uint64_t n) { value_.fetch_add(n, std::memory_order_relaxed); }
+
+    uint64_t get() const { return value_.load(std::memory_order_relaxed); }
+
+    void reset() { value_.store(0, std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value_;
+};
+
+/** Measures the time since it was created. */
+class stopwatch
+{
+public:
+    stopwatch()
+        : start_(clock::now())
+    {
+    }
+
+    uint64_t nanoseconds() const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   clock::now() - start_).count();
+    }
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    clock::time_point start_;
+};
+
+} // namespace es
@@ -0,0 +1,204 @@
+//---------------------------------------------------------------------------
+// es/job_system.cpp
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+
+#include "job_system.hpp"
+
+#include <iterator>
+
+namespace es
+{
+
+namespace
+{
+
+const size_t not_a_worker = ~size_t(0);
+
+// The pool and queue index of the current worker thread.
+thread_local job_system* current_system = nullptr;
+thread_local size_t current_index = not_a_worker;
+
+} // anonymous namespace
+
+job_system::job_system(size_t threads)
+    : queued_(0)
+    , next_queue_(0)
+    , stop_(false)
+{
+    if (threads == 0)
+        threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+
+    for (size_t i = 0; i < threads; ++i)
+        queues_.emplace_back(new queue);
+
+    for (size_t i = 0; i < threads; ++i)
+        workers_.emplace_back([this, i] { work(i); });
+}
+
+job_system::~job_system()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleep_lock_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+
+    for (auto& t : workers_)
+        t.join();
+}
+
+void job_system::submit(task t)
+{
+    push({std::move(t), nullptr});
+}
+
+void job_system::submit(task t, group& g)
+{
+    ++g.pending_;
+    push({std::move(t), &g});
+}
+
+void job_system::wait(group& g)
+{
+    size_t index = current_system == this ? current_index : not_a_worker;
+    while (!g.done()) {
+        entry e;
+        if (take(index, e, &g)) {
+            run(e);
+        } else if (index != not_a_worker) {
+            std::this_thread::yield();
+        } else {
+            // Nothing left to help with; tasks that are added to the
+            // group later go to the workers, so just wait for them.
+            std::unique_lock<std::mutex> lock(done_lock_);
+            done_.wait(lock, [&g] { return g.done(); });
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(error_lock_);
+        if (error_) {
+            auto error = error_;
+            error_ = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+    if (g.error_) {
+        auto error = g.error_;
+        g.error_ = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+void job_system::push(entry e)
+{
+    size_t index = current_system == this ? current_index
+                                          : next_queue_++ % queues_.size();
+    {
+        std::lock_guard<std::mutex> lock(queues_[index]->lock);
+        queues_[index]->tasks.push_back(std::move(e));
+    }
+    ++queued_;
+
+    // Taking the lock makes sure a worker that is about to go to sleep
+    // does not miss the notification.
+    { std::lock_guard<std::mutex> lock(sleep_lock_); }
+    wake_.notify_one();
+}
+
+bool job_system::take(size_t index, entry& e, group* only)
+{
+    if (index != not_a_worker) {
+        auto& own = *queues_[index];
+        std::lock_guard<std::mutex> lock(own.lock);
+        auto found = find(own.tasks, true, only);
+        if (found != own.tasks.end()) {
+            e = std::move(*found);
+            own.tasks.erase(found);
+            --queued_;
+            return true;
+        }
+    }
+
+    size_t start = index == not_a_worker ? 0 : index + 1;
+    for (size_t i = 0; i < queues_.size(); ++i) {
+        auto& victim = *queues_[(start + i) % queues_.size()];
+        std::lock_guard<std::mutex> lock(victim.lock);
+        auto found = find(victim.tasks, false, only);
+        if (found != victim.tasks.end()) {
+            e = std::move(*found);
+            victim.tasks.erase(found);
+            --queued_;
+            return true;
+        }
+    }
+    return false;
+}
+
+std::deque<job_system::entry>::iterator
+job_system::find(std::deque<entry>& tasks, bool from_back, group* only)
+{
+    if (tasks.empty())
+        return tasks.end();
+    if (only == nullptr)
+        return from_back ? tasks.end() - 1 : tasks.begin();
+
+    auto belongs = [only](const entry& e) { return e.owner == only; };
+    if (!from_back)
+        return std::find_if(tasks.begin(), tasks.end(), belongs);
+
+    auto found = std::find_if(tasks.rbegin(), tasks.rend(), belongs);
+    return found == tasks.rend() ? tasks.end() : std::next(found).base();
+}
+
+void job_system::run(entry& e)
+{
+    if (e.owner == nullptr) {
+        try {
+            e.func();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_lock_);
+            if (!error_)
+                error_ = std::current_exception();
+        }
+        return;
+    }
+
+    try {
+        e.func();
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(e.owner->error_lock_);
+        if (!e.owner->error_)
+            e.owner->error_ = std::current_exception();
+    }
+
+    // Taking the lock makes sure a waiter that is about to go to sleep
+    // does not miss the notification.
+    if (--e.owner->pending_ == 0) {
+        { std::lock_guard<std::mutex> lock(done_lock_); }
+        done_.notify_all();
+    }
+}
+
+void job_system::work(size_t index)
+{
+    current_system = this;
+    current_index = index;
+
+    for (;;) {
+        entry e;
+        if (take(index, e)) {
+            run(e);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_lock_);
+        wake_.wait(lock, [this] { return stop_ || queued_ > 0; });
+        if (stop_ && queued_ == 0)
+            return;
+    }
+}
+
+} // namespace es
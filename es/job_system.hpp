@@ -0,0 +1,160 @@
+//---------------------------------------------------------------------------
+/// \file   es/job_system.hpp
+/// \brief  A thread pool with a work-stealing scheduler
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace es
+{
+/** A pool of worker threads with a work-stealing scheduler.
+ * Every worker has its own queue of tasks.  Tasks that are submitted from
+ * a worker thread go to the back of its own queue, and the worker takes
+ * its work from the back as well, so related tasks tend to stay on the
+ * same core.  A worker that runs out of work steals from the front of the
+ * other queues.
+ *
+ * A thread that waits for a group of tasks helps out by running queued
+ * tasks of that group in the meantime, so it is safe to wait from within
+ * a task.  It never picks up unrelated tasks: the waiting task could
+ * hold locks, such as the storage locks a scheduler takes for a system,
+ * that those tasks would try to take again.
+ */
+class job_system
+{
+public:
+    typedef std::function<void()> task;
+
+    /** Keeps track of a number of tasks, so they can be waited for. */
+    class group
+    {
+        friend class job_system;
+
+    public:
+        group()
+            : pending_(0)
+        {
+        }
+
+        /** True if all tasks in this group have finished. */
+        bool done() const { return pending_ == 0; }
+
+    private:
+        std::atomic<size_t> pending_;
+        std::mutex error_lock_;
+        /** The first exception thrown by a task in this group. */
+        std::exception_ptr error_;
+    };
+
+public:
+    /** @param threads  The number of worker threads.  Zero means one
+     *                  thread for every hardware thread. */
+    explicit job_system(size_t threads = 0);
+
+    /** Runs the remaining tasks, and stops the worker threads. */
+    ~job_system();
+
+    job_system(const job_system&) = delete;
+    job_system& operator=(const job_system&) = delete;
+
+    /** The number of worker threads. */
+    size_t size() const { return workers_.size(); }
+
+    /** Queue a task.  If it throws, the exception is kept, and
+     *  rethrown by the next call to wait(), for any group. */
+    void submit(task t);
+
+    /** Queue a task as part of a group. */
+    void submit(task t, group& g);
+
+    /** Block until all tasks in a group have finished.  If one of the
+     *  tasks threw an exception, it is rethrown here.  A worker thread
+     *  helps out in the meantime; a thread outside the pool does the
+     *  same until the queues run dry, then it goes to sleep. */
+    void wait(group& g);
+
+    /** Call a function for consecutive ranges of [0, count) in parallel,
+     *  and wait until all of them are done.
+     * @param count       The size of the full range
+     * @param batch_size  The size of the ranges the work is split into
+     * @param func        Will be called as func(first, last) */
+    template <typename Func>
+    void parallel_for(size_t count, size_t batch_size, Func&& func)
+    {
+        batch_size = std::max<size_t>(batch_size, 1);
+
+        group g;
+        for (size_t first = 0; first < count; first += batch_size) {
+            size_t last = std::min(count, first + batch_size);
+            submit([&func, first, last] { func(first, last); }, g);
+        }
+        wait(g);
+    }
+
+private:
+    struct entry
+    {
+        task func;
+        group* owner;
+    };
+
+    struct queue
+    {
+        std::mutex lock;
+        std::deque<entry> tasks;
+    };
+
+    void push(entry e);
+
+    /** Take a task from the given queue, or steal one from another.
+     *  Pass an invalid index to only steal.
+     * @param only  If not null, only take tasks from this group */
+    bool take(size_t index, entry& e, group* only = nullptr);
+
+    /** Find the task to take from a queue, starting at the front or
+     *  the back. */
+    static std::deque<entry>::iterator find(std::deque<entry>& tasks,
+                                            bool from_back, group* only);
+
+    void run(entry& e);
+
+    void work(size_t index);
+
+private:
+    std::vector<std::unique_ptr<queue>> queues_;
+    std::vector<std::thread> workers_;
+
+    /** The number of tasks waiting in all queues. */
+    std::atomic<size_t> queued_;
+
+    /** Used to spread tasks submitted from outside the pool. */
+    std::atomic<size_t> next_queue_;
+
+    std::mutex sleep_lock_;
+    std::condition_variable wake_;
+    std::atomic<bool> stop_;
+
+    /** Signalled when the last task of a group finishes, for threads
+     *  outside the pool that wait for it. */
+    std::mutex done_lock_;
+    std::condition_variable done_;
+
+    /** The first exception thrown by a task that isn't in a group. */
+    std::mutex error_lock_;
+    std::exception_ptr error_;
+};
+
+} // namespace es
@@ -0,0 +1,124 @@
+//---------------------------------------------------------------------------
+/// \file   es/reader.hpp
+/// \brief  Reads serialized data straight from memory
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+namespace es
+{
+/** Reads serialized data from a range of memory, such as a network
+ *  buffer or a memory-mapped file, without copying it first.
+ *
+ *  Custom types can be read through es::deserialize(t&, reader&).  Types
+ *  that only implement the version for vector iterators still work: the
+ *  reader then copies the rest of its data into a vector, once, and
+ *  hands out iterators into that copy. */
+class reader
+{
+public:
+    typedef std::vector<char>::const_iterator vector_iterator;
+
+    reader(const char* data, size_t size)
+        : pos_(data)
+        , last_(data + size)
+        , base_(data)
+        , vector_(nullptr)
+    {
+    }
+
+    /** Read from a vector.  This never needs to make a copy. */
+    explicit reader(const std::vector<char>& buffer)
+        : pos_(buffer.data())
+        , last_(buffer.data() + buffer.size())
+        , base_(buffer.data())
+        , vector_(&buffer)
+    {
+    }
+
+    reader(const reader&) = delete;
+    reader& operator=(const reader&) = delete;
+
+    /** The current read position. */
+    const char* pos() const { return pos_; }
+
+    /** The end of the data. */
+    const char* end() const { return last_; }
+
+    size_t remaining() const { return last_ - pos_; }
+
+    bool empty() const { return pos_ == last_; }
+
+    /** Copy the next bytes.  Throws std::runtime_error if there is not
+     *  enough data left. */
+    void read(void* dest, size_t size) { std::memcpy(dest, take(size), size); }
+
+    /** Read a value of a flat type. */
+    template <typename T>
+    T read()
+    {
+        static_assert(std::is_trivial<T>::value, "only flat types");
+        T result;
+        read(&result, sizeof(T));
+        return result;
+    }
+
+    /** Skip the next bytes, and return a pointer to them. */
+    const char* take(size_t size)
+    {
+        if (size > remaining())
+            throw std::runtime_error("es::reader: missing data");
+
+        auto result = pos_;
+        pos_ += size;
+        return result;
+    }
+
+    /** The current position as an iterator into a vector with the same
+     *  data.  If the reader does not read from a vector, this is where
+     *  the copy is made. */
+    vector_iterator vector_pos()
+    {
+        if (vector_ == nullptr) {
+            copy_.assign(pos_, last_);
+            vector_ = &copy_;
+            base_ = pos_;
+        }
+        return vector_->begin() + (pos_ - base_);
+    }
+
+    vector_iterator vector_end()
+    {
+        vector_pos();
+        return vector_->end();
+    }
+
+    /** Continue reading from an iterator that was handed out by
+     *  vector_pos(). */
+    void seek(vector_iterator pos)
+    {
+        size_t offset = pos - vector_->begin();
+        if (offset > size_t(last_ - base_))
+            throw std::runtime_error("es::reader: missing data");
+
+        pos_ = base_ + offset;
+    }
+
+private:
+    const char* pos_;
+    const char* last_;
+    /** The position in memory that corresponds with the start of
+     *  \a vector_. */
+    const char* base_;
+    const std::vector<char>* vector_;
+    std::vector<char> copy_;
+};
+
+} // namespace es
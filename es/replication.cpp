@@ -0,0 +1,314 @@
+//---------------------------------------------------------------------------
+// es/replication.cpp
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+
+#include "replication.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace es
+{
+
+namespace
+{
+
+enum record_kind : uint8_t { update_record, create_record, delete_record };
+
+const uint8_t xor_flag = 1;
+
+const entity nobody = make_entity(entity_index_mask, 0);
+
+void missing_data()
+{
+    throw std::runtime_error("es::delta_decoder: missing data");
+}
+
+void write_number(std::vector<char>& buffer, uint64_t value)
+{
+    while (value >= 0x80) {
+        buffer.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    buffer.push_back(static_cast<char>(value));
+}
+
+uint64_t read_number(reader& in)
+{
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (in.empty())
+            missing_data();
+
+        auto byte = static_cast<uint8_t>(*in.take(1));
+        result |= uint64_t(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            return result;
+    }
+    throw std::runtime_error("es::delta_decoder: bad number");
+}
+
+/** Masks are written as one number per 64-bit word.  Wide masks start
+ *  with the number of words that follow, trailing zero words are left
+ *  out. */
+void write_mask(std::vector<char>& buffer, const component_mask& mask)
+{
+    size_t words = 1;
+    if (mask_words > 1) {
+        words = mask_words;
+        while (words > 0 && mask_word(mask, words - 1) == 0)
+            --words;
+
+        write_number(buffer, words);
+    }
+    for (size_t i = 0; i < words; ++i)
+        write_number(buffer, mask_word(mask, i));
+}
+
+component_mask read_mask(reader& in)
+{
+    size_t words = mask_words > 1 ? read_number(in) : 1;
+    if (words > mask_words)
+        throw std::runtime_error("es::delta_decoder: bad mask");
+
+    uint64_t result[mask_words] = {};
+    for (size_t i = 0; i < words; ++i)
+        result[i] = read_number(in);
+
+    return mask_from_words(result);
+}
+
+/** Write the XOR of two values, as alternating runs of zero bytes that
+ *  are left out, and bytes that are written. */
+void write_xor(std::vector<char>& buffer, const char* value,
+               const char* previous, size_t size)
+{
+    size_t i = 0;
+    while (i < size) {
+        size_t zeroes = i;
+        while (zeroes < size && value[zeroes] == previous[zeroes])
+            ++zeroes;
+
+        size_t bytes = zeroes;
+        while (bytes < size && value[bytes] != previous[bytes])
+            ++bytes;
+
+        write_number(buffer, zeroes - i);
+        write_number(buffer, bytes - zeroes);
+        for (size_t j = zeroes; j < bytes; ++j)
+            buffer.push_back(value[j] ^ previous[j]);
+
+        i = bytes;
+    }
+}
+
+void read_xor(reader& in, char* value, size_t size)
+{
+    size_t i = 0;
+    while (i < size) {
+        // Both numbers come from the wire, so check them one at a time;
+        // their sum could wrap around.  An empty run would never end.
+        auto skip = read_number(in);
+        auto bytes = read_number(in);
+        if (skip > size - i || bytes > size - i - skip
+            || (skip == 0 && bytes == 0))
+            throw std::runtime_error("es::delta_decoder: bad XOR run");
+
+        i += skip;
+        auto changes = in.take(bytes);
+        for (size_t j = 0; j < bytes; ++j)
+            value[i++] ^= changes[j];
+    }
+}
+
+} // anonymous namespace
+
+delta_encoder::delta_encoder(storage& data, bool use_xor)
+    : data_(data)
+    , use_xor_(use_xor)
+    , started_(false)
+{
+}
+
+void delta_encoder::encode(std::vector<char>& buffer)
+{
+    if (!data_.tracks_changes())
+        throw std::logic_error("es::delta_encoder: changes are not tracked");
+
+    buffer.push_back(use_xor_ ? xor_flag : 0);
+
+    // The first delta has to look at every slot, after that only the
+    // slots on the storage's list of changes can be different.
+    if (!started_) {
+        known_.resize(data_.entities_.size(), known{nobody, 0, {}});
+        for (size_t i = 0; i < known_.size(); ++i)
+            write_slot(buffer, i);
+
+        started_ = true;
+        return;
+    }
+
+    for (auto i : data_.changes_)
+        write_slot(buffer, i);
+}
+
+void delta_encoder::write_slot(std::vector<char>& buffer, size_t i)
+{
+    auto& slots = data_.entities_;
+    if (known_.size() <= i)
+        known_.resize(std::max(i + 1, slots.size()), known{nobody, 0, {}});
+
+    auto& k = known_[i];
+    bool live = i < slots.size() && storage::in_use(slots[i]);
+
+    if (k.id != nobody && (!live || k.id != slots[i].first)) {
+        write_number(buffer, k.id);
+        buffer.push_back(delete_record);
+        k = known{nobody, 0, {}};
+    }
+    if (!live)
+        return;
+
+    auto& s = slots[i];
+    auto& e = s.second;
+    if (k.id == nobody) {
+        write_number(buffer, s.first);
+        buffer.push_back(create_record);
+        k.id = s.first;
+        write_entity(buffer, k, i, e.components);
+    } else {
+        auto changed
+            = (data_.dirty_flags(i) | ~k.components) & e.components;
+        if (changed.none() && k.components == e.components)
+            return;
+
+        write_number(buffer, s.first);
+        buffer.push_back(update_record);
+        write_entity(buffer, k, i, changed);
+    }
+    data_.dirty_[i].reset();
+}
+
+void delta_encoder::reset()
+{
+    known_.clear();
+    started_ = false;
+}
+
+void delta_encoder::write_entity(std::vector<char>& buffer, known& k,
+                                 size_t index, const component_mask& mask)
+{
+    auto& e = data_.entities_[index].second;
+    write_mask(buffer, mask);
+    write_mask(buffer, k.components & ~e.components);
+
+    for (size_t c = 0; c < data_.components_.size(); ++c) {
+        if (!mask[c])
+            continue;
+
+        auto& info = data_.components_[c];
+        auto value = data_.component_data(index, c);
+        if (!info.is_flat()) {
+            reinterpret_cast<const storage::placeholder*>(value)
+                ->serialize(buffer);
+        } else if (use_xor_ && k.components[c] && !data_.is_sparse(c)
+                   && info.buffers() == 1) {
+            auto previous
+                = &k.data[data_.layout_size(k.components & mask_below(c))];
+            write_xor(buffer, value, previous, info.size());
+        } else {
+            buffer.resize(buffer.size() + info.size());
+            data_.write_buffers(c, value, &buffer[buffer.size() - info.size()]);
+        }
+    }
+
+    k.components = e.components;
+    if (use_xor_)
+        k.data.assign(e.data.begin(), e.data.end());
+}
+
+delta_decoder::delta_decoder(storage& data)
+    : data_(data)
+{
+}
+
+void delta_decoder::apply(const std::vector<char>& buffer)
+{
+    reader in(buffer);
+    apply(in);
+}
+
+void delta_decoder::apply(const char* data, size_t size)
+{
+    reader in(data, size);
+    apply(in);
+}
+
+void delta_decoder::apply(reader& in)
+{
+    if (in.empty())
+        return;
+
+    bool use_xor = (in.read<uint8_t>() & xor_flag) != 0;
+    auto& components = data_.components_;
+
+    while (!in.empty()) {
+        auto id = static_cast<entity>(read_number(in));
+        if (in.empty())
+            missing_data();
+
+        auto kind = in.read<uint8_t>();
+        if (kind == delete_record) {
+            data_.delete_entity(id);
+            continue;
+        }
+        if (kind != update_record && kind != create_record)
+            throw std::runtime_error("es::delta_decoder: bad record");
+
+        auto mask = read_mask(in);
+        auto removed = read_mask(in);
+        if (((mask | removed) >> components.size()).any())
+            throw std::runtime_error("es::delta_decoder: bad mask");
+
+        if (kind == update_record && !data_.exists(id))
+            throw std::runtime_error("es::delta_decoder: unknown entity");
+
+        auto en = kind == create_record ? data_.make(id) : data_.find(id);
+        auto& e = en->second;
+        auto before = e.components;
+        auto after = (before | mask) & ~removed;
+        if (after != before) {
+            data_.change_components(en, after);
+            data_.update_queries(en);
+        }
+
+        // New non-flat components need an object before they can be
+        // deserialized.
+        data_.construct_defaults(e, after & ~before);
+
+        for (size_t c = 0; c < components.size(); ++c) {
+            if (!mask[c])
+                continue;
+
+            // Sparse components are never sent as XOR, the encoder only
+            // keeps a copy of the packed data.  Neither are buffered
+            // ones; their buffers are sent in order, and every swap
+            // moves them all by one place.
+            auto& info = components[c];
+            auto value = data_.component_data(entity_index(en->first), c);
+            if (!info.is_flat()) {
+                reinterpret_cast<storage::placeholder*>(value)->deserialize(in);
+            } else if (use_xor && kind == update_record && before[c]
+                       && !data_.is_sparse(c) && info.buffers() == 1) {
+                read_xor(in, value, info.size());
+            } else {
+                data_.read_buffers(c, in.take(info.size()), value);
+            }
+        }
+        data_.mark_dirty(en, mask);
+    }
+}
+
+} // namespace es
@@ -0,0 +1,103 @@
+//---------------------------------------------------------------------------
+/// \file   es/replication.hpp
+/// \brief  Replicates the changes to a storage as compact deltas
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "component_mask.hpp"
+#include "entity.hpp"
+#include "storage.hpp"
+
+namespace es
+{
+/** Writes the changes to a storage since the last call as a delta.
+ *  The encoder is driven by the dirty flags: only entities that were
+ *  created, deleted, or have dirty components are written, and only
+ *  their dirty components are included.  The flags are cleared once
+ *  the entity has been written, so if several peers need the changes,
+ *  encode once and send the same delta to all of them.
+ *
+ *  After the first delta, only the entities on the storage's list of
+ *  changes are looked at, so call encode() before clear_changes().
+ *
+ *  A delta is a list of records.  Every record holds an entity ID, the
+ *  mask of the components that follow, the mask of the components that
+ *  were removed, and the component values.  Integers are written as
+ *  variable-length numbers.  Flat components are written as-is, or
+ *  XOR'd against the last value that was sent, with the runs of zero
+ *  bytes left out.  Non-flat components go through es::serialize.
+ *
+ *  Deltas have to be applied in order, and both sides must have the
+ *  same components registered in the same order. */
+class delta_encoder
+{
+public:
+    /** @param data     The storage to replicate
+     *  @param use_xor  XOR flat components against the previous value.
+     *                  This makes small changes to large components
+     *                  cheap, but the encoder has to keep a copy of
+     *                  the last values it sent. */
+    explicit delta_encoder(storage& data, bool use_xor = false);
+
+    /** Append the changes since the last call to a buffer.  The first
+     *  call writes all entities.  Throws std::logic_error if the storage
+     *  doesn't track changes. */
+    void encode(std::vector<char>& buffer);
+
+    /** Forget what was sent so far, so the next delta starts from
+     *  scratch.  Use this for a new peer, that only has an empty
+     *  storage. */
+    void reset();
+
+private:
+    /** What the other side knows about a slot. */
+    struct known
+    {
+        entity id;
+        component_mask components;
+        /** The entity data as it was sent, only used with XOR. */
+        std::vector<char> data;
+    };
+
+    void write_slot(std::vector<char>& buffer, size_t index);
+
+    void write_entity(std::vector<char>& buffer, known& k, size_t index,
+                      const component_mask& mask);
+
+private:
+    storage& data_;
+    bool use_xor_;
+    /** Set once the first delta, with all entities, was written. */
+    bool started_;
+    /** Indexed by slot. */
+    std::vector<known> known_;
+};
+
+/** Applies the deltas written by a delta_encoder to a storage.  New
+ *  entities keep their IDs, and the changed components are marked as
+ *  dirty. */
+class delta_decoder
+{
+public:
+    explicit delta_decoder(storage& data);
+
+    /** Apply a delta.  Throws std::runtime_error if the delta is
+     *  corrupt. */
+    void apply(const std::vector<char>& buffer);
+
+    /** Apply a delta straight from memory, such as a network buffer. */
+    void apply(const char* data, size_t size);
+
+private:
+    void apply(reader& in);
+
+private:
+    storage& data_;
+};
+
+} // namespace es
@@ -0,0 +1,74 @@
+//---------------------------------------------------------------------------
+/// \file   es/rw_lock.hpp
+/// \brief  A lock that can be shared by readers, or held by one writer
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+namespace es
+{
+/** A reader/writer lock.  Any number of threads can hold it for
+ *  reading, or a single thread for writing.  Writers take precedence:
+ *  once a writer is waiting, new readers have to wait as well, so a
+ *  steady stream of readers can't hold off the writer forever.
+ *
+ *  The lock is not recursive.  A thread that already holds it must not
+ *  try to take it again, not even for reading. */
+class rw_lock
+{
+public:
+    rw_lock()
+        : readers_(0)
+        , writers_waiting_(0)
+        , writing_(false)
+    {
+    }
+
+    rw_lock(const rw_lock&) = delete;
+    rw_lock& operator=(const rw_lock&) = delete;
+
+    void lock_shared()
+    {
+        std::unique_lock<std::mutex> guard(mutex_);
+        changed_.wait(guard,
+                      [this] { return !writing_ && writers_waiting_ == 0; });
+        ++readers_;
+    }
+
+    void unlock_shared()
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (--readers_ == 0)
+            changed_.notify_all();
+    }
+
+    void lock()
+    {
+        std::unique_lock<std::mutex> guard(mutex_);
+        ++writers_waiting_;
+        changed_.wait(guard, [this] { return !writing_ && readers_ == 0; });
+        --writers_waiting_;
+        writing_ = true;
+    }
+
+    void unlock()
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        writing_ = false;
+        changed_.notify_all();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    size_t readers_;
+    size_t writers_waiting_;
+    bool writing_;
+};
+
+} // namespace es
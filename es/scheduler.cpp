@@ -0,0 +1,94 @@
+//---------------------------------------------------------------------------
+// es/scheduler.cpp
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+
+#include "scheduler.hpp"
+
+namespace es
+{
+
+scheduler::scheduler(storage& data, job_system& jobs)
+    : data_(data)
+    , jobs_(jobs)
+    , changed_(false)
+{
+}
+
+size_t scheduler::add(system s)
+{
+    systems_.emplace_back(std::move(s));
+    stats_.push_back({0, 0});
+    changed_ = true;
+    return systems_.size() - 1;
+}
+
+void scheduler::reset_stats()
+{
+    for (auto& s : stats_)
+        s = {0, 0};
+}
+
+const std::vector<size_t>& scheduler::dependencies(size_t index)
+{
+    if (changed_)
+        build();
+
+    return dependencies_.at(index);
+}
+
+void scheduler::run()
+{
+    if (changed_)
+        build();
+
+    frame f;
+    f.remaining.reset(new std::atomic<size_t>[systems_.size()]);
+    for (size_t i = 0; i < systems_.size(); ++i)
+        f.remaining[i] = dependencies_[i].size();
+
+    for (size_t i = 0; i < systems_.size(); ++i) {
+        if (dependencies_[i].empty())
+            launch(f, i);
+    }
+    jobs_.wait(f.group);
+}
+
+void scheduler::build()
+{
+    size_t count = systems_.size();
+    dependencies_.assign(count, std::vector<size_t>());
+    dependents_.assign(count, std::vector<size_t>());
+
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t j = 0; j < i; ++j) {
+            if (systems_[i].conflicts_with(systems_[j])) {
+                dependencies_[i].push_back(j);
+                dependents_[j].push_back(i);
+            }
+        }
+    }
+    changed_ = false;
+}
+
+void scheduler::launch(frame& f, size_t index)
+{
+    jobs_.submit([this, &f, index] {
+        auto& sys = systems_[index];
+        ES_INSTRUMENT(stopwatch timer;)
+        {
+            auto guard = sys.exclusive ? data_.lock_structure()
+                                       : data_.lock(sys.reads, sys.writes);
+            sys.run(data_);
+        }
+        ES_INSTRUMENT(++stats_[index].runs;
+                      stats_[index].nanoseconds += timer.nanoseconds();)
+        for (auto next : dependents_[index]) {
+            if (--f.remaining[next] == 0)
+                launch(f, next);
+        }
+    }, f.group);
+}
+
+} // namespace es
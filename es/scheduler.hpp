@@ -0,0 +1,136 @@
+//---------------------------------------------------------------------------
+/// \file   es/scheduler.hpp
+/// \brief  Runs systems concurrently, based on the components they use
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "instrumentation.hpp"
+#include "job_system.hpp"
+#include "storage.hpp"
+
+namespace es
+{
+/** A system is a function that is run over a storage every frame.
+ *  It declares which components it reads and which ones it writes, so
+ *  the scheduler can tell which systems are safe to run at the same
+ *  time. */
+struct system
+{
+    typedef std::function<void(storage&)> function;
+
+    system(std::string name, std::initializer_list<storage::component_id> reads,
+           std::initializer_list<storage::component_id> writes, function run,
+           bool exclusive = false)
+        : name(std::move(name))
+        , run(std::move(run))
+        , exclusive(exclusive)
+    {
+        for (auto c : reads)
+            this->reads.set(c);
+        for (auto c : writes)
+            this->writes.set(c);
+    }
+
+    /** Two systems conflict if one of them writes a component that the
+     *  other one uses. */
+    bool conflicts_with(const system& other) const
+    {
+        return exclusive || other.exclusive
+               || (writes & (other.reads | other.writes)).any()
+               || (other.writes & reads).any();
+    }
+
+    std::string name;
+    /** The components this system only reads. */
+    component_mask reads;
+    /** The components this system changes. */
+    component_mask writes;
+    function run;
+    /** Exclusive systems never run at the same time as another system.
+     *  This is needed for systems that create or delete entities, or
+     *  add or remove components. */
+    bool exclusive;
+};
+
+/** The time spent in a system, see scheduler::stats(). */
+struct system_stats
+{
+    /** The number of times the system was run. */
+    uint64_t runs;
+    uint64_t nanoseconds;
+};
+
+/** Runs a list of systems once per frame, as concurrently as possible.
+ *  Systems that conflict with each other are run in the order they were
+ *  added; all other systems are free to run in parallel.  A system can
+ *  use the same job_system for a parallel_for_each of its own.
+ *
+ *  While a system runs, the scheduler holds the storage locks for the
+ *  components it declared (see storage::lock()), or the structure lock
+ *  if it is exclusive.  Other threads can safely use the storage at the
+ *  same time, as long as they lock it too.  A system must not take any
+ *  locks on the storage itself. */
+class scheduler
+{
+public:
+    scheduler(storage& data, job_system& jobs);
+
+    /** Add a system.
+     * @return The index of the system */
+    size_t add(system s);
+
+    const std::vector<system>& systems() const { return systems_; }
+
+    /** The systems that have to be finished before a given system can
+     *  start. */
+    const std::vector<size_t>& dependencies(size_t index);
+
+    /** Run every system once, and wait until all of them are done.  If a
+     *  system throws, the systems that depend on it are skipped and the
+     *  exception is rethrown here. */
+    void run();
+
+    /** How often every system ran, and how long it took, indexed like
+     *  systems().  This is only kept if the library was built with
+     *  ES_INSTRUMENTATION, otherwise it is always zero.  Don't call this
+     *  while run() is busy. */
+    const std::vector<system_stats>& stats() const { return stats_; }
+
+    void reset_stats();
+
+private:
+    struct frame
+    {
+        job_system::group group;
+        std::unique_ptr<std::atomic<size_t>[]> remaining;
+    };
+
+    void build();
+
+    void launch(frame& f, size_t index);
+
+private:
+    storage& data_;
+    job_system& jobs_;
+    std::vector<system> systems_;
+
+    /** For every system, the earlier systems it conflicts with. */
+    std::vector<std::vector<size_t>> dependencies_;
+    /** For every system, the later systems that conflict with it. */
+    std::vector<std::vector<size_t>> dependents_;
+    /** Set if the graph has to be rebuilt. */
+    bool changed_;
+    std::vector<system_stats> stats_;
+};
+
+} // namespace es
@@ -0,0 +1,240 @@
+//---------------------------------------------------------------------------
+/// \file   es/small_buffer.hpp
+/// \brief  A byte buffer that keeps small contents inline
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <utility>
+
+#include "allocator.hpp"
+
+namespace es
+{
+/** A byte buffer that keeps small contents inline.
+ *  It takes up as much space as a std::vector<char>, but up to
+ *  \a inline_capacity bytes are stored in the object itself instead of on
+ *  the heap.
+ *
+ *  The buffer knows nothing about what it holds, and will move its
+ *  contents bytewise when it grows, or when an inline buffer is moved.
+ *  This is only safe for flat data.  Anything else should be stored in a
+ *  buffer that was put on the heap from the start, and never outgrows its
+ *  capacity; moving such a buffer only moves a pointer.
+ *
+ *  Heap blocks can come from an es::allocator.  Every block remembers
+ *  the allocator it came from, so the buffer does not get any larger. */
+class small_buffer
+{
+public:
+    static const size_t inline_capacity = 16;
+
+    typedef char* iterator;
+    typedef const char* const_iterator;
+
+    small_buffer()
+        : storage_()
+        , size_(0)
+        , capacity_(inline_capacity)
+    {
+    }
+
+    /** Create a zero-filled buffer.
+     * @param size      The size of the buffer in bytes
+     * @param on_heap   Force the data to go on the heap
+     * @param alloc     The allocator for the heap, or nullptr for malloc */
+    explicit small_buffer(size_t size, bool on_heap = false,
+                          allocator* alloc = nullptr)
+        : storage_()
+        , size_(0)
+        , capacity_(inline_capacity)
+    {
+        reserve(size, on_heap, alloc);
+        resize(size);
+    }
+
+    small_buffer(const small_buffer& copy)
+        : storage_()
+        , size_(0)
+        , capacity_(inline_capacity)
+    {
+        reserve(copy.size_, !copy.is_inline(), copy.get_allocator());
+        std::memcpy(data(), copy.data(), copy.size_);
+        size_ = copy.size_;
+    }
+
+    small_buffer(small_buffer&& move) noexcept
+        : storage_()
+        , size_(0)
+        , capacity_(inline_capacity)
+    {
+        swap(move);
+    }
+
+    ~small_buffer()
+    {
+        if (!is_inline())
+            free_heap();
+    }
+
+    small_buffer& operator=(small_buffer copy)
+    {
+        swap(copy);
+        return *this;
+    }
+
+    void swap(small_buffer& other) noexcept
+    {
+        std::swap(storage_, other.storage_);
+        std::swap(size_, other.size_);
+        std::swap(capacity_, other.capacity_);
+    }
+
+    size_t size() const { return size_; }
+
+    size_t capacity() const { return capacity_; }
+
+    bool empty() const { return size_ == 0; }
+
+    /** True if the data is stored in the object itself. */
+    bool is_inline() const { return capacity_ == inline_capacity; }
+
+    /** The bytes taken from the allocator for the heap block, or 0 for
+     *  inline data. */
+    size_t heap_bytes() const
+    {
+        return is_inline() ? 0 : capacity_ + header_size;
+    }
+
+    /** The allocator the heap block came from.  This is nullptr for
+     *  inline data, and for blocks that came from malloc. */
+    allocator* get_allocator() const
+    {
+        return is_inline() ? nullptr : header(storage_.heap);
+    }
+
+    char* data() { return is_inline() ? storage_.local : storage_.heap; }
+
+    const char* data() const
+    {
+        return is_inline() ? storage_.local : storage_.heap;
+    }
+
+    iterator begin() { return data(); }
+
+    iterator end() { return data() + size_; }
+
+    const_iterator begin() const { return data(); }
+
+    const_iterator end() const { return data() + size_; }
+
+    char& operator[](size_t i) { return data()[i]; }
+
+    const char& operator[](size_t i) const { return data()[i]; }
+
+    /** Make room for at least a given number of bytes.
+     * @param capacity  The number of bytes
+     * @param on_heap   Move the data to the heap, even if it would fit in
+     *                  the object itself
+     * @param alloc     The allocator for the new block.  If this is
+     *                  nullptr, a buffer that is already on the heap sticks
+     *                  to its own allocator, and an inline buffer uses
+     *                  malloc. */
+    void reserve(size_t capacity, bool on_heap = false,
+                 allocator* alloc = nullptr)
+    {
+        if (capacity <= capacity_ && (!on_heap || !is_inline()))
+            return;
+
+        // Always stay clear of the inline capacity, so is_inline() can
+        // tell the two apart.
+        if (capacity <= inline_capacity)
+            capacity = inline_capacity + 1;
+
+        if (alloc == nullptr)
+            alloc = get_allocator();
+
+        auto ptr = allocate_heap(alloc, capacity);
+        std::memcpy(ptr, data(), size_);
+        if (!is_inline())
+            free_heap();
+
+        storage_.heap = ptr;
+        capacity_ = static_cast<uint32_t>(capacity);
+    }
+
+    /** Change the size, filling any new bytes with zeroes. */
+    void resize(size_t size)
+    {
+        if (size > capacity_)
+            reserve(std::max<size_t>(size, capacity_ * 2));
+
+        if (size > size_)
+            std::memset(data() + size_, 0, size - size_);
+
+        size_ = static_cast<uint32_t>(size);
+    }
+
+    template <typename InputIt>
+    void append(InputIt first, InputIt last)
+    {
+        size_t count = std::distance(first, last);
+        size_t off = size_;
+        resize(size_ + count);
+        std::copy(first, last, data() + off);
+    }
+
+    void clear() { size_ = 0; }
+
+private:
+    /** Heap blocks start with a pointer to their allocator. */
+    static const size_t header_size = sizeof(allocator*);
+
+    static allocator*& header(char* heap)
+    {
+        return *reinterpret_cast<allocator**>(heap - header_size);
+    }
+
+    static char* allocate_heap(allocator* alloc, size_t capacity)
+    {
+        size_t bytes = capacity + header_size;
+        auto block = static_cast<char*>(alloc ? alloc->allocate(bytes)
+                                              : std::malloc(bytes));
+        if (block == nullptr)
+            throw std::bad_alloc();
+
+        auto result = block + header_size;
+        header(result) = alloc;
+        return result;
+    }
+
+    void free_heap()
+    {
+        auto alloc = header(storage_.heap);
+        auto block = storage_.heap - header_size;
+        if (alloc)
+            alloc->deallocate(block, capacity_ + header_size);
+        else
+            std::free(block);
+    }
+
+private:
+    union
+    {
+        char* heap;
+        char local[inline_capacity];
+    } storage_;
+
+    uint32_t size_;
+    uint32_t capacity_;
+};
+
+} // namespace es
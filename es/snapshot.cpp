@@ -0,0 +1,96 @@
+//---------------------------------------------------------------------------
+// es/snapshot.cpp
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+
+#include "snapshot.hpp"
+
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+namespace es
+{
+
+snapshot_view::snapshot_view(const char* data, size_t size)
+{
+    assert(reinterpret_cast<uintptr_t>(data) % alignment == 0);
+
+    auto fail = [] {
+        throw std::runtime_error("es::snapshot_view: invalid snapshot");
+    };
+
+    snapshot_header head;
+    if (size < sizeof(head))
+        fail();
+
+    std::memcpy(&head, data, sizeof(head));
+    if (std::memcmp(head.magic, magic(), sizeof(head.magic)) != 0
+        || head.version != version || head.mask_words == 0)
+        fail();
+
+    slot_count_ = head.slot_count;
+    mask_words_ = head.mask_words;
+    entity_count_ = head.entity_count;
+
+    size_t pos = align(sizeof(head));
+    for (uint32_t i = 0; i < head.component_count; ++i) {
+        snapshot_component info;
+        if (pos + sizeof(info) > size)
+            fail();
+
+        std::memcpy(&info, data + pos, sizeof(info));
+        pos += sizeof(info);
+        if (pos + info.name_size > size || info.offset > size
+            || info.bytes > size - info.offset)
+            fail();
+
+        column col;
+        col.name.assign(data + pos, info.name_size);
+        col.size = info.size;
+        col.flat = info.flat != 0;
+        col.type_hash = info.type_hash;
+        col.count = info.count;
+        col.data = data + info.offset;
+        col.bytes = info.bytes;
+        if (col.flat && col.bytes != col.count * col.size)
+            fail();
+
+        columns_.emplace_back(std::move(col));
+        pos = align(pos + info.name_size);
+    }
+
+    size_t slots_size = slot_count_ * sizeof(entity);
+    size_t masks_size = slot_count_ * mask_words_ * sizeof(uint64_t);
+    if (pos + slots_size > size
+        || align(pos + slots_size) + masks_size > size)
+        fail();
+
+    slots_ = reinterpret_cast<const entity*>(data + pos);
+    pos = align(pos + slots_size);
+    masks_ = reinterpret_cast<const uint64_t*>(data + pos);
+}
+
+const snapshot_view::column*
+snapshot_view::find(const std::string& name) const
+{
+    for (auto& col : columns_) {
+        if (col.name == name)
+            return &col;
+    }
+    return nullptr;
+}
+
+uint64_t snapshot_view::type_hash(const char* name)
+{
+    // 64-bit FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (; *name; ++name) {
+        hash ^= static_cast<unsigned char>(*name);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+} // namespace es
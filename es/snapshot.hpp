@@ -0,0 +1,144 @@
+//---------------------------------------------------------------------------
+/// \file   es/snapshot.hpp
+/// \brief  The file format for snapshots of a whole storage
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "entity.hpp"
+
+namespace es
+{
+/** The header at the start of every snapshot.
+ *
+ * A snapshot is laid out as follows, with every part aligned to 16
+ * bytes:
+ * - The header
+ * - A snapshot_component for every component, followed by its name
+ * - The entity ID of every slot in the storage, free or not
+ * - The component mask of every slot
+ * - A column for every component.  Flat components are stored as an
+ *   array, with an element for every entity that has the component, in
+ *   slot order.  Non-flat components are stored as es::serialize wrote
+ *   them, for the same entities.
+ *
+ * All numbers are stored in the byte order of the machine that wrote the
+ * snapshot.  A snapshot can be memory mapped, and read as-is with a
+ * snapshot_view. */
+struct snapshot_header
+{
+    char magic[8];
+    uint32_t version;
+    /** The number of 64-bit words in a component mask. */
+    uint32_t mask_words;
+    uint32_t component_count;
+    uint32_t slot_count;
+    uint64_t entity_count;
+};
+
+/** Describes one component in a snapshot. */
+struct snapshot_component
+{
+    uint32_t name_size;
+    uint32_t size;
+    uint32_t flat;
+    uint32_t reserved;
+    /** A hash of the type's name, to catch mismatched registrations. */
+    uint64_t type_hash;
+    /** The number of entities that have this component. */
+    uint64_t count;
+    /** The position of the column, from the start of the snapshot. */
+    uint64_t offset;
+    /** The size of the column in bytes. */
+    uint64_t bytes;
+};
+
+static_assert(sizeof(snapshot_header) == 32, "unexpected padding");
+static_assert(sizeof(snapshot_component) == 48, "unexpected padding");
+
+/** A read-only view on a snapshot in memory.  Nothing is copied; the
+ *  snapshot has to stay around as long as the view is used.  The data
+ *  must be aligned to 16 bytes, as memory from mmap or malloc is. */
+class snapshot_view
+{
+public:
+    static const uint32_t version = 1;
+    static const size_t alignment = 16;
+
+    struct column
+    {
+        std::string name;
+        size_t size;
+        bool flat;
+        uint64_t type_hash;
+        /** The number of entities that have this component. */
+        size_t count;
+        const char* data;
+        size_t bytes;
+
+        /** The component values, only for flat components.  A
+         *  buffered component has all of its buffers in every value:
+         *  next, current, then the older ones. */
+        template <typename T>
+        const T* as() const
+        {
+            return reinterpret_cast<const T*>(data);
+        }
+    };
+
+public:
+    /** Check and index a snapshot.  Throws std::runtime_error if the
+     *  data is not a valid snapshot. */
+    snapshot_view(const char* data, size_t size);
+
+    /** The number of slots, including the free ones. */
+    size_t slot_count() const { return slot_count_; }
+
+    /** The number of entities in use. */
+    size_t entity_count() const { return entity_count_; }
+
+    /** The entity IDs of all slots.  Free slots have the index bits set
+     *  to entity_index_mask. */
+    const entity* slots() const { return slots_; }
+
+    /** The number of 64-bit words in every mask. */
+    size_t mask_words() const { return mask_words_; }
+
+    /** The component mask of all slots, as \a mask_words() words per
+     *  slot, lowest word first. */
+    const uint64_t* masks() const { return masks_; }
+
+    const std::vector<column>& columns() const { return columns_; }
+
+    /** Find a column by component name.
+     * @return The column, or nullptr if there is none */
+    const column* find(const std::string& name) const;
+
+    /** A stable hash of a type name. */
+    static uint64_t type_hash(const char* name);
+
+    /** Round a position up to the alignment of the parts. */
+    static size_t align(size_t pos)
+    {
+        return (pos + alignment - 1) & ~(alignment - 1);
+    }
+
+    /** The magic bytes at the start of every snapshot. */
+    static const char* magic() { return "es-snap"; }
+
+private:
+    size_t slot_count_;
+    size_t entity_count_;
+    size_t mask_words_;
+    const entity* slots_;
+    const uint64_t* masks_;
+    std::vector<column> columns_;
+};
+
+} // namespace es
@@ -0,0 +1,118 @@
+//---------------------------------------------------------------------------
+/// \file   es/sparse_set.hpp
+/// \brief  Component values kept apart from the entity data
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace es
+{
+/** Flat values of a fixed size, keyed by entity slot.  Every value has a
+ *  spot in a dense array; a sparse array maps slots to that spot.
+ *  Adding and removing a value takes constant time, and walking over all
+ *  values only touches the ones that are in use.  The order of the values
+ *  changes when one is removed: the last value takes its place.
+ *
+ *  Pointers to the values stay valid until the next insert or erase. */
+class sparse_set
+{
+public:
+    explicit sparse_set(size_t value_size)
+        : value_size_(value_size)
+    {
+    }
+
+    size_t value_size() const { return value_size_; }
+
+    /** The number of values. */
+    size_t size() const { return dense_.size(); }
+
+    bool empty() const { return dense_.empty(); }
+
+    bool contains(size_t slot) const
+    {
+        return slot < sparse_.size() && sparse_[slot] != none;
+    }
+
+    /** The value for a slot, or null if it doesn't have one. */
+    char* find(size_t slot)
+    {
+        return contains(slot) ? value(sparse_[slot]) : nullptr;
+    }
+
+    const char* find(size_t slot) const
+    {
+        return contains(slot) ? value(sparse_[slot]) : nullptr;
+    }
+
+    /** Add a zero-filled value for a slot that doesn't have one yet. */
+    char* insert(size_t slot)
+    {
+        assert(!contains(slot));
+        if (slot >= sparse_.size())
+            sparse_.resize(slot + 1, uint32_t(none));
+
+        sparse_[slot] = static_cast<uint32_t>(dense_.size());
+        dense_.push_back(static_cast<uint32_t>(slot));
+        values_.resize(values_.size() + value_size_, 0);
+        return value(dense_.size() - 1);
+    }
+
+    /** Remove the value of a slot, if it has one. */
+    void erase(size_t slot)
+    {
+        if (!contains(slot))
+            return;
+
+        uint32_t pos = sparse_[slot];
+        uint32_t last = static_cast<uint32_t>(dense_.size() - 1);
+        if (pos != last) {
+            std::memcpy(value(pos), value(last), value_size_);
+            dense_[pos] = dense_[last];
+            sparse_[dense_[pos]] = pos;
+        }
+        sparse_[slot] = none;
+        dense_.pop_back();
+        values_.resize(values_.size() - value_size_);
+    }
+
+    void clear()
+    {
+        sparse_.clear();
+        dense_.clear();
+        values_.clear();
+    }
+
+    /** The slots that have a value, in the same order as the values. */
+    const std::vector<uint32_t>& slots() const { return dense_; }
+
+    /** The value at a position in the dense array. */
+    char* value(size_t pos) { return &values_[pos * value_size_]; }
+
+    const char* value(size_t pos) const { return &values_[pos * value_size_]; }
+
+    /** The bytes in use, for memory statistics. */
+    size_t capacity_bytes() const
+    {
+        return sparse_.capacity() * sizeof(uint32_t)
+               + dense_.capacity() * sizeof(uint32_t) + values_.capacity();
+    }
+
+private:
+    static const uint32_t none = ~uint32_t(0);
+
+    size_t value_size_;
+    /** The position of every slot's value in \a dense_, or \a none. */
+    std::vector<uint32_t> sparse_;
+    /** The slot every value belongs to. */
+    std::vector<uint32_t> dense_;
+    std::vector<char> values_;
+};
+
+} // namespace es
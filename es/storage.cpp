@@ -6,119 +6,220 @@
 
 #include "storage.hpp"
 
+#include <cstring>
+
+#include "snapshot.hpp"
+
 namespace es
 {
 
-storage::storage()
-    : next_id_(0)
-    , component_offsets_(8 * 256)
+const uint32_t storage::query_data::gone;
+const size_t storage::absent;
+
+storage::storage(allocator* alloc)
+    : alloc_(alloc)
+    , size_(0)
+    , tracking_(true)
+    , shared_(0)
+    , component_offsets_(max_components / 8 * 256)
 {
     std::fill(component_offsets_.begin(), component_offsets_.end(), 0);
 }
 
 storage::~storage()
 {
-    for (auto i = entities_.begin(); i != entities_.end(); ++i)
-        call_destructors(i);
+    for (auto i = begin(); i != end(); ++i)
+        call_destructors(i->second);
 }
 
 storage::component_id storage::find_component(const std::string& name) const
 {
-    auto found = std::find(components_.begin(), components_.end(), name);
-    if (found == components_.end())
+    auto found = names_.find(name);
+    if (found == names_.end())
         throw std::logic_error("component does not exist");
 
-    return std::distance(components_.begin(), found);
+    return found->second;
 }
 
 entity storage::new_entity()
 {
-    auto result = entities_.insert(std::make_pair(next_id_, elem())).first;
+    auto result = acquire_slot();
     if (on_new_entity)
         on_new_entity(result);
 
-    ++next_id_;
-    return next_id_ - 1;
+    return result->first;
 }
 
 storage::iterator storage::make(uint32_t id)
 {
-    if (next_id_ <= id)
-        next_id_ = id + 1;
+    auto index = entity_index(id);
+    if (index == free_slot)
+        throw std::logic_error("invalid entity");
+
+    while (entities_.size() <= index) {
+        free_slots_.push_back(entities_.size());
+        add_slot(make_entity(free_slot, 0));
+    }
+
+    auto& found = entities_[index];
+    if (found.first == id)
+        return iterator(&entities_, index);
 
-    auto result = entities_.insert(std::make_pair(id, elem()));
-    if (result.second && on_new_entity)
-        on_new_entity(result.first);
+    if (in_use(found))
+        throw std::logic_error("entity index is in use");
 
-    return result.first;
+    auto result = acquire_slot(index, entity_generation(id));
+    if (on_new_entity)
+        on_new_entity(result);
+
+    return result;
 }
 
 std::pair<entity, entity> storage::new_entities(size_t count)
 {
-    auto range_begin = next_id_;
-    for (; count > 0; --count)
-        entities_[next_id_++];
+    // The new entities always go at the end, so they form a range.
+    entity range_begin = entities_.size();
+    entities_.reserve(entities_.size() + count);
+    for (; count > 0; --count) {
+        auto en = acquire_slot(entities_.size(), 0);
+        if (on_new_entity)
+            on_new_entity(en);
+    }
 
-    return {range_begin, next_id_};
+    return {range_begin, entity(entities_.size())};
+}
+
+std::pair<entity, entity> storage::new_entities(size_t count,
+                                                const prototype& proto)
+{
+    assert(&proto.owner_ == this);
+    const elem& p = proto.data_;
+
+    // Find the non-flat components, these need a proper copy.
+    std::vector<std::pair<size_t, const component*>> deep_copies;
+    if ((p.components & flat_mask_).any()) {
+        size_t off = 0;
+        for (size_t c = 0; c < components_.size(); ++c) {
+            if (!p.components[c])
+                continue;
+
+            if (!components_[c].is_flat())
+                deep_copies.emplace_back(off, &components_[c]);
+
+            off += components_[c].size();
+        }
+    }
+
+    entity range_begin = entities_.size();
+    entities_.reserve(entities_.size() + count);
+    for (; count > 0; --count) {
+        auto en = acquire_slot(entities_.size(), 0);
+        elem& e = en->second;
+        e.data = p.data;
+        for (auto& d : deep_copies)
+            d.second->copy(&e.data[d.first], &p.data[d.first]);
+
+        e.components = p.components;
+        set_dirty(en.pos_, p.components);
+        update_queries(en);
+        if (on_new_entity)
+            on_new_entity(en);
+    }
+
+    return {range_begin, entity(entities_.size())};
 }
 
 entity storage::clone_entity(iterator f)
 {
-    auto cloned = entities_.insert(std::make_pair(next_id_, f->second)).first;
+    auto cloned = acquire_slot();
+    cloned->second = f->second;
     elem& e(cloned->second);
 
     // Quick check if we need to make deep copies
     if ((e.components & flat_mask_).any()) {
         size_t off = 0;
-        for (int c_id = 0; c_id < 64 && off < e.data.size(); ++c_id) {
-            if (e.components[c_id]) {
+        for (size_t c_id = 0; c_id < components_.size() && off < e.data.size();
+             ++c_id) {
+            if (e.components[c_id] && !is_sparse(c_id)) {
                 if (!components_[c_id].is_flat()) {
-                    auto ptr = reinterpret_cast<placeholder*>(&*e.data.begin()
-                                                              + off);
-                    ptr->clone()->move_to(e.data.begin() + off);
+                    // The bytewise copy still points at the original's
+                    // data, so copy-construct over it in place.
+                    components_[c_id].copy(&e.data[off],
+                                           &f->second.data[off]);
                 }
                 off += components_[c_id].size();
             }
         }
     }
+    if (intersects(e.components, sparse_mask_)) {
+        for (size_t c = 0; c < components_.size(); ++c) {
+            if (!e.components[c] || !is_sparse(c))
+                continue;
+
+            auto& set = *sparse_[c];
+            auto to = set.insert(cloned.pos_);
+            std::memcpy(to, set.find(f.pos_), set.value_size());
+        }
+    }
+    update_queries(cloned);
     if (on_new_entity)
         on_new_entity(cloned);
 
-    ++next_id_;
-    return next_id_ - 1;
+    return cloned->first;
 }
 
 storage::iterator storage::find(entity en)
 {
-    auto found = entities_.find(en);
-    if (found == entities_.end())
+    if (!exists(en))
         throw std::logic_error("unknown entity");
 
-    return found;
+    return iterator(&entities_, entity_index(en));
 }
 
 storage::const_iterator storage::find(entity en) const
 {
-    auto found = entities_.find(en);
-    if (found == entities_.end())
+    if (!exists(en))
         throw std::logic_error("unknown entity");
 
-    return found;
+    return const_iterator(&entities_, entity_index(en));
 }
 
 size_t storage::size() const
 {
-    return entities_.size();
+    return size_;
 }
 
-bool storage::delete_entity(entity en)
+void storage::clear()
 {
-    auto found = find(en);
-    if (found != entities_.end()) {
-        delete_entity(found);
-        return true;
+    for (auto& set : sparse_) {
+        if (set)
+            set->clear();
     }
-    return false;
+    free_slots_.clear();
+    for (size_t i = entities_.size(); i-- > 0;) {
+        auto& s = entities_[i];
+        if (in_use(s)) {
+            call_destructors(s.second);
+            auto generation
+                = (entity_generation(s.first) + 1) & entity_generation_mask;
+            s.first = make_entity(free_slot, generation);
+            s.second = elem();
+            mark_changed(i);
+        }
+        // Push them in reverse, so the lowest indices are used first.
+        free_slots_.push_back(i);
+    }
+    size_ = 0;
+    rebuild_queries();
+}
+
+bool storage::delete_entity(entity en)
+{
+    if (!exists(en))
+        return false;
+
+    delete_entity(iterator(&entities_, entity_index(en)));
+    return true;
 }
 
 void storage::delete_entity(iterator f)
@@ -126,8 +227,19 @@ void storage::delete_entity(iterator f)
     if (on_deleted_entity)
         on_deleted_entity(f);
 
-    call_destructors(f);
-    entities_.erase(f);
+    call_destructors(f->second);
+    erase_sparse(f.pos_, f->second.components);
+
+    // Release the data, and bump the generation so any handles that are
+    // still around no longer match.
+    auto generation
+        = (entity_generation(f->first) + 1) & entity_generation_mask;
+    f->first = make_entity(free_slot, generation);
+    f->second = elem();
+    free_slots_.push_back(f.pos_);
+    mark_changed(f.pos_);
+    update_queries(f);
+    --size_;
 }
 
 void storage::remove_component_from_entity(iterator en, component_id c)
@@ -136,79 +248,653 @@ void storage::remove_component_from_entity(iterator en, component_id c)
     if (!e.components[c])
         return;
 
-    size_t off = offset(e, c);
-    auto& comp_info = components_[c];
-    if (!comp_info.is_flat()) {
-        auto ptr = reinterpret_cast<placeholder*>(&*e.data.begin() + off);
-        if (ptr)
-            ptr->~placeholder();
-    }
-    auto o = e.data.begin() + off;
-    e.data.erase(o, o + comp_info.size());
-    e.components.reset(c);
-    e.dirty = true;
+    change_components(en, component_mask(e.components).reset(c));
+    set_dirty(en.pos_, component_mask().set(c));
+    mark_changed(en.pos_);
+    update_queries(en);
+}
+
+void storage::remove_components_from_entity(iterator en,
+                                            const component_mask& mask)
+{
+    auto& e = en->second;
+    if ((e.components & mask).none())
+        return;
+
+    auto removed = e.components & mask;
+    change_components(en, e.components & ~mask);
+    set_dirty(en.pos_, removed);
+    mark_changed(en.pos_);
+    update_queries(en);
 }
 
-bool storage::entity_has_component(iterator en, component_id c) const
+bool storage::entity_has_component(const_iterator en, component_id c) const
 {
     return c < components_.size() && en->second.components.test(c);
 }
 
-size_t storage::offset(const elem& e, component_id c) const
+void storage::relayout(elem& e, const component_mask& mask)
 {
-    assert(c < components_.size());
+    // Non-flat components must never be moved bytewise, so they always
+    // go on the heap.
+    small_buffer data(layout_size(mask), (mask & flat_mask_).any(), alloc_);
+    size_t from = 0, to = 0;
+    ES_INSTRUMENT(size_t moved = 0;)
 
-    auto mask = ((uint64_t(1) << c) - 1) & e.components.to_ullong();
-    size_t result{0};
-    for (int i{0}; mask != 0 && i < 8; ++i) {
-        result += component_offsets_[(i << 8) + (mask & 0xff)];
-        mask >>= 8;
+    for (size_t c = 0; c < components_.size(); ++c) {
+        bool had = e.components[c], has = mask[c];
+        if ((!had && !has) || is_sparse(c))
+            continue;
+
+        auto& info = components_[c];
+        if (had && has) {
+            ES_INSTRUMENT(moved += info.size();)
+            info.relocate(&data[to], &e.data[from]);
+        } else if (had) {
+            info.destroy(&e.data[from]);
+        }
+
+        if (had)
+            from += info.size();
+        if (has)
+            to += info.size();
     }
+    e.data.swap(data);
+    e.components = mask;
+    ES_INSTRUMENT(counters_.relayouts.add(1); counters_.bytes_moved.add(moved);)
+}
+
+void storage::construct_defaults(elem& e, const component_mask& mask)
+{
+    if ((mask & flat_mask_).none())
+        return;
+
+    for (size_t c = 0; c < components_.size(); ++c) {
+        if (mask[c])
+            components_[c].construct(&e.data[offset(e, c)]);
+    }
+}
 
+storage::component_id storage::component_added(bool sparse)
+{
+    auto& info = components_.back();
+    write_shift_.push_back(0);
+    read_shift_.push_back(info.size() - info.value_size());
+    component_locks_.emplace_back(new rw_lock);
+
+    component_id index = components_.size() - 1;
+    names_.emplace(info.name(), index);
+    sparse_.emplace_back(sparse ? new sparse_set(info.size()) : nullptr);
+    sparse_mask_[index] = sparse;
+
+    // Sparse components take up no room in the entity data.
+    size_t size = sparse ? 0 : info.size();
+    size_t block = (index >> 3) << 8;
+    size_t i = 1 << (index & 0x07);
+
+    for (size_t j = block + i; j != block + i * 2; ++j)
+        component_offsets_[j] = component_offsets_[j - i] + size;
+
+    return index;
+}
+
+const sparse_set* storage::smallest_set(const component_mask& mask) const
+{
+    const sparse_set* result = nullptr;
+    if (!intersects(mask, sparse_mask_))
+        return result;
+
+    for (size_t c = 0; c < components_.size(); ++c) {
+        if (mask[c] && is_sparse(c)
+            && (!result || sparse_[c]->size() < result->size()))
+            result = sparse_[c].get();
+    }
     return result;
 }
 
+void storage::change_components(iterator en, const component_mask& mask)
+{
+    auto& e = en->second;
+    auto changed = e.components ^ mask;
+    if (intersects(changed, sparse_mask_)) {
+        erase_sparse(en.pos_, changed & e.components);
+        for (size_t c = 0; c < components_.size(); ++c) {
+            if (changed[c] && mask[c] && is_sparse(c))
+                sparse_[c]->insert(en.pos_);
+        }
+    }
+
+    // Neither sparse components nor tags are in the entity's data.
+    if ((changed & ~(sparse_mask_ | tag_mask_)).any())
+        relayout(e, mask);
+    else
+        e.components = mask;
+}
+
+void storage::erase_sparse(size_t index, const component_mask& mask)
+{
+    if (!intersects(mask, sparse_mask_))
+        return;
+
+    for (size_t c = 0; c < components_.size(); ++c) {
+        if (mask[c] && is_sparse(c))
+            sparse_[c]->erase(index);
+    }
+}
+
+void storage::swap_buffers()
+{
+    for (size_t c = 0; c < components_.size(); ++c) {
+        auto& info = components_[c];
+        if (info.buffers() == 1)
+            continue;
+
+        read_shift_[c] = write_shift_[c];
+        write_shift_[c] = (write_shift_[c] + info.value_size()) % info.size();
+    }
+}
+
+void storage::write_buffers(component_id c, const char* from, char* to) const
+{
+    auto& info = components_[c];
+    if (info.buffers() == 1) {
+        std::memcpy(to, from, info.size());
+        return;
+    }
+
+    // The buffers form a ring, every swap moves the next one forward.
+    auto size = info.value_size();
+    for (size_t i = 0; i < info.buffers(); ++i) {
+        auto pos = (write_shift_[c] + (info.buffers() - i) * size)
+                   % info.size();
+        std::memcpy(to + i * size, from + pos, size);
+    }
+}
+
+void storage::read_buffers(component_id c, const char* from, char* to) const
+{
+    auto& info = components_[c];
+    if (info.buffers() == 1) {
+        std::memcpy(to, from, info.size());
+        return;
+    }
+
+    auto size = info.value_size();
+    for (size_t i = 0; i < info.buffers(); ++i) {
+        auto pos = (write_shift_[c] + (info.buffers() - i) * size)
+                   % info.size();
+        std::memcpy(to + pos, from + i * size, size);
+    }
+}
+
+storage::access storage::lock(const component_mask& reads,
+                              const component_mask& writes)
+{
+    assert(((reads | writes) >> components_.size()).none());
+
+    structure_lock_.lock_shared();
+    auto all = reads | writes;
+    for (size_t c = 0; c < components_.size(); ++c) {
+        if (writes[c])
+            component_locks_[c]->lock();
+        else if (all[c])
+            component_locks_[c]->lock_shared();
+    }
+    ++shared_;
+    return access(this, reads, writes, false);
+}
+
+storage::access storage::lock_structure()
+{
+    structure_lock_.lock();
+    return access(this, component_mask(), component_mask(), true);
+}
+
+void storage::unlock(const access& a)
+{
+    if (a.structure_) {
+        structure_lock_.unlock();
+        return;
+    }
+
+    --shared_;
+    auto all = a.reads_ | a.writes_;
+    for (size_t c = components_.size(); c-- > 0;) {
+        if (a.writes_[c])
+            component_locks_[c]->unlock();
+        else if (all[c])
+            component_locks_[c]->unlock_shared();
+    }
+    structure_lock_.unlock_shared();
+}
+
+void storage::compact()
+{
+    std::vector<uint32_t> order(entities_.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = static_cast<uint32_t>(i);
+
+    compact_in_order(std::move(order));
+    order_.clear();
+}
+
+void storage::compact_in_order(std::vector<uint32_t>&& order)
+{
+    assert(order.size() == entities_.size());
+
+    // Hang on to the old buffers until the end, otherwise the allocator
+    // would just hand them out again.
+    std::vector<small_buffer> old;
+    old.reserve(size_);
+
+    for (auto index : order) {
+        auto& s = entities_[index];
+        auto& e = s.second;
+        if (!in_use(s) || e.data.is_inline())
+            continue;
+
+        small_buffer data(e.data.size(), true, alloc_);
+        size_t off = 0;
+        for (size_t c = 0; c < components_.size() && off < e.data.size();
+             ++c) {
+            if (!e.components[c] || is_sparse(c))
+                continue;
+
+            auto& info = components_[c];
+            info.relocate(&data[off], &e.data[off]);
+            off += info.size();
+        }
+        e.data.swap(data);
+        old.emplace_back(std::move(data));
+    }
+    order_ = std::move(order);
+}
+
+storage_stats storage::stats() const
+{
+    storage_stats result;
+    result.for_each.calls = counters_.calls.get();
+    result.for_each.visited = counters_.visited.get();
+    result.for_each.matched = counters_.matched.get();
+    result.for_each.nanoseconds = counters_.nanoseconds.get();
+    result.relayouts = counters_.relayouts.get();
+    result.bytes_moved = counters_.bytes_moved.get();
+    return result;
+}
+
+void storage::reset_stats()
+{
+    counters_.calls.reset();
+    counters_.visited.reset();
+    counters_.matched.reset();
+    counters_.nanoseconds.reset();
+    counters_.relayouts.reset();
+    counters_.bytes_moved.reset();
+}
+
+std::vector<component_footprint> storage::footprint() const
+{
+    std::vector<component_footprint> result;
+    for (auto& c : components_)
+        result.push_back({c.name(), 0, 0});
+
+    for (auto& s : entities_) {
+        if (!in_use(s))
+            continue;
+
+        for (size_t c = 0; c < components_.size(); ++c) {
+            if (s.second.components[c])
+                ++result[c].entities;
+        }
+    }
+    for (size_t c = 0; c < components_.size(); ++c) {
+        result[c].bytes = sparse_[c] ? sparse_[c]->capacity_bytes()
+                                     : result[c].entities
+                                           * components_[c].size();
+    }
+
+    return result;
+}
+
+memory_usage storage::memory_stats() const
+{
+    memory_usage result;
+    result.entities = size_;
+    result.slots = entities_.size();
+    result.slot_bytes = entities_.capacity() * sizeof(slot);
+    result.change_bytes = dirty_.capacity() * sizeof(component_mask)
+                          + changes_.capacity() * sizeof(uint32_t)
+                          + listed_.capacity() / 8;
+
+    size_t index = free_slots_.capacity() + order_.capacity();
+    for (auto& q : queries_) {
+        if (q)
+            index += q->members.capacity() + q->positions.capacity();
+    }
+    result.index_bytes = index * sizeof(uint32_t);
+    for (auto& w : watches_) {
+        if (w)
+            result.index_bytes += w->has.capacity() / 8
+                                  + (w->added.capacity()
+                                     + w->removed.capacity())
+                                        * sizeof(entity);
+    }
+
+    result.heap_bytes = 0;
+    result.slack_bytes = 0;
+    for (auto& s : entities_) {
+        auto& data = s.second.data;
+        if (!in_use(s) || data.is_inline())
+            continue;
+
+        result.heap_bytes += data.heap_bytes();
+        result.slack_bytes += data.heap_bytes() - data.size();
+    }
+    result.components = footprint();
+
+    return result;
+}
+
+storage::query storage::register_query(const component_mask& include,
+                                       const component_mask& exclude)
+{
+    if ((include & exclude).any())
+        throw std::logic_error("query includes and excludes a component");
+
+    queries_.emplace_back(new query_data(include, exclude));
+    auto& q = *queries_.back();
+    q.positions.assign(entities_.size(), query_data::gone);
+    for (size_t i = 0; i < entities_.size(); ++i) {
+        if (q.matches(entities_[i]))
+            q.update(static_cast<uint32_t>(i), true);
+    }
+    return query(static_cast<uint32_t>(queries_.size() - 1));
+}
+
+void storage::unregister_query(query q)
+{
+    find_query(q);
+    queries_[q.index_].reset();
+}
+
+size_t storage::query_size(query q) const
+{
+    auto& found = find_query(q);
+    return found.members.size()
+           - std::count(found.members.begin(), found.members.end(),
+                        query_data::gone);
+}
+
+storage::query_data& storage::find_query(query q)
+{
+    if (q.index_ >= queries_.size() || !queries_[q.index_])
+        throw std::logic_error("unknown query");
+
+    return *queries_[q.index_];
+}
+
+const storage::query_data& storage::find_query(query q) const
+{
+    if (q.index_ >= queries_.size() || !queries_[q.index_])
+        throw std::logic_error("unknown query");
+
+    return *queries_[q.index_];
+}
+
+void storage::rebuild_queries()
+{
+    for (auto& q : queries_) {
+        if (!q)
+            continue;
+
+        assert(q->iterating == 0);
+        q->members.clear();
+        q->positions.assign(entities_.size(), query_data::gone);
+        for (size_t i = 0; i < entities_.size(); ++i) {
+            if (q->matches(entities_[i]))
+                q->update(static_cast<uint32_t>(i), true);
+        }
+    }
+    if (!watches_.empty()) {
+        for (size_t i = 0; i < entities_.size(); ++i)
+            update_watches(i);
+    }
+}
+
+storage::observer storage::observe(component_id c, unsigned int events,
+                                   observer_function func)
+{
+    if (c >= components_.size())
+        throw std::logic_error("component does not exist");
+    if (!func)
+        throw std::logic_error("observer needs a function");
+
+    observers_.push_back({c, events, std::move(func)});
+    update_watched();
+    return observer(static_cast<uint32_t>(observers_.size() - 1));
+}
+
+void storage::unobserve(observer o)
+{
+    if (o.index_ >= observers_.size() || !observers_[o.index_].func)
+        throw std::logic_error("unknown observer");
+
+    observers_[o.index_].func = nullptr;
+    update_watched();
+}
+
+void storage::update_watched()
+{
+    component_mask watched;
+    for (auto& o : observers_) {
+        if (o.func)
+            watched.set(o.component);
+    }
+
+    if (watched.none()) {
+        watches_.clear();
+        return;
+    }
+
+    watches_.resize(components_.size());
+    for (size_t c = 0; c < components_.size(); ++c) {
+        if (!watched[c]) {
+            watches_[c].reset();
+        } else if (!watches_[c]) {
+            // Only what happens from now on is an event.
+            watches_[c].reset(new watch_data);
+            auto& has = watches_[c]->has;
+            has.resize(entities_.size());
+            for (size_t i = 0; i < entities_.size(); ++i)
+                has[i] = in_use(entities_[i])
+                         && entities_[i].second.components[c];
+        }
+    }
+}
+
+void storage::dispatch_events()
+{
+    // Take the events out first, so the callbacks can change the
+    // storage without touching the batches they are looking at.
+    std::vector<watch_data> logs(components_.size());
+    for (size_t c = 0; c < watches_.size(); ++c) {
+        if (watches_[c]) {
+            logs[c].added.swap(watches_[c]->added);
+            logs[c].removed.swap(watches_[c]->removed);
+        }
+    }
+
+    component_mask observed;
+    for (auto& o : observers_) {
+        if (o.func && (o.events & on_change))
+            observed.set(o.component);
+    }
+
+    std::vector<std::vector<entity>> changes(components_.size());
+    if (observed.any()) {
+        for (auto index : changes_) {
+            if (index >= entities_.size() || !in_use(entities_[index]))
+                continue;
+
+            auto& s = entities_[index];
+            auto mask = dirty_[index] & s.second.components & observed;
+            if (mask.none())
+                continue;
+
+            for (size_t c = 0; c < components_.size(); ++c) {
+                if (mask[c])
+                    changes[c].push_back(s.first);
+            }
+        }
+    }
+    clear_changes();
+
+    // Components that were just added are dirty as well, but that
+    // isn't a change of their value.
+    for (size_t c = 0; c < changes.size(); ++c) {
+        auto added = logs[c].added;
+        if (changes[c].empty() || added.empty())
+            continue;
+
+        std::sort(added.begin(), added.end());
+        auto& list = changes[c];
+        list.erase(std::remove_if(list.begin(), list.end(),
+                                  [&](entity en) {
+                                      return std::binary_search(
+                                          added.begin(), added.end(), en);
+                                  }),
+                   list.end());
+    }
+
+    auto deliver = [](const observer_data& o, event kind,
+                      const std::vector<entity>& list) {
+        if (!(o.events & kind) || list.empty())
+            return;
+
+        event_batch batch = {o.component, kind, list.data(),
+                             list.data() + list.size()};
+        o.func(batch);
+    };
+
+    // The callbacks can register new observers.
+    for (size_t i = 0; i < observers_.size(); ++i) {
+        auto o = observers_[i];
+        if (!o.func || o.component >= logs.size())
+            continue;
+
+        deliver(o, on_add, logs[o.component].added);
+        deliver(o, on_remove, logs[o.component].removed);
+        deliver(o, on_change, changes[o.component]);
+    }
+}
+
+void storage::defer_change(change_list& deferred, size_t i,
+                           const component_mask& dirty)
+{
+    deferred.emplace_back(static_cast<uint32_t>(i), dirty);
+}
+
+void storage::list_change(size_t index)
+{
+    if (!tracking_)
+        return;
+
+    if (index >= listed_.size())
+        listed_.resize(std::max(index + 1, entities_.size()));
+
+    if (!listed_[index]) {
+        listed_[index] = true;
+        changes_.push_back(static_cast<uint32_t>(index));
+    }
+}
+
+void storage::clear_changes()
+{
+    for (auto index : changes_) {
+        if (index < dirty_.size())
+            dirty_[index].reset();
+
+        listed_[index] = false;
+    }
+    changes_.clear();
+}
+
+void storage::track_changes(bool on)
+{
+    if (on == tracking_)
+        return;
+
+    tracking_ = on;
+    std::vector<uint32_t>().swap(changes_);
+    std::vector<bool>().swap(listed_);
+    if (on)
+        dirty_.assign(entities_.size(), component_mask());
+    else
+        std::vector<component_mask>().swap(dirty_);
+}
+
 bool storage::check_dirty(iterator en)
 {
-    return en->second.dirty.any();
+    return dirty_flags(en.pos_).any();
 }
 
 bool storage::check_dirty_and_clear(iterator en)
 {
     bool result(check_dirty(en));
-    en->second.dirty.reset();
+    if (tracking_)
+        dirty_[en.pos_].reset();
     return result;
 }
 
 bool storage::check_dirty(iterator en, component_id c)
 {
-    return en->second.dirty[c];
+    return dirty_flags(en.pos_)[c];
 }
 
 bool storage::check_dirty_and_clear(iterator en, component_id c)
 {
     bool result(check_dirty(en, c));
-    en->second.dirty.reset(c);
+    if (tracking_)
+        dirty_[en.pos_].reset(c);
     return result;
 }
 
 void storage::serialize(const_iterator en, std::vector<char>& buffer) const
 {
     auto& e = en->second;
-    buffer.reserve(8 + e.data.size());
-    buffer.resize(8);
-
-    *(reinterpret_cast<uint64_t*>(&buffer[0])) = e.components.to_ullong();
+    auto words = mask_words * sizeof(uint64_t);
+    buffer.reserve(words + e.data.size());
+    buffer.resize(words);
+    for (size_t i = 0; i < mask_words; ++i) {
+        auto word = mask_word(e.components, i);
+        std::memcpy(&buffer[i * sizeof(uint64_t)], &word, sizeof(word));
+    }
 
     auto first = e.data.begin();
     auto last = first;
+    bool sparse = intersects(e.components, sparse_mask_);
 
     for (size_t i = 0; i < components_.size(); ++i) {
         if (!e.components[i])
             continue;
 
         auto& c = components_[i];
-        if (c.is_flat()) {
+        if (is_sparse(i)) {
+            // Sparse values go in the same place a packed one would.
+            buffer.insert(buffer.end(), first, last);
+            first = last;
+            auto value = sparse_[i]->find(en.pos_);
+            buffer.insert(buffer.end(), value, value + c.size());
+            continue;
+        } else if (c.buffers() > 1) {
+            // Buffers are written in order, not the way they happen to
+            // lie in memory.
+            buffer.insert(buffer.end(), first, last);
+            buffer.resize(buffer.size() + c.size());
+            write_buffers(i, &*last, &buffer[buffer.size() - c.size()]);
+            std::advance(last, c.size());
+            first = last;
+        } else if (c.is_flat()) {
             // As long as we have a flat memory layout, just move the
             // end of the range.
             std::advance(last, c.size());
@@ -224,7 +910,7 @@ void storage::serialize(const_iterator en, std::vector<char>& buffer) const
             first = last;
         }
 
-        if (last >= e.data.end())
+        if (last >= e.data.end() && !sparse)
             break;
     }
     // Write the last bit after we're done.
@@ -234,64 +920,354 @@ void storage::serialize(const_iterator en, std::vector<char>& buffer) const
 
 void storage::deserialize(iterator en, const std::vector<char>& buffer)
 {
-    auto first = buffer.begin();
+    reader in(buffer);
+    deserialize(en, in);
+    assert(in.empty());
+}
+
+void storage::deserialize(iterator en, const char* data, size_t size)
+{
+    reader in(data, size);
+    deserialize(en, in);
+    assert(in.empty());
+}
+
+void storage::deserialize(iterator en, reader& in)
+{
     auto& e = en->second;
 
-    call_destructors(en);
+    uint64_t words[mask_words];
+    in.read(words, sizeof(words));
+    auto mask = mask_from_words(words);
+    if ((mask >> components_.size()).any())
+        throw std::runtime_error("es::deserialize: unknown component");
+
+    call_destructors(e);
+    erase_sparse(en.pos_, e.components);
     e.data.clear();
-    e.components = *(reinterpret_cast<const uint64_t*>(&*first));
+    e.components = mask;
+    mark_changed(en.pos_);
+    // Reserve the final size up front, so non-flat components are never
+    // moved around by a reallocation.
+    e.data.reserve(layout_size(e.components),
+                   (e.components & flat_mask_).any(), alloc_);
 
-    std::advance(first, 8);
-    auto last = first;
+    // Until everything is in place, the mask only holds the components
+    // that have been read, so the entity can be cleaned up if this
+    // throws.
+    e.components.reset();
+    try {
+        read_components(en, mask, in);
+    } catch (...) {
+        update_queries(en);
+        throw;
+    }
+    update_queries(en);
+}
 
+void storage::read_components(iterator en, const component_mask& mask,
+                              reader& in)
+{
+    auto& e = en->second;
     for (size_t i = 0; i < components_.size(); ++i) {
-        if (!e.components[i])
+        if (!mask[i])
             continue;
 
         auto& c(components_[i]);
-        if (c.is_flat()) {
-            // As long as we have a flat memory layout, just move the
-            // end of the range.
-            std::advance(last, c.size());
+        auto offset(e.data.size());
+        if (is_sparse(i)) {
+            auto value = in.take(c.size());
+            std::memcpy(sparse_[i]->insert(en.pos_), value, c.size());
+            e.components.set(i);
+        } else if (c.is_flat()) {
+            auto value = in.take(c.size());
+            e.data.append(value, value + c.size());
+            if (c.buffers() > 1)
+                read_buffers(i, value, &e.data[offset]);
+            e.components.set(i);
         } else {
-            // If not, write the current range to the entity data.
-            e.data.insert(e.data.end(), first, last);
-            // Create a new object for the component and deserialize the
-            // data using the function the caller provided.
-            std::unique_ptr<component::placeholder> ptr(c.clone());
-            last = ptr->deserialize(last, buffer.end());
-            first = last;
-            // Move the object to the buffer.
-            auto offset(e.data.size());
+            // Create a new object for the component in place, and
+            // deserialize the data using the function the caller
+            // provided.
             e.data.resize(offset + c.size());
-            ptr->move_to(e.data.begin() + offset);
+            try {
+                c.construct(&e.data[offset]);
+            } catch (...) {
+                e.data.resize(offset);
+                throw;
+            }
+            e.components.set(i);
+            reinterpret_cast<placeholder*>(&e.data[offset])->deserialize(in);
         }
+    }
+}
 
-        if (last > buffer.end())
-            throw std::runtime_error("es::deserialize: missing data");
+void storage::write_snapshot(std::vector<char>& buffer) const
+{
+    typedef snapshot_view view;
+    size_t count = components_.size();
 
-        if (last == buffer.end())
-            break;
+    std::vector<snapshot_component> table(count);
+    for (auto& s : entities_) {
+        if (!in_use(s))
+            continue;
+
+        for (size_t c = 0; c < count; ++c) {
+            if (s.second.components[c])
+                ++table[c].count;
+        }
     }
-    // Write the last bit after we're done.
-    assert(last == buffer.end());
-    e.data.insert(e.data.end(), first, buffer.end());
+
+    // Lay out everything but the non-flat columns, these go at the end
+    // once we know how large they are.
+    size_t pos = view::align(sizeof(snapshot_header));
+    for (auto& c : components_)
+        pos = view::align(pos + sizeof(snapshot_component) + c.name().size());
+
+    size_t slots_pos = pos;
+    pos = view::align(pos + entities_.size() * sizeof(entity));
+    size_t masks_pos = pos;
+    pos = view::align(pos + entities_.size() * mask_words * sizeof(uint64_t));
+
+    for (size_t c = 0; c < count; ++c) {
+        auto& info = components_[c];
+        table[c].name_size = static_cast<uint32_t>(info.name().size());
+        table[c].size = static_cast<uint32_t>(info.size());
+        table[c].flat = info.is_flat();
+        table[c].type_hash = view::type_hash(info.type_info_.name());
+        if (info.is_flat()) {
+            table[c].offset = pos;
+            table[c].bytes = table[c].count * info.size();
+            pos = view::align(pos + table[c].bytes);
+        }
+    }
+
+    buffer.assign(pos, 0);
+    std::vector<uint64_t> cursors(count);
+    for (size_t c = 0; c < count; ++c)
+        cursors[c] = table[c].offset;
+
+    std::vector<std::vector<char>> deep(count);
+    for (size_t i = 0; i < entities_.size(); ++i) {
+        auto& s = entities_[i];
+        auto mask = in_use(s) ? s.second.components : component_mask();
+        std::memcpy(&buffer[slots_pos + i * sizeof(entity)], &s.first,
+                    sizeof(entity));
+        for (size_t w = 0; w < mask_words; ++w) {
+            auto word = mask_word(mask, w);
+            std::memcpy(&buffer[masks_pos + (i * mask_words + w)
+                                                * sizeof(uint64_t)],
+                        &word, sizeof(word));
+        }
+        if (mask.none())
+            continue;
+
+        auto& e = s.second;
+        size_t off = 0;
+        for (size_t c = 0; c < count; ++c) {
+            if (!e.components[c])
+                continue;
+
+            auto& info = components_[c];
+            if (is_sparse(c)) {
+                std::memcpy(&buffer[cursors[c]], sparse_[c]->find(i),
+                            info.size());
+                cursors[c] += info.size();
+                continue;
+            } else if (info.is_flat()) {
+                write_buffers(c, &e.data[off], &buffer[cursors[c]]);
+                cursors[c] += info.size();
+            } else {
+                reinterpret_cast<const placeholder*>(&e.data[off])
+                    ->serialize(deep[c]);
+            }
+            off += info.size();
+        }
+    }
+
+    for (size_t c = 0; c < count; ++c) {
+        if (components_[c].is_flat())
+            continue;
+
+        table[c].offset = view::align(buffer.size());
+        table[c].bytes = deep[c].size();
+        buffer.resize(table[c].offset);
+        buffer.insert(buffer.end(), deep[c].begin(), deep[c].end());
+    }
+
+    snapshot_header head;
+    std::memcpy(head.magic, view::magic(), sizeof(head.magic));
+    head.version = view::version;
+    head.mask_words = mask_words;
+    head.component_count = static_cast<uint32_t>(count);
+    head.slot_count = static_cast<uint32_t>(entities_.size());
+    head.entity_count = size_;
+    std::memcpy(&buffer[0], &head, sizeof(head));
+
+    pos = view::align(sizeof(head));
+    for (size_t c = 0; c < count; ++c) {
+        std::memcpy(&buffer[pos], &table[c], sizeof(table[c]));
+        auto& name = components_[c].name();
+        std::copy(name.begin(), name.end(),
+                  buffer.begin() + pos + sizeof(table[c]));
+        pos = view::align(pos + sizeof(table[c]) + name.size());
+    }
+}
+
+void storage::read_snapshot(const char* data, size_t size)
+{
+    snapshot_view view(data, size);
+    auto& columns = view.columns();
+
+    // Map the components in the snapshot to ours.
+    std::vector<component_id> ids;
+    std::vector<size_t> column_of(components_.size(), columns.size());
+    for (auto& col : columns) {
+        auto id = find_component(col.name);
+        auto& info = components_[id];
+        if (info.is_flat() != col.flat
+            || (col.flat && info.size() != col.size)
+            || snapshot_view::type_hash(info.type_info_.name())
+                   != col.type_hash)
+            throw std::logic_error("snapshot component does not match");
+
+        column_of[id] = ids.size();
+        ids.push_back(id);
+    }
+
+    // Non-flat components are read straight from the snapshot.
+    std::vector<size_t> cursors(columns.size(), 0);
+    std::vector<std::unique_ptr<reader>> readers(columns.size());
+    for (size_t i = 0; i < columns.size(); ++i) {
+        if (!columns[i].flat)
+            readers[i].reset(new reader(columns[i].data, columns[i].bytes));
+    }
+
+    // clear() put every old slot on the list of changes, but those
+    // slots are about to go away.
+    clear();
+    clear_changes();
+    entities_.clear();
+    dirty_.clear();
+    free_slots_.clear();
+    order_.clear();
+    entities_.reserve(view.slot_count());
+
+    for (size_t i = 0; i < view.slot_count(); ++i) {
+        entity id;
+        std::memcpy(&id, view.slots() + i, sizeof(id));
+
+        // The snapshot can have been written with another mask width.
+        component_mask mask;
+        bool empty = true;
+        for (size_t w = 0; w < view.mask_words(); ++w) {
+            uint64_t bits;
+            std::memcpy(&bits, view.masks() + i * view.mask_words() + w,
+                        sizeof(bits));
+            for (size_t j = 0; bits != 0; ++j, bits >>= 1) {
+                if (!(bits & 1))
+                    continue;
+                if (w * 64 + j >= ids.size())
+                    throw std::runtime_error("es::read_snapshot: bad mask");
+
+                mask.set(ids[w * 64 + j]);
+                empty = false;
+            }
+        }
+
+        if (entity_index(id) != i) {
+            if (entity_index(id) != free_slot || !empty)
+                throw std::runtime_error("es::read_snapshot: bad entity");
+
+            add_slot(id);
+            continue;
+        }
+
+        add_slot(id);
+        ++size_;
+        elem& e = entities_.back().second;
+        e.data = small_buffer(layout_size(mask), (mask & flat_mask_).any(),
+                              alloc_);
+
+        // Components are only added to the mask once they are in place,
+        // so the entity can always be cleaned up if this throws.
+        size_t off = 0;
+        for (size_t c = 0; c < components_.size(); ++c) {
+            if (!mask[c])
+                continue;
+
+            auto& info = components_[c];
+            auto col = column_of[c];
+            if (info.is_flat()) {
+                if (cursors[col] + info.size() > columns[col].bytes)
+                    throw std::runtime_error("es::read_snapshot: missing data");
+
+                auto to = is_sparse(c) ? sparse_[c]->insert(i) : &e.data[off];
+                read_buffers(c, columns[col].data + cursors[col], to);
+                cursors[col] += info.size();
+                e.components.set(c);
+                if (is_sparse(c))
+                    continue;
+            } else {
+                info.construct(&e.data[off]);
+                e.components.set(c);
+                reinterpret_cast<placeholder*>(&e.data[off])
+                    ->deserialize(*readers[col]);
+            }
+            off += info.size();
+        }
+        if (tracking_)
+            dirty_[i] = e.components;
+        mark_changed(i);
+    }
+
+    for (size_t i = entities_.size(); i-- > 0;) {
+        if (!in_use(entities_[i]))
+            free_slots_.push_back(i);
+    }
+    rebuild_queries();
 }
 
-void storage::call_destructors(iterator i) const
+storage::iterator storage::acquire_slot()
 {
-    elem& e = i->second;
+    while (!free_slots_.empty()) {
+        auto index = free_slots_.back();
+        free_slots_.pop_back();
+        if (!in_use(entities_[index]))
+            return acquire_slot(index,
+                                entity_generation(entities_[index].first));
+    }
+    return acquire_slot(entities_.size(), 0);
+}
+
+storage::iterator storage::acquire_slot(uint32_t index, uint32_t generation)
+{
+    if (index >= free_slot)
+        throw std::length_error("too many entities");
+
+    if (index == entities_.size())
+        add_slot(make_entity(free_slot, generation));
 
+    assert(!in_use(entities_[index]));
+    entities_[index].first = make_entity(index, generation);
+    if (tracking_)
+        dirty_[index] = component_mask(true);
+    mark_changed(index);
+    update_queries(index);
+    ++size_;
+
+    return iterator(&entities_, index);
+}
+
+void storage::call_destructors(elem& e) const
+{
     // Quick check if we'll have to call any destructors.
     if ((e.components & flat_mask_).any()) {
         size_t off = 0;
-        for (int search = 0; search < 64 && off < e.data.size(); ++search) {
-            if (e.components[search]) {
-                if (!components_[search].is_flat()) {
-                    auto ptr = reinterpret_cast<placeholder*>(&*e.data.begin()
-                                                              + off);
-                    ptr->~placeholder();
-                }
+        for (size_t search = 0;
+             search < components_.size() && off < e.data.size(); ++search) {
+            if (e.components[search] && !is_sparse(search)) {
+                components_[search].destroy(&*e.data.begin() + off);
                 off += components_[search].size();
             }
         }
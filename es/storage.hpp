@@ -7,120 +7,504 @@
 #pragma once
 
 #include <algorithm>
-#include <bitset>
+#include <atomic>
 #include <cassert>
 #include <cstdint>
 #include <functional>
+#include <initializer_list>
 #include <stdexcept>
 #include <string>
 #include <typeinfo>
 #include <type_traits>
-#include <vector>
 #include <unordered_map>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
 
+#include "allocator.hpp"
 #include "component.hpp"
+#include "component_mask.hpp"
 #include "entity.hpp"
+#include "instrumentation.hpp"
+#include "job_system.hpp"
+#include "rw_lock.hpp"
+#include "small_buffer.hpp"
+#include "sparse_set.hpp"
 #include "traits.hpp"
 
 namespace es
 {
+class command_buffer;
+class delta_encoder;
+class delta_decoder;
+
 /** A storage ties entities and components together.
  * Storage associates two other bits of data with every entity:
- * - A 64-bit mask that keeps track of which components are defined
- * - A vector of bytes, holding the actual data
+ * - A component_mask that keeps track of which components are defined
+ * - A buffer of bytes, holding the actual data
+ *
+ * The buffer tries to pack the component data as tightly as possible.
+ * It is really fast for plain old datatypes, but it also handles
+ * nontrivial types safely.  It packs a virtual table and a pointer to
+ * some heap space in the buffer, and calls the constructor and destructor
+ * as needed.  Entities that only have a few bytes of flat data keep it
+ * inline, and don't need a heap allocation at all.
  *
- * The vector of bytes tries to pack the component data as tightly as
- * possible.  It is really fast for plain old datatypes, but it also
- * handles nontrivial types safely.  It packs a virtual table and a
- * pointer to some heap space in the vector, and calls the constructor
- * and destructor as needed.
+ * Concurrency: none of the functions lock anything by themselves, but a
+ * storage has a reader/writer lock for every component, and one for its
+ * structure, that threads can use to share it.  A thread that takes
+ * lock() can read the components it locked for reading, and change the
+ * values of the ones it locked for writing, while other threads do the
+ * same with other components.  Creating or deleting entities, and adding
+ * or removing components, needs lock_structure(), which waits until no
+ * other thread holds any lock.  The scheduler takes these locks for the
+ * systems it runs, so other threads can safely use them as well.  The
+ * list of changes is protected separately, so marking components as
+ * dirty is always safe; checking or clearing the dirty flags, and
+ * clear_changes(), need lock_structure().
  */
 class storage
 {
-    /** This data gets associated with every entity. */
+    friend class command_buffer;
+    friend class delta_encoder;
+    friend class delta_decoder;
+
+    /** This data gets associated with every entity.  The dirty flags
+     *  are kept apart, see track_changes(). */
     struct elem
     {
         /** Bitmask to keep track of which components are held in \a data. */
-        std::bitset<64> components;
-        /** Track what aspects of an entity have changed. */
-        std::bitset<64> dirty;
+        component_mask components;
         /** Component data for this entity. */
-        std::vector<char> data;
+        small_buffer data;
+    };
+
+    typedef component::placeholder placeholder;
+
+    template <typename T>
+    using holder = component::holder<T>;
+
+    template <typename T>
+    using shared_holder = component::shared_holder<T>;
+
+    /** Every entity index has a slot, holding the entity's full ID and
+     *  its data.  Slots that are not in use have an invalid index in
+     *  their ID, and the generation that will be given out next. */
+    typedef std::pair<entity, elem> slot;
+
+    typedef std::vector<slot> stor_impl;
+
+    /** Marks a slot that is not in use. */
+    static const uint32_t free_slot = entity_index_mask;
+
+    static bool in_use(const slot& s)
+    {
+        return entity_index(s.first) != free_slot;
+    }
+
+    /** The state of a query, see register_query().  This is a sparse
+     *  set of slot indices. */
+    struct query_data
+    {
+        /** Marks a slot that is not a member. */
+        static const uint32_t gone = ~uint32_t(0);
+
+        query_data(const component_mask& include,
+                   const component_mask& exclude)
+            : include(include)
+            , exclude(exclude)
+            , iterating(0)
+            , holes(false)
+        {
+        }
+
+        bool matches(const slot& s) const
+        {
+            auto& mask = s.second.components;
+            return in_use(s) && includes(mask, include)
+                   && !intersects(mask, exclude);
+        }
+
+        /** Add a slot to the members, or remove it. */
+        void update(uint32_t index, bool member)
+        {
+            if (index >= positions.size())
+                positions.resize(index + 1, gone);
+
+            auto& pos = positions[index];
+            if (member == (pos != gone))
+                return;
+
+            if (member) {
+                pos = static_cast<uint32_t>(members.size());
+                members.push_back(index);
+            } else if (iterating > 0) {
+                members[pos] = gone;
+                pos = gone;
+                holes = true;
+            } else {
+                auto last = members.back();
+                members[pos] = last;
+                positions[last] = pos;
+                members.pop_back();
+                pos = gone;
+            }
+        }
 
-        elem()
-            : dirty(true)
+        /** Close the holes left by members that were removed during a
+         *  loop. */
+        void compact()
         {
+            size_t to = 0;
+            for (auto index : members) {
+                if (index == gone)
+                    continue;
+
+                positions[index] = static_cast<uint32_t>(to);
+                members[to++] = index;
+            }
+            members.resize(to);
+            holes = false;
         }
+
+        /** Keeps track of the loops over the members. */
+        struct iteration
+        {
+            explicit iteration(query_data& q)
+                : q(q)
+            {
+                ++q.iterating;
+            }
+
+            ~iteration()
+            {
+                if (--q.iterating == 0 && q.holes)
+                    q.compact();
+            }
+
+            query_data& q;
+        };
+
+        component_mask include;
+        component_mask exclude;
+        /** The slot indices of the matching entities. */
+        std::vector<uint32_t> members;
+        /** For every slot, its position in \a members, or \a gone. */
+        std::vector<uint32_t> positions;
+        /** The number of loops over the members that are running. */
+        size_t iterating;
+        /** Set if members were removed during a loop. */
+        bool holes;
     };
 
-    typedef component::placeholder placeholder;
+    /** Keeps track of which slots have a component, for its observers.
+     *  Like a query on a single component, but it logs the entities
+     *  that come and go. */
+    struct watch_data
+    {
+        /** For every slot, whether it had the component when it was
+         *  last looked at. */
+        std::vector<bool> has;
+        /** The entities that got the component since the last
+         *  dispatch_events(). */
+        std::vector<entity> added;
+        /** The entities that lost it. */
+        std::vector<entity> removed;
+    };
 
-    /** Data types that do not have a flat memory layout are kept in the
-    * * elem::data buffer in a placeholder object. */
-    template <typename T>
-    class holder : public placeholder
+    /** Iterates over the slots that are in use.
+     *  The iterator refers to its slot by index, so it stays valid when
+     *  other entities are created or deleted. */
+    template <typename Slots, typename Value>
+    class slot_iterator
     {
+        template <typename, typename>
+        friend class slot_iterator;
+
+        friend class storage;
+
     public:
-        holder() {}
+        typedef std::forward_iterator_tag iterator_category;
+        typedef Value value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef Value* pointer;
+        typedef Value& reference;
+
+        slot_iterator()
+            : slots_(nullptr)
+            , pos_(0)
+        {
+        }
 
-        holder(T&& init)
-            : held_(std::move(init))
+        slot_iterator(Slots* slots, size_t pos)
+            : slots_(slots)
+            , pos_(pos)
         {
+            skip();
         }
 
-        holder(const T& init)
-            : held_(init)
+        /** Allows converting an iterator to a const_iterator. */
+        template <typename S, typename V,
+                  typename = typename std::enable_if<
+                      std::is_convertible<S*, Slots*>::value>::type>
+        slot_iterator(const slot_iterator<S, V>& copy)
+            : slots_(copy.slots_)
+            , pos_(copy.pos_)
         {
         }
 
-        const T& held() const { return held_; }
+        reference operator*() const { return (*slots_)[pos_]; }
 
-        T& held() { return held_; }
+        pointer operator->() const { return &(*slots_)[pos_]; }
 
-        placeholder* clone() const { return new holder<T>(held_); }
+        slot_iterator& operator++()
+        {
+            ++pos_;
+            skip();
+            return *this;
+        }
 
-        void serialize(std::vector<char>& buffer) const
+        slot_iterator operator++(int)
         {
-            es::serialize(held(), buffer);
+            slot_iterator result(*this);
+            ++*this;
+            return result;
         }
 
-        buffer_t::const_iterator deserialize(buffer_t::const_iterator first,
-                                             buffer_t::const_iterator last)
+        template <typename S, typename V>
+        bool operator==(const slot_iterator<S, V>& compare) const
         {
-            return es::deserialize(held(), first, last);
+            return pos_ == compare.pos_;
         }
 
-        void move_to(buffer_t::iterator pos)
+        template <typename S, typename V>
+        bool operator!=(const slot_iterator<S, V>& compare) const
         {
-            auto ptr = reinterpret_cast<holder<T>*>(&*pos);
-            auto tmp = new (ptr) holder<T>(std::move(held_));
-            assert(tmp == ptr);
-            (void)tmp;
+            return pos_ != compare.pos_;
         }
 
     private:
-        T held_;
-    };
+        void skip()
+        {
+            while (pos_ < slots_->size() && !in_use((*slots_)[pos_]))
+                ++pos_;
+        }
 
-    typedef std::unordered_map<uint32_t, elem> stor_impl;
+    private:
+        Slots* slots_;
+        size_t pos_;
+    };
 
 public:
-    typedef uint8_t component_id;
+    typedef es::component_id component_id;
+
+    typedef slot_iterator<stor_impl, slot> iterator;
+    typedef slot_iterator<const stor_impl, const slot> const_iterator;
+
+    /** A handle to a query, see register_query(). */
+    class query
+    {
+        friend class storage;
+
+    public:
+        query()
+            : index_(~uint32_t(0))
+        {
+        }
+
+    private:
+        explicit query(uint32_t index)
+            : index_(index)
+        {
+        }
+
+        uint32_t index_;
+    };
+
+    /** The kinds of events an observer can be told about, see
+     *  observe().  They can be combined with '|'. */
+    enum event {
+        /** The component was added to an entity, or the entity was
+         *  created with it. */
+        on_add = 1,
+        /** The component was removed from an entity, or the entity was
+         *  deleted. */
+        on_remove = 2,
+        /** The component's value was set, or changed by a for_each.
+         *  Components that were just added don't count. */
+        on_change = 4
+    };
+
+    /** A batch of events of one kind, for one component: the entities
+     *  it happened to, each listed once. */
+    struct event_batch
+    {
+        component_id component;
+        event kind;
+        const entity* first;
+        const entity* last;
+
+        const entity* begin() const { return first; }
+        const entity* end() const { return last; }
+        size_t size() const { return last - first; }
+    };
+
+    typedef std::function<void(const event_batch&)> observer_function;
+
+    /** A handle to an observer, see observe(). */
+    class observer
+    {
+        friend class storage;
+
+    public:
+        observer()
+            : index_(~uint32_t(0))
+        {
+        }
+
+    private:
+        explicit observer(uint32_t index)
+            : index_(index)
+        {
+        }
+
+        uint32_t index_;
+    };
 
-    typedef stor_impl::iterator iterator;
-    typedef stor_impl::const_iterator const_iterator;
+private:
+    /** The number of slots handed to a thread at once by
+     *  parallel_for_each. */
+    static const size_t parallel_batch_size = 4096;
+
+    /** Maps any type to a component_id, so a parameter pack of types can
+     *  be turned into a list of IDs. */
+    template <typename>
+    struct id_for
+    {
+        typedef component_id type;
+    };
 
 public:
     std::function<void(iterator)> on_new_entity;
     std::function<void(iterator)> on_deleted_entity;
 
+    /** Holds the locks taken by lock() or lock_structure(), and releases
+     *  them when it goes out of scope. */
+    class access
+    {
+        friend class storage;
+
+    public:
+        access(access&& move)
+            : owner_(move.owner_)
+            , reads_(move.reads_)
+            , writes_(move.writes_)
+            , structure_(move.structure_)
+        {
+            move.owner_ = nullptr;
+        }
+
+        access(const access&) = delete;
+        access& operator=(const access&) = delete;
+
+        ~access()
+        {
+            if (owner_)
+                owner_->unlock(*this);
+        }
+
+    private:
+        access(storage* owner, const component_mask& reads,
+               const component_mask& writes, bool structure)
+            : owner_(owner)
+            , reads_(reads)
+            , writes_(writes)
+            , structure_(structure)
+        {
+        }
+
+        storage* owner_;
+        component_mask reads_;
+        component_mask writes_;
+        bool structure_;
+    };
+
+    /** Where the values of a component are kept. */
+    enum policy {
+        /** Packed together with the entity's other components.  This is
+         *  the fastest to iterate over, but adding or removing the
+         *  component means laying out the entity's data again. */
+        packed,
+        /** In a sparse set of their own.  Adding and removing takes
+         *  constant time and leaves the entity's data alone, and a
+         *  for_each that requires the component only visits the entities
+         *  that have it.  Good for status effects that come and go all
+         *  the time.  Only flat types can be sparse, and sparse
+         *  components can't be used in a prototype. */
+        sparse,
+        /** Reference counted, and shared by copies until one of them is
+         *  written to.  Cloning an entity, or making entities from a
+         *  prototype, only copies a pointer; set(), the non-const get(),
+         *  and a for_each that writes the component give the entity a
+         *  copy of its own first.  Good for large values that many
+         *  entities made from the same prototype only read, such as
+         *  stat tables. */
+        shared
+    };
+
 public:
-    storage();
+    /** @param alloc  The allocator for the entity data, or nullptr to use
+     *                malloc.  It has to outlive the storage. */
+    explicit storage(allocator* alloc = nullptr);
     ~storage();
 
+    /** Register a new component type.  Throws std::logic_error if there
+     *  are already ES_MAX_COMPONENTS components, or if a type that isn't
+     *  flat is registered as sparse.
+     *
+     *  A flat, empty type becomes a tag: it is only a bit in the
+     *  entity's component mask, and takes up no room in its data, no
+     *  matter what the policy is.  Adding and removing a tag never lays
+     *  out the entity again, and it is serialized as just that bit.
+     * @code
+     * struct frozen {};
+     * auto frozen_id = s.register_component<frozen>("frozen");
+     * @endcode */
     template <typename type>
-    component_id register_component(std::string&& name)
+    component_handle<type> register_component(std::string&& name,
+                                              policy how = packed)
     {
+        if (components_.size() >= max_components)
+            throw std::logic_error("too many components");
+
+        if (is_flat<type>::value && std::is_empty<type>::value) {
+            tag_mask_.set(components_.size());
+            components_.emplace_back(std::move(name), 0, typeid(type),
+                                     nullptr);
+            return component_handle<type>(component_added());
+        }
+
+        if (how == sparse && !is_flat<type>::value)
+            throw std::logic_error("only flat components can be sparse");
+
+        if (how == sparse) {
+            components_.emplace_back(std::move(name), sizeof(type),
+                                     typeid(type), nullptr);
+            return component_handle<type>(component_added(true));
+        }
+
+        // Shared values are always kept in a placeholder, even flat ones.
+        if (how == shared) {
+            flat_mask_.set(components_.size());
+            shared_mask_.set(components_.size());
+            components_.emplace_back(
+                std::move(name), sizeof(shared_holder<type>), typeid(type),
+                std::unique_ptr<placeholder>(new shared_holder<type>()));
+            return component_handle<type>(component_added());
+        }
+
         size_t size;
 
         if (is_flat<type>::value) {
@@ -135,18 +519,70 @@ public:
                 std::unique_ptr<placeholder>(new holder<type>()));
         }
 
-        component_id index = components_.size() - 1;
-        size_t block = (index & 0x38) << 5;
-        size_t i = 1 << (index & 0x07);
-
-        for (size_t j = block + i; j != block + i * 2; ++j)
-            component_offsets_[j] = component_offsets_[j - i] + size;
+        return component_handle<type>(component_added());
+    }
 
-        return index;
+    /** Register a component that keeps several copies of its value in
+     *  every entity.  All the usual ways to get or change a value work on
+     *  the next buffer, while get_current() and for_each on current<T>
+     *  see the current one.  Threads that only read the current values
+     *  don't need a lock on the component, only lock() with an empty
+     *  mask, so they never wait for a system that writes the next
+     *  values.  swap_buffers() makes the next values current.
+     *
+     *  Only flat types can be buffered.  Throws std::logic_error if there
+     *  are already ES_MAX_COMPONENTS components, or if \a buffers is less
+     *  than two.
+     * @param buffers  The number of buffers.  With more than two, the
+     *                 values from older frames are kept around as well,
+     *                 but only the next and current values can be
+     *                 reached. */
+    template <typename type>
+    component_handle<type> register_buffered_component(std::string&& name,
+                                                       size_t buffers = 2)
+    {
+        static_assert(is_flat<type>::value,
+                      "only flat components can be buffered");
+        static_assert(!std::is_empty<type>::value,
+                      "tags can't be buffered");
+
+        if (components_.size() >= max_components)
+            throw std::logic_error("too many components");
+        if (buffers < 2)
+            throw std::logic_error("a buffered component needs at least "
+                                   "two buffers");
+
+        components_.emplace_back(std::move(name), sizeof(type) * buffers,
+                                 typeid(type), nullptr, buffers);
+        return component_handle<type>(component_added());
     }
 
+    /** Make the next values of all buffered components the current
+     *  ones.  The new next buffer still holds the values from before;
+     *  systems are expected to overwrite them, usually from the current
+     *  values.  This only changes a few offsets, no matter how many
+     *  entities there are.  It must not run while other threads read or
+     *  write buffered components, take lock_structure() first. */
+    void swap_buffers();
+
+    /** Look up a component by its name.  Throws std::logic_error if
+     *  there is no such component.  If several have the same name, this
+     *  is the first one that was registered. */
     component_id find_component(const std::string& name) const;
 
+    /** Look up a component by its name, and check that it has the right
+     *  type.  Throws std::logic_error if it doesn't exist, or if it has
+     *  a different type. */
+    template <typename T>
+    component_handle<T> find_component(const std::string& name) const
+    {
+        auto id = find_component(name);
+        if (!components_[id].is_of_type<T>())
+            throw std::logic_error("component has a different type");
+
+        return component_handle<T>(id);
+    }
+
     const component& operator[](component_id id) const
     {
         return components_[id];
@@ -154,10 +590,64 @@ public:
 
     const std::vector<component>& components() const { return components_; }
 
+public:
+    /** A template for new entities: a set of components, and the values
+     *  they start out with.  The data is laid out once, and every entity
+     *  created from a prototype gets a straight copy of it.
+     * @code
+     * storage::prototype bullet(s);
+     * bullet.set(pos, vec(0, 0, 0)).set(damage, 10);
+     * s.new_entities(50000, bullet);
+     * @endcode */
+    class prototype
+    {
+        friend class storage;
+
+    public:
+        /** The prototype can only be used with the storage it was made
+         *  for, and only as long as no components are registered. */
+        explicit prototype(storage& owner)
+            : owner_(owner)
+        {
+        }
+
+        ~prototype() { owner_.call_destructors(data_); }
+
+        prototype(const prototype&) = delete;
+        prototype& operator=(const prototype&) = delete;
+
+        template <typename T>
+        prototype& set(component_id c_id, T val)
+        {
+            assert(owner_.components_[c_id].is_of_type<T>());
+            if (owner_.is_sparse(c_id))
+                throw std::logic_error("prototype can't hold a sparse "
+                                       "component");
+
+            owner_.set_value(data_, c_id, std::move(val));
+            return *this;
+        }
+
+        template <typename T>
+        const T& get(component_id c_id) const
+        {
+            assert(owner_.components_[c_id].is_of_type<T>());
+            if (!data_.components[c_id])
+                throw std::logic_error("prototype does not have component");
+
+            return owner_.get<T>(data_, c_id);
+        }
+
+    private:
+        storage& owner_;
+        elem data_;
+    };
+
 public:
     entity new_entity();
 
-    /** Get an entity with a given ID, or create it if it didn't exist yet. */
+    /** Get an entity with a given ID, or create it if it didn't exist yet.
+     *  Throws if the ID's index is held by a different generation. */
     iterator make(uint32_t id);
 
     /** Create a whole bunch of empty entities in one go.
@@ -165,6 +655,13 @@ public:
      * @return The range of entities created */
     std::pair<entity, entity> new_entities(size_t count);
 
+    /** Create a whole bunch of entities with the same initial components.
+     * @param count     The number of entities to create
+     * @param proto     The components and their values
+     * @return The range of entities created */
+    std::pair<entity, entity> new_entities(size_t count,
+                                           const prototype& proto);
+
     entity clone_entity(iterator f);
 
     iterator find(entity en);
@@ -173,15 +670,34 @@ public:
 
     size_t size() const;
 
+    /** Delete all entities at once, without calling on_deleted_entity.
+     *  The components stay registered.  After this, nothing in the
+     *  storage uses its allocator anymore, so a pool_allocator can be
+     *  reset. */
+    void clear();
+
+    /** Delete an entity.
+     * @return False if the entity did not exist (anymore) */
     bool delete_entity(entity en);
 
     void delete_entity(iterator f);
 
     void remove_component_from_entity(iterator en, component_id c);
 
-    bool exists(entity en) const { return entities_.count(en) != 0; }
+    /** Remove several components at once, moving the remaining data
+     *  only once.
+     * @param en    The entity
+     * @param mask  Bitmask of the components to remove */
+    void remove_components_from_entity(iterator en,
+                                       const component_mask& mask);
 
-    bool entity_has_component(iterator en, component_id c) const;
+    bool exists(entity en) const
+    {
+        auto index = entity_index(en);
+        return index < entities_.size() && entities_[index].first == en;
+    }
+
+    bool entity_has_component(const_iterator en, component_id c) const;
 
     template <typename T>
     void set(entity en, component_id c_id, T val)
@@ -192,35 +708,50 @@ public:
     template <typename T>
     void set(iterator en, component_id c_id, T val)
     {
-        assert(c_id < components_.size());
-        const component& c = components_[c_id];
-        assert(c.is_of_type<T>());
-        elem& e = en->second;
-        size_t off = offset(e, c_id);
+        assert(components_[c_id].is_of_type<T>());
+        set_unchecked(en, c_id, std::move(val));
+    }
 
-        if (!e.components[c_id]) {
-            if (e.data.size() < off)
-                e.data.resize(off + c.size());
-            else
-                e.data.insert(e.data.begin() + off, c.size(), 0);
-        }
+    template <typename T>
+    void set(entity en, component_handle<T> c, T val)
+    {
+        set_unchecked(find(en), c, std::move(val));
+    }
 
-        if (is_flat<T>::value) {
-            assert(e.data.size() >= off + sizeof(T));
-            new (&*e.data.begin() + off) T(val);
-        } else {
-            assert(e.data.size() >= off + sizeof(holder<T>));
+    template <typename T>
+    void set(iterator en, component_handle<T> c, T val)
+    {
+        set_unchecked(en, c, std::move(val));
+    }
 
-            auto ptr = reinterpret_cast<holder<T>*>(&*e.data.begin() + off);
-            if (e.components[c_id])
-                ptr->~holder();
+    /** Set several components in one go.  If any of them are new to the
+     *  entity, its data is laid out and moved only once.
+     * @code
+     * s.set_components<vec, vec>(en, pos, vel, vec(0, 0), vec(1, 1));
+     * @endcode */
+    template <typename... Ts>
+    void set_components(entity en, typename id_for<Ts>::type... c,
+                        Ts... vals)
+    {
+        set_components<Ts...>(find(en), c..., std::move(vals)...);
+    }
 
-            auto tmp = new (ptr) holder<T>(std::move(val));
-            assert(tmp == ptr);
-            (void)tmp;
-        }
-        e.components.set(c_id);
-        e.dirty.set(c_id);
+    template <typename... Ts>
+    void set_components(iterator en, typename id_for<Ts>::type... c,
+                        Ts... vals)
+    {
+        check_types<Ts...>(c...);
+        elem& e = en->second;
+        auto mask = make_mask(c...);
+        auto added = mask & ~e.components;
+        if (added.any())
+            change_components(en, e.components | mask);
+
+        int expand[] = {(store_value(en, added, c, std::move(vals)), 0)...};
+        (void)expand;
+        mark_dirty(en, mask);
+        if (added.any())
+            update_queries(en);
     }
 
     template <typename T>
@@ -232,11 +763,8 @@ public:
     template <typename T>
     const T& get(const_iterator en, component_id c_id) const
     {
-        auto& e = en->second;
-        if (!e.components[c_id])
-            throw std::logic_error("entity does not have component");
-
-        return get<T>(e, c_id);
+        assert(components_[c_id].is_of_type<T>());
+        return get_unchecked<T>(en, c_id);
     }
 
     template <typename T>
@@ -248,72 +776,357 @@ public:
     template <typename T>
     T& get(iterator en, component_id c_id)
     {
+        assert(components_[c_id].is_of_type<T>());
+        return get_unchecked<T>(en, c_id);
+    }
+
+    template <typename T>
+    const T& get(entity en, component_handle<T> c) const
+    {
+        return get_unchecked<T>(find(en), c);
+    }
+
+    template <typename T>
+    const T& get(const_iterator en, component_handle<T> c) const
+    {
+        return get_unchecked<T>(en, c);
+    }
+
+    template <typename T>
+    T& get(entity en, component_handle<T> c)
+    {
+        return get_unchecked<T>(find(en), c);
+    }
+
+    template <typename T>
+    T& get(iterator en, component_handle<T> c)
+    {
+        return get_unchecked<T>(en, c);
+    }
+
+    /** The current value of a buffered component, see
+     *  register_buffered_component.  For other components, this is the
+     *  same as get(). */
+    template <typename T>
+    const T& get_current(entity en, component_id c_id) const
+    {
+        return get_current<T>(find(en), c_id);
+    }
+
+    template <typename T>
+    const T& get_current(const_iterator en, component_id c_id) const
+    {
+        assert(components_[c_id].is_of_type<T>());
         auto& e = en->second;
         if (!e.components[c_id])
             throw std::logic_error("entity does not have component");
+        if (is_sparse(c_id))
+            return get_sparse<T>(en.pos_, c_id);
 
-        return get<T>(e, c_id);
+        auto data_ptr(&*e.data.begin() + offset(e, c_id) + read_shift_[c_id]);
+        if (is_shared(c_id))
+            return shared_ref<T>(data_ptr);
+        if (is_flat<T>::value)
+            return *reinterpret_cast<const T*>(data_ptr);
+
+        return reinterpret_cast<const holder<T>*>(data_ptr)->held();
     }
 
-    /** Call a function for every entity that has a given component.
-     *  The callee can then query and change the value of the component through
-     *  a var_ref object, or remove the entity.
-     * @param c     The component to look for.
+
+    /** Call a function for every entity that has a given set of
+     *  components.
+     *  The callee can then query and change the values of the components,
+     *  or remove the entity.
+     *
+     *  The references it is given point into the entity's data, and the
+     *  slots are kept in a vector, with small values stored inline.
+     *  Creating an entity can move all slots, and adding or removing a
+     *  component lays out the entity's data again; either way the
+     *  references are left dangling.  Don't touch them after such a
+     *  change, or queue the change in a command_buffer and play it back
+     *  after the loop.
+     * @code
+     * s.for_each<vec, vec>(pos, vel, [](storage::iterator, vec& p, vec& v) {
+     *     p += v;
+     * });
+     * @endcode
+     * @param c     The components to look for, one for every type in Ts.
      * @param func  The function to call.  This function will be passed an
-     *              iterator to the current entity, and a var_ref corresponding
-     *              to the component value in this entity. */
-    template <typename T>
-    void for_each(component_id c, std::function<uint64_t(iterator, T&)> func)
-    {
-        std::bitset<64> mask;
-        mask.set(c);
-        for (auto i(begin()); i != end();) {
-            auto next = std::next(i);
-            elem& e(i->second);
-            if ((e.components & mask) == mask) {
-                e.dirty |= (func(i, get<T>(e, c)) & mask.to_ullong());
-            }
-            i = next;
-        }
+     *              iterator to the current entity, and a reference to each
+     *              of the component values in this entity.  It can return
+     *              a bitmask of the components that were changed.  If it
+     *              returns void, all components in \a c are marked as
+     *              changed.
+     *
+     * Components can be marked as optional<T>.  These are not required
+     * for an entity to be visited; the callback gets a pointer to the
+     * value, or a null pointer if the entity doesn't have it. */
+    template <typename... Ts, typename Func>
+    void for_each(typename id_for<Ts>::type... c, Func&& func)
+    {
+        for_each_in<Ts...>(0, entities_.size(), component_mask(), nullptr,
+                           func, c...);
+    }
+
+    /** Like for_each, but skips the entities that have any of the
+     *  components in a mask.
+     * @code
+     * s.for_each<vec>(component_mask().set(frozen), pos,
+     *                 [](storage::iterator, vec& p) { p.y -= 1; });
+     * @endcode */
+    template <typename... Ts, typename Func>
+    void for_each(const component_mask& exclude,
+                  typename id_for<Ts>::type... c, Func&& func)
+    {
+        for_each_in<Ts...>(0, entities_.size(), exclude, nullptr, func, c...);
     }
 
-    template <typename T1, typename T2>
-    void for_each(component_id c1, component_id c2,
-                  std::function<uint64_t(iterator, T1&, T2&)> func)
+    /** Like for_each, but splits the entities in batches that are
+     *  processed in parallel by a job_system.
+     *  The callback can change the values of the components it is given,
+     *  but it must not create or delete entities, or add or remove
+     *  components.  Every batch keeps its own list of changes, these
+     *  are merged once it is done.
+     * @param jobs  The thread pool that does the work
+     * @param c     The components to look for, one for every type in Ts.
+     * @param func  The function to call, see for_each. */
+    template <typename... Ts, typename Func>
+    void parallel_for_each(job_system& jobs, typename id_for<Ts>::type... c,
+                           Func&& func)
     {
-        std::bitset<64> mask;
-        mask.set(c1);
-        mask.set(c2);
-        for (auto i(begin()); i != end();) {
-            auto next = std::next(i);
-            elem& e = i->second;
-            if ((e.components & mask) == mask)
-                e.dirty |= (func(i, get<T1>(e, c1), get<T2>(e, c2))
-                            & mask.to_ullong());
+        jobs.parallel_for(entities_.size(), parallel_batch_size,
+                          [&](size_t first, size_t last) {
+            std::vector<uint32_t> changed;
+            for_each_in<Ts...>(first, last, component_mask(), &changed, func,
+                               c...);
+            merge_changes(changed);
+        });
+    }
 
-            i = next;
+    /** Call a function for every entity that has changed since the last
+     *  call to clear_changes().  An entity has changed if it was created,
+     *  components were added or removed, or any of its components was
+     *  marked as dirty.  This only visits the changed entities, instead
+     *  of every entity in the storage.
+     * @param func  The function to call, with an iterator to the
+     *              entity */
+    template <typename Func>
+    void for_each_changed(Func&& func)
+    {
+        for (size_t i = 0; i < changes_.size(); ++i) {
+            auto index = changes_[i];
+            if (index < entities_.size() && in_use(entities_[index]))
+                func(iterator(&entities_, index));
         }
     }
 
-    template <typename T1, typename T2, typename T3>
-    void for_each(component_id c1, component_id c2, component_id c3,
-                  std::function<uint64_t(iterator, T1&, T2&, T3&)> func)
+    /** Call a function for every entity that has a dirty flag for a
+     *  given component.
+     * @param c     The component
+     * @param func  The function to call, with an iterator to the
+     *              entity */
+    template <typename Func>
+    void for_each_changed(component_id c, Func&& func)
     {
-        std::bitset<64> mask;
-        mask.set(c1);
-        mask.set(c2);
-        mask.set(c3);
-        for (auto i(begin()); i != end();) {
-            auto next = std::next(i);
-            elem& e = i->second;
-            if ((e.components & mask) == mask) {
-                e.dirty |= (func(i, get<T1>(e, c1), get<T2>(e, c2),
-                                 get<T3>(e, c3)) & mask.to_ullong());
-            }
-            i = next;
+        for_each_changed([&](iterator en) {
+            if (dirty_[en.pos_][c])
+                func(en);
+        });
+    }
+
+    /** Reset the dirty flags of all changed entities, and empty the
+     *  list of changes.  This is meant to be called once per frame,
+     *  after everything that is interested in the changes had a look. */
+    void clear_changes();
+
+    /** Turn the list of changes and the dirty flags on or off.  They
+     *  are on by default.  Without them, every slot is a component mask
+     *  smaller, and marking components as dirty costs nothing; but
+     *  for_each_changed() never visits anything, check_dirty() is
+     *  always false, observers get no on_change events, and a
+     *  delta_encoder can't be used.  Turning tracking on again starts
+     *  with a clean slate. */
+    void track_changes(bool on);
+
+    bool tracks_changes() const { return tracking_; }
+
+    /** Register a query for all entities that have a given set of
+     *  components, and none of another set.  The storage keeps the list
+     *  of matching entities up to date as components are added and
+     *  removed, so a for_each over the query only visits the entities
+     *  that match.  This pays off for components that only a few
+     *  entities have.
+     * @param include   The components an entity must have
+     * @param exclude   The components an entity must not have
+     * @return A handle to the query */
+    query register_query(const component_mask& include,
+                         const component_mask& exclude = component_mask());
+
+    /** Stop keeping track of a query.  The handle can not be used
+     *  anymore. */
+    void unregister_query(query q);
+
+    /** The number of entities that match a query. */
+    size_t query_size(query q) const;
+
+    /** Register an observer for a component.  Events are not delivered
+     *  as they happen: they are collected, and dispatch_events() hands
+     *  every observer one batch per kind of event.  Entities that are
+     *  added and removed again before that show up in both batches.
+     *  Nothing is called from set() or a for_each: on_change events are
+     *  worked out from the list of changes, and keeping track of
+     *  on_add and on_remove costs about as much as a query.
+     * @code
+     * s.observe(pos, storage::on_add | storage::on_remove,
+     *           [&](const storage::event_batch& b) {
+     *     for (auto en : b)
+     *         b.kind == storage::on_add ? grid.insert(en) : grid.erase(en);
+     * });
+     * @endcode
+     * @param c       The component to observe
+     * @param events  The kinds of events, see event
+     * @param func    Called with every batch
+     * @return A handle to the observer */
+    observer observe(component_id c, unsigned int events,
+                     observer_function func);
+
+    /** Stop delivering events to an observer.  The handle can not be
+     *  used anymore. */
+    void unobserve(observer o);
+
+    /** Hand the events since the last call to the observers, and then
+     *  clear_changes().  This is meant to replace the call to
+     *  clear_changes() at the end of a frame; on_change events come
+     *  from the dirty flags, so they are lost if those are cleared
+     *  first, and include anything that was dirty before the observer
+     *  was registered.  The callbacks can change the storage, those changes go
+     *  in the next batch. */
+    void dispatch_events();
+
+    /** Like for_each, but only visits the entities that match a query,
+     *  and have all components in \a c.  Entities that start matching
+     *  the query during the loop are not visited.
+     * @code
+     * auto burning = s.register_query(component_mask().set(fire));
+     * s.for_each<float>(burning, fire, [](storage::iterator, float& t) {
+     *     t -= 0.1f;
+     * });
+     * @endcode */
+    template <typename... Ts, typename Func>
+    void for_each(query q, typename id_for<Ts>::type... c, Func&& func)
+    {
+        auto& data = find_query(q);
+        if (any_indirect(make_mask(c...)))
+            for_each_in<Ts...>(make_index_sequence<sizeof...(Ts)>(),
+                               std::true_type(), data, func, c...);
+        else
+            for_each_in<Ts...>(make_index_sequence<sizeof...(Ts)>(),
+                               std::false_type(), data, func, c...);
+    }
+
+    /** Lock components for reading and writing, until the returned
+     *  object is destroyed.  The locks are always taken in the same
+     *  order, so two threads can never deadlock on them.  A thread must
+     *  release its locks before it takes new ones.
+     * @code
+     * // On a network thread, while the simulation moves things around:
+     * auto guard = s.lock(component_mask().set(pos));
+     * for (auto i = s.cbegin(); i != s.cend(); ++i)
+     *     send(i->first, s.get<vec>(i, pos));
+     * @endcode
+     * @param reads   The components that will only be read
+     * @param writes  The components whose values will be changed */
+    access lock(const component_mask& reads,
+                const component_mask& writes = component_mask());
+
+    /** Get exclusive access to everything, to create or delete entities,
+     *  or add or remove components.  This waits until all other locks
+     *  have been released. */
+    access lock_structure();
+
+    /** Move the data of all entities to fresh memory, in slot order.
+     *  After a lot of churn, the data of entities that are next to each
+     *  other ends up all over the heap; this puts it back in sequence,
+     *  so for_each walks through memory in one direction.  Entities that
+     *  keep their data inline are not touched.
+     *
+     *  The old memory is only released at the end, so this temporarily
+     *  needs twice the memory for the entity data.  Iterators stay
+     *  valid, but references to component values do not. */
+    void compact();
+
+    /** Like compact(), but lays out the data in order of a key, and
+     *  makes for_each_ordered() visit the entities in that order.  Use
+     *  a spatial key such as a Morton code of the position to keep
+     *  entities that are close to each other close in memory.
+     * @code
+     * s.compact([&](storage::const_iterator i) {
+     *     return morton_code(s.get<vec>(i, pos));
+     * });
+     * @endcode
+     * @param key  Called once for every entity, returns a value that
+     *             can be compared with operator< */
+    template <typename Key>
+    void compact(Key&& key)
+    {
+        typedef decltype(key(std::declval<const_iterator>())) key_type;
+        std::vector<std::pair<key_type, uint32_t>> keys;
+        keys.reserve(size_);
+        for (auto i = cbegin(); i != cend(); ++i)
+            keys.emplace_back(key(i), static_cast<uint32_t>(i.pos_));
+
+        std::stable_sort(keys.begin(), keys.end(),
+                         [](const std::pair<key_type, uint32_t>& a,
+                            const std::pair<key_type, uint32_t>& b) {
+                             return a.first < b.first;
+                         });
+
+        // Free slots go at the end, so they are still visited when they
+        // are taken again.
+        std::vector<uint32_t> order;
+        order.reserve(entities_.size());
+        for (auto& k : keys)
+            order.push_back(k.second);
+        for (size_t i = 0; i < entities_.size(); ++i) {
+            if (!in_use(entities_[i]))
+                order.push_back(static_cast<uint32_t>(i));
         }
+        compact_in_order(std::move(order));
+    }
+
+    /** Like for_each, but visits the entities in the order of the last
+     *  compact().  Entities that were made after that come last, in
+     *  slot order. */
+    template <typename... Ts, typename Func>
+    void for_each_ordered(typename id_for<Ts>::type... c, Func&& func)
+    {
+        if (any_indirect(make_mask(c...)))
+            for_each_ordered_in<Ts...>(make_index_sequence<sizeof...(Ts)>(),
+                                       std::true_type(), func, c...);
+        else
+            for_each_ordered_in<Ts...>(make_index_sequence<sizeof...(Ts)>(),
+                                       std::false_type(), func, c...);
     }
 
+    /** The counters for loops and relayouts.  These are only kept if
+     *  the library was built with ES_INSTRUMENTATION, otherwise they are
+     *  always zero.  Loops that run in parallel count every batch as one
+     *  call, and add up the time spent in all threads. */
+    storage_stats stats() const;
+
+    void reset_stats();
+
+    /** The memory taken up by every component, in the order they were
+     *  registered.  This is worked out on the spot, so it works with or
+     *  without instrumentation, but it has to look at every entity. */
+    std::vector<component_footprint> footprint() const;
+
+    /** Where the memory of the storage goes: the fixed cost of every
+     *  slot, the bookkeeping, and the entity data with the bytes that
+     *  were allocated but aren't used.  Like footprint(), this looks at
+     *  every entity. */
+    memory_usage memory_stats() const;
+
     bool check_dirty(iterator en);
     bool check_dirty_and_clear(iterator en);
 
@@ -323,63 +1136,1038 @@ public:
     void serialize(const_iterator en, std::vector<char>& buffer) const;
     void deserialize(iterator en, const std::vector<char>& buffer);
 
-    iterator begin() { return entities_.begin(); }
+    /** Deserialize an entity straight from memory, without copying the
+     *  data to a vector first. */
+    void deserialize(iterator en, const char* data, size_t size);
 
-    iterator end() { return entities_.end(); }
+    /** Deserialize an entity from a reader, and leave the reader at the
+     *  end of the entity's data.  This way, a single buffer can hold any
+     *  number of entities. */
+    void deserialize(iterator en, reader& in);
 
-    const_iterator begin() const { return entities_.begin(); }
+    /** Write a snapshot of all entities to a buffer.  The format is
+     *  described in snapshot.hpp; flat components are written as arrays,
+     *  only non-flat components go through es::serialize.
+     * @param buffer  Gets replaced by the snapshot */
+    void write_snapshot(std::vector<char>& buffer) const;
 
-    const_iterator end() const { return entities_.end(); }
+    /** Replace all entities with the ones from a snapshot.  Entities keep
+     *  their IDs.  The components in the snapshot have to be registered
+     *  under the same names and with the same types, but not necessarily
+     *  in the same order.  No on_new_entity or on_deleted_entity hooks
+     *  are called.
+     * @param data  The snapshot, aligned to 16 bytes.  It can be memory
+     *              mapped; it is not needed anymore afterwards.
+     * @param size  The size of the snapshot in bytes */
+    void read_snapshot(const char* data, size_t size);
 
-    const_iterator cbegin() const { return entities_.cbegin(); }
+    iterator begin() { return iterator(&entities_, 0); }
 
-    const_iterator cend() const { return entities_.cend(); }
-
-private:
-    template <typename T>
-    const T& get(const elem& e, component_id c_id) const
-    {
-        assert(components_[c_id].is_of_type<T>());
-        auto data_ptr(&*e.data.begin() + offset(e, c_id));
-        if (is_flat<T>::value)
-            return *reinterpret_cast<const T*>(data_ptr);
+    iterator end() { return iterator(&entities_, entities_.size()); }
 
-        auto obj_ptr(reinterpret_cast<const holder<T>*>(data_ptr));
-        return obj_ptr->held();
-    }
+    const_iterator begin() const { return const_iterator(&entities_, 0); }
 
-    template <typename T>
-    T& get(elem& e, component_id c_id)
+    const_iterator end() const
     {
-        assert(components_[c_id].is_of_type<T>());
-        auto data_ptr(&*e.data.begin() + offset(e, c_id));
-        if (is_flat<T>::value)
-            return *reinterpret_cast<T*>(data_ptr);
-
-        auto obj_ptr(reinterpret_cast<holder<T>*>(data_ptr));
-        return obj_ptr->held();
+        return const_iterator(&entities_, entities_.size());
     }
 
-    size_t offset(const elem& e, component_id c) const;
+    const_iterator cbegin() const { return begin(); }
 
-    void call_destructors(iterator i) const;
+    const_iterator cend() const { return end(); }
 
 private:
-    /** Keeps track of entity IDs to give out. */
-    uint32_t next_id_;
+    /** A small direct-mapped cache from component masks to the offsets
+     *  of the N components a for_each is interested in.  Entities with
+     *  the same set of components have the same offsets, so usually only
+     *  a handful of masks need to be worked out. */
+    template <size_t N>
+    class offset_cache
+    {
+        static const size_t lines = 16;
 
-    /** The list of registered components. */
-    std::vector<component> components_;
+    public:
+        offset_cache()
+        {
+            // Fill every line with a mask that belongs in another line,
+            // so it can never be found.
+            for (size_t i = 0; i < lines; ++i)
+                lines_[i].mask = component_mask(i == 0 ? 1 : 0);
+        }
 
-    /** Mapping entity IDs to their data. */
-    std::unordered_map<uint32_t, elem> entities_;
+        size_t* find(const component_mask& mask)
+        {
+            auto& l = lines_[line(mask)];
+            return l.mask == mask ? l.offsets : nullptr;
+        }
 
-    /** A lookup table for the data offsets of components. */
+        size_t* insert(const component_mask& mask)
+        {
+            auto& l = lines_[line(mask)];
+            l.mask = mask;
+            return l.offsets;
+        }
+
+    private:
+        static size_t line(const component_mask& mask)
+        {
+            return mask_hash(mask) >> 60;
+        }
+
+        struct line_t
+        {
+            component_mask mask;
+            size_t offsets[N ? N : 1];
+        };
+
+        line_t lines_[lines];
+    };
+
+    /** Interpret a pointer into an entity's data as a component value. */
+    template <typename T>
+    static T& ref(char* ptr)
+    {
+        if (is_flat<T>::value)
+            return *reinterpret_cast<T*>(ptr);
+
+        return reinterpret_cast<holder<T>*>(ptr)->held();
+    }
+
+    /** Like ref(), but a shared value is copied first if other entities
+     *  use it as well. */
+    template <typename T>
+    T& ref(char* ptr, component_id c_id) const
+    {
+        if (is_shared(c_id))
+            return reinterpret_cast<shared_holder<T>*>(ptr)->held();
+
+        return ref<T>(ptr);
+    }
+
+    /** Read a shared value, without making a copy. */
+    template <typename T>
+    static const T& shared_ref(const char* ptr)
+    {
+        return reinterpret_cast<const shared_holder<T>*>(ptr)->held();
+    }
+
+    template <typename T>
+    const T& get_unchecked(const_iterator en, component_id c_id) const
+    {
+        auto& e = en->second;
+        if (!e.components[c_id])
+            throw std::logic_error("entity does not have component");
+        if (is_sparse(c_id))
+            return get_sparse<T>(en.pos_, c_id);
+
+        return get<T>(e, c_id);
+    }
+
+    template <typename T>
+    T& get_unchecked(iterator en, component_id c_id)
+    {
+        auto& e = en->second;
+        if (!e.components[c_id])
+            throw std::logic_error("entity does not have component");
+        if (is_sparse(c_id))
+            return get_sparse<T>(en.pos_, c_id);
+
+        return get<T>(e, c_id);
+    }
+
+    template <typename T>
+    void set_unchecked(iterator en, component_id c_id, T val)
+    {
+        bool added = !en->second.components[c_id];
+        if (is_sparse(c_id))
+            set_sparse(en, c_id, std::move(val));
+        else
+            set_value(en->second, c_id, std::move(val));
+
+        mark_dirty(en, component_mask().set(c_id));
+        if (added)
+            update_queries(en);
+    }
+
+    template <typename T>
+    const T& get(const elem& e, component_id c_id) const
+    {
+        auto data_ptr(&*e.data.begin() + value_offset(e, c_id));
+        if (is_shared(c_id))
+            return shared_ref<T>(data_ptr);
+        if (is_flat<T>::value)
+            return *reinterpret_cast<const T*>(data_ptr);
+
+        auto obj_ptr(reinterpret_cast<const holder<T>*>(data_ptr));
+        return obj_ptr->held();
+    }
+
+    template <typename T>
+    T& get(elem& e, component_id c_id)
+    {
+        return ref<T>(&*e.data.begin() + value_offset(e, c_id), c_id);
+    }
+
+    /** Store a component value in an entity's data buffer. */
+    template <typename T>
+    void set_value(elem& e, component_id c_id, T val)
+    {
+        assert(c_id < components_.size());
+
+        if (e.components[c_id]) {
+            assign(&*e.data.begin() + value_offset(e, c_id), c_id,
+                   std::move(val));
+        } else if (is_tag(c_id)) {
+            e.components.set(c_id);
+        } else {
+            relayout(e, component_mask(e.components).set(c_id));
+            construct_value(e, c_id, std::move(val));
+        }
+    }
+
+    /** Store a component value in a slot that was made by relayout, but
+     *  not initialized yet.  A buffered component gets the value in all
+     *  of its buffers. */
+    template <typename T>
+    void construct_value(elem& e, component_id c_id, T val)
+    {
+        size_t off = offset(e, c_id);
+        if (is_shared(c_id)) {
+            assert(e.data.size() >= off + sizeof(shared_holder<T>));
+            new (&*e.data.begin() + off) shared_holder<T>(std::move(val));
+        } else if (is_flat<T>::value) {
+            size_t end = off + components_[c_id].size();
+            assert(e.data.size() >= end);
+            for (; off != end; off += sizeof(T))
+                new (&*e.data.begin() + off) T(val);
+        } else {
+            assert(e.data.size() >= off + sizeof(holder<T>));
+            assert(!e.data.is_inline());
+            new (&*e.data.begin() + off) holder<T>(std::move(val));
+        }
+    }
+
+    /** One step of set_components.  The entity has been given all of
+     *  the components already. */
+    template <typename T>
+    void store_value(iterator en, const component_mask& added,
+                     component_id c_id, T val)
+    {
+        auto& e = en->second;
+        if (is_sparse(c_id))
+            get_sparse<T>(en.pos_, c_id) = std::move(val);
+        else if (added[c_id])
+            construct_value(e, c_id, std::move(val));
+        else
+            assign(&*e.data.begin() + value_offset(e, c_id), c_id,
+                   std::move(val));
+    }
+
+    /** Overwrite a value in an entity's data.  A shared value is
+     *  replaced without copying it first. */
+    template <typename T>
+    void assign(char* ptr, component_id c_id, T val)
+    {
+        if (is_shared(c_id))
+            reinterpret_cast<shared_holder<T>*>(ptr)->assign(std::move(val));
+        else
+            ref<T>(ptr) = std::move(val);
+    }
+
+    bool is_sparse(component_id c) const { return sparse_mask_[c]; }
+
+    bool is_tag(component_id c) const { return tag_mask_[c]; }
+
+    bool is_shared(component_id c) const { return shared_mask_[c]; }
+
+    /** Check if a for_each over these components has to look up some of
+     *  them one entity at a time, because they are sparse or shared. */
+    bool any_indirect(const component_mask& mask) const
+    {
+        return intersects(mask, sparse_mask_ | shared_mask_);
+    }
+
+    /** Store the value of a sparse component, adding it if needed. */
+    template <typename T>
+    void set_sparse(iterator en, component_id c_id, T val)
+    {
+        auto& set = *sparse_[c_id];
+        char* ptr = set.find(en.pos_);
+        if (ptr == nullptr) {
+            ptr = set.insert(en.pos_);
+            en->second.components.set(c_id);
+        }
+        *reinterpret_cast<T*>(ptr) = std::move(val);
+    }
+
+    /** The value of a sparse component, for the entity in a slot that
+     *  has it. */
+    template <typename T>
+    T& get_sparse(size_t index, component_id c_id)
+    {
+        assert(sparse_[c_id]->contains(index));
+        return *reinterpret_cast<T*>(sparse_[c_id]->find(index));
+    }
+
+    template <typename T>
+    const T& get_sparse(size_t index, component_id c_id) const
+    {
+        assert(sparse_[c_id]->contains(index));
+        return *reinterpret_cast<const T*>(sparse_[c_id]->find(index));
+    }
+
+    /** Where the data of a component starts, for the entity in a slot
+     *  that has it.  This works for both packed and sparse components. */
+    char* component_data(size_t index, component_id c)
+    {
+        if (is_sparse(c))
+            return sparse_[c]->find(index);
+
+        auto& e = entities_[index].second;
+        return &e.data[offset(e, c)];
+    }
+
+    const char* component_data(size_t index, component_id c) const
+    {
+        if (is_sparse(c))
+            return sparse_[c]->find(index);
+
+        auto& e = entities_[index].second;
+        return &e.data[offset(e, c)];
+    }
+
+    /** Of the sparse components in a mask, the one with the fewest
+     *  values, or null if there are none. */
+    const sparse_set* smallest_set(const component_mask& mask) const;
+
+    /** Where a component's data starts in an entity's buffer.  For a
+     *  buffered component, this is the start of the first buffer. */
+    size_t offset(const elem& e, component_id c) const
+    {
+        assert(c < components_.size());
+
+        return layout_size(e.components & mask_below(c));
+    }
+
+    /** Where the next value of a component is. */
+    size_t value_offset(const elem& e, component_id c) const
+    {
+        return offset(e, c) + write_shift_[c];
+    }
+
+    /** Copy a component's data out of an entity.  The buffers of a
+     *  buffered component come out in a fixed order: next, current,
+     *  then the older ones, so the result doesn't depend on how often
+     *  swap_buffers() was called. */
+    void write_buffers(component_id c, const char* from, char* to) const;
+
+    /** The reverse of write_buffers(), puts the buffers back where this
+     *  storage's shifts expect them. */
+    void read_buffers(component_id c, const char* from, char* to) const;
+
+    /** The number of bytes needed to store a given set of components. */
+    size_t layout_size(const component_mask& components) const
+    {
+        size_t result{0};
+        for (size_t w{0}; w < mask_words; ++w) {
+            auto mask = mask_word(components, w);
+            for (size_t i{w * 8}; mask != 0; ++i) {
+                result += component_offsets_[(i << 8) + (mask & 0xff)];
+                mask >>= 8;
+            }
+        }
+
+        return result;
+    }
+
+    /** The for_each loop, over the slots in [first, last).
+     * @param changed  If not null, the indices of the entities that were
+     *                 changed are added to this list, instead of to the
+     *                 storage's list of changes. */
+    template <typename... Ts, typename Func>
+    void for_each_in(size_t first, size_t last,
+                     const component_mask& exclude,
+                     std::vector<uint32_t>* changed, Func& func,
+                     typename id_for<Ts>::type... c)
+    {
+        if (any_indirect(make_mask(c...)))
+            for_each_in<Ts...>(make_index_sequence<sizeof...(Ts)>(),
+                               std::true_type(), first, last, exclude,
+                               changed, func, c...);
+        else
+            for_each_in<Ts...>(make_index_sequence<sizeof...(Ts)>(),
+                               std::false_type(), first, last, exclude,
+                               changed, func, c...);
+    }
+
+    /** The loops are compiled twice: with \a Indirect true, some of the
+     *  components can be in a sparse set or shared, and need to be
+     *  looked up for every entity. */
+    template <typename... Ts, size_t... I, typename Indirect, typename Func>
+    void for_each_in(index_sequence<I...> seq, Indirect indirect, size_t first,
+                     size_t last,
+                     const component_mask& exclude,
+                     std::vector<uint32_t>* changed, Func& func,
+                     typename id_for<Ts>::type... c)
+    {
+        check_types<Ts...>(c...);
+        const component_id ids[sizeof...(Ts) + 1] = {c...};
+        auto mask = required_mask<Ts...>(c...);
+        auto bits = written_mask<Ts...>(c...);
+        // Free slots have no components, so they only need to be
+        // skipped explicitly if nothing is required.
+        bool skip_free = mask.none();
+        offset_cache<sizeof...(Ts)> cache;
+        change_list deferred;
+        bool defer = concurrent();
+        ES_INSTRUMENT(stopwatch timer; size_t matched = 0;)
+
+        auto step = [&](size_t i) {
+            auto& found = entities_[i];
+            if (!includes(found.second.components, mask)
+                || intersects(found.second.components, exclude)
+                || (skip_free && !in_use(found)))
+                return;
+
+            ES_INSTRUMENT(++matched;)
+            auto dirty = visit<Ts...>(seq, i, cache, ids, bits, indirect, func);
+            if (dirty.any())
+                note_change(i, dirty, defer, deferred, changed);
+        };
+
+        // If a sparse component is required, only its entities need to
+        // be looked at.  The callee can add and remove sparse components,
+        // which moves the members of the set around, so go by a copy of
+        // the list; step() skips the ones that no longer match.
+        auto set = Indirect::value && first == 0 && last == entities_.size()
+                       ? smallest_set(mask)
+                       : nullptr;
+        if (set) {
+            const std::vector<uint32_t> members(set->slots());
+            for (auto index : members)
+                step(index);
+        } else {
+            for (size_t i = first; i < last; ++i)
+                step(i);
+        }
+        ES_INSTRUMENT(count_loop(set ? set->size() : last - first, matched,
+                                 timer);)
+        merge_changes(deferred);
+    }
+
+    /** The for_each loop over the members of a query. */
+    template <typename... Ts, size_t... I, typename Indirect, typename Func>
+    void for_each_in(index_sequence<I...> seq, Indirect indirect, query_data& q,
+                     Func& func,
+                     typename id_for<Ts>::type... c)
+    {
+        check_types<Ts...>(c...);
+        const component_id ids[sizeof...(Ts) + 1] = {c...};
+        auto mask = required_mask<Ts...>(c...);
+        // Components outside the query have to be checked per entity.
+        bool check = (mask & ~q.include).any();
+        auto bits = written_mask<Ts...>(c...);
+        offset_cache<sizeof...(Ts)> cache;
+
+        // Members that leave the query during the loop are only marked,
+        // and members that join are added to the end.  Either way, the
+        // members that have yet to be visited stay where they are.
+        query_data::iteration guard(q);
+        change_list deferred;
+        bool defer = concurrent();
+        ES_INSTRUMENT(stopwatch timer; size_t matched = 0;)
+        for (size_t k = 0, count = q.members.size(); k < count; ++k) {
+            auto i = q.members[k];
+            if (i == query_data::gone)
+                continue;
+
+            if (check && !includes(entities_[i].second.components, mask))
+                continue;
+
+            ES_INSTRUMENT(++matched;)
+            auto dirty = visit<Ts...>(seq, i, cache, ids, bits, indirect, func);
+            if (dirty.any())
+                note_change(i, dirty, defer, deferred);
+        }
+        ES_INSTRUMENT(count_loop(q.members.size(), matched, timer);)
+        merge_changes(deferred);
+    }
+
+    /** The for_each loop over all slots, in the order of the last
+     *  compact().  Slots that were added since then come last. */
+    template <typename... Ts, size_t... I, typename Indirect, typename Func>
+    void for_each_ordered_in(index_sequence<I...> seq, Indirect indirect,
+                             Func& func,
+                             typename id_for<Ts>::type... c)
+    {
+        check_types<Ts...>(c...);
+        const component_id ids[sizeof...(Ts) + 1] = {c...};
+        auto mask = required_mask<Ts...>(c...);
+        auto bits = written_mask<Ts...>(c...);
+        bool skip_free = mask.none();
+        offset_cache<sizeof...(Ts)> cache;
+        change_list deferred;
+        bool defer = concurrent();
+        ES_INSTRUMENT(stopwatch timer; size_t matched = 0;)
+
+        size_t ordered = order_.size(), count = entities_.size();
+        for (size_t k = 0; k < count; ++k) {
+            size_t i = k < ordered ? order_[k] : k;
+            auto& found = entities_[i];
+            if (!includes(found.second.components, mask)
+                || (skip_free && !in_use(found)))
+                continue;
+
+            ES_INSTRUMENT(++matched;)
+            auto dirty = visit<Ts...>(seq, i, cache, ids, bits, indirect, func);
+            if (dirty.any())
+                note_change(i, dirty, defer, deferred);
+        }
+        ES_INSTRUMENT(count_loop(count, matched, timer);)
+        merge_changes(deferred);
+    }
+
+#if ES_INSTRUMENTATION
+    void count_loop(size_t visited, size_t matched, const stopwatch& timer)
+    {
+        counters_.calls.add(1);
+        counters_.visited.add(visited);
+        counters_.matched.add(matched);
+        counters_.nanoseconds.add(timer.nanoseconds());
+    }
+#endif
+
+    /** Call a for_each callback for the entity in a given slot.  The
+     *  callback can create entities, which can move \a entities_, so
+     *  nothing may hold on to the slot or its data after the call.
+     * @return The components that were changed */
+    template <typename... Ts, size_t... I, typename Indirect, typename Func>
+    component_mask visit(index_sequence<I...>, size_t i,
+                         offset_cache<sizeof...(Ts)>& cache,
+                         const component_id* ids, const component_mask& bits,
+                         Indirect indirect, Func& func)
+    {
+        typedef decltype(func(
+            std::declval<iterator>(),
+            std::declval<typename component_type<Ts>::param>()...))
+            result_type;
+
+        elem& e = entities_[i].second;
+        auto& key = e.components;
+        auto offsets = cache.find(key);
+        if (offsets == nullptr) {
+            offsets = cache.insert(key);
+            const bool current[] = {component_type<Ts>::is_current::value...,
+                                    false};
+            for (size_t j = 0; j < sizeof...(Ts); ++j) {
+                auto c = ids[j];
+                offsets[j] = !e.components[c] ? absent
+                             : is_sparse(c) ? in_set
+                             : offset(e, c)
+                                   + (current[j] ? read_shift_[c]
+                                                 : write_shift_[c]);
+            }
+        }
+
+        // Optional components that are missing are never marked dirty.
+        char* data = &*e.data.begin();
+        (void)data;
+        (void)indirect;
+        return invoke(std::is_void<result_type>(), bits & key, func,
+                      iterator(&entities_, i),
+                      fetch<Ts>(indirect, data, offsets[I], i, ids[I])...);
+    }
+
+    /** A for_each callback argument, for a loop without sparse or shared
+     *  components. */
+    template <typename C>
+    typename component_type<C>::param fetch(std::false_type, char* data,
+                                            size_t off, size_t, component_id)
+    {
+        return arg<typename component_type<C>::type>(
+            typename component_type<C>::is_optional(), data, off);
+    }
+
+    /** A for_each callback argument, for a loop that has sparse or
+     *  shared components.  A shared value is copied first, unless the
+     *  callback only reads its current value. */
+    template <typename C>
+    typename component_type<C>::param fetch(std::true_type, char* data,
+                                            size_t off, size_t i,
+                                            component_id c)
+    {
+        typedef typename component_type<C>::type T;
+        char* ptr = locate(data, off, i, c);
+        T* value = nullptr;
+        if (ptr && component_type<C>::is_current::value && is_shared(c))
+            value = const_cast<T*>(&shared_ref<T>(ptr));
+        else if (ptr)
+            value = &ref<T>(ptr, c);
+
+        return arg_at<T>(typename component_type<C>::is_optional(), value);
+    }
+
+    /** Marks a component that an entity does not have, in the offset
+     *  cache. */
+    static const size_t absent = ~size_t(0);
+
+    /** Marks a sparse component in the offset cache. */
+    static const size_t in_set = ~size_t(1);
+
+    /** Where a for_each finds a component's value, or null if the
+     *  entity doesn't have it. */
+    char* locate(char* data, size_t off, size_t i, component_id c)
+    {
+        if (off == absent)
+            return nullptr;
+        if (off == in_set)
+            return sparse_[c]->find(i);
+
+        return data + off;
+    }
+
+    /** The value of a required component, for a for_each callback. */
+    template <typename T>
+    static T& arg(std::false_type, char* data, size_t off)
+    {
+        return ref<T>(data + off);
+    }
+
+    /** The value of an optional component, or null if it is absent. */
+    template <typename T>
+    static T* arg(std::true_type, char* data, size_t off)
+    {
+        return off == absent ? nullptr : &ref<T>(data + off);
+    }
+
+    /** Like arg(), if the value itself has been found already. */
+    template <typename T>
+    static T& arg_at(std::false_type, T* value)
+    {
+        return *value;
+    }
+
+    template <typename T>
+    static T* arg_at(std::true_type, T* value)
+    {
+        return value;
+    }
+
+    /** Check, in debug builds, that the component IDs in a for_each call
+     *  match the types. */
+    template <typename... Ts>
+    void check_types(typename id_for<Ts>::type... c) const
+    {
+#ifndef NDEBUG
+        const bool type_ok[] = {
+            true, components_[c].template is_of_type<
+                      typename component_type<Ts>::type>()...};
+        for (bool ok : type_ok)
+            assert(ok);
+#else
+        const int unused[] = {0, ((void)c, 0)...};
+        (void)unused;
+#endif
+    }
+
+    /** The mask of the components that are not optional. */
+    template <typename... Ts>
+    static component_mask required_mask(typename id_for<Ts>::type... c)
+    {
+        const bool optional[] = {false,
+                                 component_type<Ts>::is_optional::value...};
+        const component_id ids[] = {0, c...};
+        component_mask result;
+        for (size_t i = 1; i < sizeof...(Ts) + 1; ++i) {
+            if (!optional[i])
+                result.set(ids[i]);
+        }
+        return result;
+    }
+
+    /** The mask of the components a for_each can change: all of them,
+     *  except the ones that are read through current<T>. */
+    template <typename... Ts>
+    static component_mask written_mask(typename id_for<Ts>::type... c)
+    {
+        const bool current[] = {false,
+                                component_type<Ts>::is_current::value...};
+        const component_id ids[] = {0, c...};
+        component_mask result;
+        for (size_t i = 1; i < sizeof...(Ts) + 1; ++i) {
+            if (!current[i])
+                result.set(ids[i]);
+        }
+        return result;
+    }
+
+    static component_mask make_mask() { return component_mask(); }
+
+    template <typename... Ids>
+    static component_mask make_mask(component_id c, Ids... rest)
+    {
+        return make_mask(rest...).set(c);
+    }
+
+    /** The components a for_each callback says it changed.  Callbacks
+     *  can return a bitmask as an integer, or a component_mask if some
+     *  of the components have an ID of 64 or more. */
+    static component_mask changed_mask(const component_mask& bits)
+    {
+        return bits;
+    }
+
+    template <typename T>
+    static component_mask changed_mask(T bits)
+    {
+        return component_mask(uint64_t(bits));
+    }
+
+    /** Call a for_each callback that returns the components it changed. */
+    template <typename Func, typename... Args>
+    static component_mask invoke(std::false_type, const component_mask& mask,
+                                 Func& func, Args&&... args)
+    {
+        return changed_mask(func(std::forward<Args>(args)...)) & mask;
+    }
+
+    /** Call a for_each callback that returns nothing. */
+    template <typename Func, typename... Args>
+    static component_mask invoke(std::true_type, const component_mask& mask,
+                                 Func& func, Args&&... args)
+    {
+        func(std::forward<Args>(args)...);
+        return mask;
+    }
+
+    /** Rebuild an entity's data buffer for a new set of components.
+     *  Components that are in both the old and the new set are moved to
+     *  their new location, components that are no longer in the set are
+     *  destroyed, and space for new components is zero-filled.  Sparse
+     *  components are left alone, see change_components(). */
+    void relayout(elem& e, const component_mask& mask);
+
+    /** Give an entity a new set of components.  New sparse components
+     *  get a zero-filled value, and the entity's data is only laid out
+     *  again if any of its packed components changed. */
+    void change_components(iterator en, const component_mask& mask);
+
+    /** Remove the values of an entity's sparse components. */
+    void erase_sparse(size_t index, const component_mask& mask);
+
+    /** Give the non-flat components in a mask their initial value,
+     *  after relayout() made room for them. */
+    void construct_defaults(elem& e, const component_mask& mask);
+
+    void call_destructors(elem& e) const;
+
+    /** True if any thread holds a lock(), so other threads might be
+     *  changing the dirty flags at the same time. */
+    bool concurrent() const
+    {
+        return shared_.load(std::memory_order_relaxed) != 0;
+    }
+
+    /** A lock on the list of changes, but only if it is needed. */
+    std::unique_lock<std::mutex> lock_changes()
+    {
+        std::unique_lock<std::mutex> guard(changes_lock_, std::defer_lock);
+        if (concurrent())
+            guard.lock();
+        return guard;
+    }
+
+    /** Put a slot on the list of changes. */
+    void mark_changed(size_t index)
+    {
+        auto guard = lock_changes();
+        list_change(index);
+    }
+
+    /** Put a batch of slots on the list of changes, all at once. */
+    void merge_changes(const std::vector<uint32_t>& indices)
+    {
+        if (indices.empty())
+            return;
+
+        std::lock_guard<std::mutex> guard(changes_lock_);
+        for (auto index : indices)
+            list_change(index);
+    }
+
+    /** The slots a loop changed, and the components it marked dirty. */
+    typedef std::vector<std::pair<uint32_t, component_mask>> change_list;
+
+    /** Mark the dirty flags of a batch of slots, and put them on the list
+     *  of changes, all at once. */
+    void merge_changes(const change_list& changes)
+    {
+        if (changes.empty())
+            return;
+
+        std::lock_guard<std::mutex> guard(changes_lock_);
+        for (auto& change : changes) {
+            set_dirty(change.first, change.second);
+            list_change(change.first);
+        }
+    }
+
+    /** Record the components a loop changed for a slot.  The dirty flags
+     *  of an entity share a word, so if other threads could be working
+     *  on the same entity, the change is deferred until the end of the
+     *  loop.  Otherwise it is applied straight away, and the slot goes
+     *  on \a changed if that isn't null. */
+    void note_change(size_t i, const component_mask& dirty, bool defer,
+                     change_list& deferred,
+                     std::vector<uint32_t>* changed = nullptr)
+    {
+        if (defer) {
+            defer_change(deferred, i, dirty);
+            return;
+        }
+
+        // The callee might have created entities, so don't use a
+        // reference to the slot from before the call.
+        set_dirty(i, dirty);
+        if (changed)
+            changed->push_back(static_cast<uint32_t>(i));
+        else if (i >= listed_.size() || !listed_[i])
+            list_change(i);
+    }
+
+    /** Add a change to the ones a loop merges at the end. */
+    static void defer_change(change_list& deferred, size_t i,
+                             const component_mask& dirty);
+
+    /** mark_changed(), for a caller that holds \a changes_lock_. */
+    void list_change(size_t index);
+
+    void mark_dirty(iterator en, const component_mask& mask)
+    {
+        auto guard = lock_changes();
+        set_dirty(en.pos_, mask);
+        list_change(en.pos_);
+    }
+
+    /** Add to the dirty flags of a slot, if changes are tracked. */
+    void set_dirty(size_t index, const component_mask& mask)
+    {
+        if (tracking_)
+            dirty_[index] |= mask;
+    }
+
+    /** The dirty flags of a slot, or none if changes aren't tracked. */
+    component_mask dirty_flags(size_t index) const
+    {
+        return tracking_ ? dirty_[index] : component_mask();
+    }
+
+    /** Add a slot at the end. */
+    void add_slot(entity id)
+    {
+        entities_.emplace_back(id, elem());
+        if (tracking_)
+            dirty_.emplace_back(true);
+    }
+
+    /** Check if a slot still matches the queries, after its entity was
+     *  created or deleted, or its components changed. */
+    void update_queries(size_t index)
+    {
+        for (auto& q : queries_) {
+            if (q)
+                q->update(static_cast<uint32_t>(index),
+                          q->matches(entities_[index]));
+        }
+        if (!watches_.empty())
+            update_watches(index);
+    }
+
+    void update_queries(iterator en) { update_queries(en.pos_); }
+
+    /** Log the on_add and on_remove events for a slot, after its entity
+     *  was created or deleted, or its components changed. */
+    void update_watches(size_t index)
+    {
+        auto& s = entities_[index];
+        for (size_t c = 0; c < watches_.size(); ++c) {
+            if (!watches_[c])
+                continue;
+
+            auto& w = *watches_[c];
+            if (index >= w.has.size())
+                w.has.resize(std::max(index + 1, entities_.size()));
+
+            bool has = in_use(s) && s.second.components[c];
+            if (has == w.has[index])
+                continue;
+
+            w.has[index] = has;
+            if (has)
+                w.added.push_back(s.first);
+            else
+                w.removed.push_back(last_entity(index));
+        }
+    }
+
+    /** The entity that is in a slot, or that was in it until it was
+     *  deleted.  A free slot holds the generation that will be given
+     *  out next, which is one more than that of its last entity. */
+    entity last_entity(size_t index) const
+    {
+        auto& s = entities_[index];
+        if (in_use(s))
+            return s.first;
+
+        auto generation
+            = (entity_generation(s.first) - 1) & entity_generation_mask;
+        return make_entity(static_cast<uint32_t>(index), generation);
+    }
+
+    /** Read the components in a mask, adding them to the entity's mask
+     *  once they are in place. */
+    void read_components(iterator en, const component_mask& mask, reader& in);
+
+    /** Move the entity data to new memory, in the order of a list of
+     *  slots, and remember the order for for_each_ordered(). */
+    void compact_in_order(std::vector<uint32_t>&& order);
+
+    /** Release the locks held by an access object. */
+    void unlock(const access& a);
+
+    /** Set up the offsets and the lock for the component that was just
+     *  added to \a components_.
+     * @param sparse  Keep the values in a sparse set
+     * @return The new component's ID */
+    component_id component_added(bool sparse = false);
+
+    /** Rebuild the members of all queries from scratch, and log the
+     *  events for every slot that changed. */
+    void rebuild_queries();
+
+    /** Start or stop keeping track of which slots have the components
+     *  that are observed. */
+    void update_watched();
+
+    query_data& find_query(query q);
+
+    const query_data& find_query(query q) const;
+
+    /** Take a slot for a new entity, re-using a free one if possible. */
+    iterator acquire_slot();
+
+    /** Take the slot with a given index.  The slot must be free. */
+    iterator acquire_slot(uint32_t index, uint32_t generation);
+
+private:
+    /** Used for the entity data. */
+    allocator* alloc_;
+
+    /** The number of entities in use. */
+    size_t size_;
+
+    /** Indices of slots that can be re-used.  This list can also hold
+     *  slots that are in use again, these are skipped. */
+    std::vector<uint32_t> free_slots_;
+
+    /** The list of registered components. */
+    std::vector<component> components_;
+
+    /** Mapping entity indices to their data. */
+    stor_impl entities_;
+
+    /** Set if changes are tracked, see track_changes(). */
+    bool tracking_;
+
+    /** The dirty flags of every slot, or empty if changes aren't
+     *  tracked.  Only the slots on the list of changes can have any. */
+    std::vector<component_mask> dirty_;
+
+    /** The indices of the slots that changed since the last call to
+     *  clear_changes(). */
+    std::vector<uint32_t> changes_;
+
+    /** Marks the slots that are in \a changes_. */
+    std::vector<bool> listed_;
+
+    /** Protects \a changes_ and \a listed_, so loops that run at the
+     *  same time can all mark entities as changed. */
+    std::mutex changes_lock_;
+
+    /** Taken for reading by lock(), and for writing by
+     *  lock_structure(). */
+    rw_lock structure_lock_;
+
+    /** A lock for every registered component. */
+    std::vector<std::unique_ptr<rw_lock>> component_locks_;
+
+    /** The number of lock() objects that are alive. */
+    std::atomic<size_t> shared_;
+
+    /** The registered queries.  Unregistered queries leave a null
+     *  pointer behind, so the handles stay valid. */
+    std::vector<std::unique_ptr<query_data>> queries_;
+
+    /** The registered observers, see observe(). */
+    struct observer_data
+    {
+        component_id component;
+        unsigned int events;
+        observer_function func;
+    };
+
+    /** Unregistered observers leave an empty function behind, so the
+     *  handles stay valid. */
+    std::vector<observer_data> observers_;
+
+    /** For every component that is observed, the slots that have it.
+     *  Empty if there are no observers. */
+    std::vector<std::unique_ptr<watch_data>> watches_;
+
+    /** The slot order of the last compact(), or empty if the slots are
+     *  in order. */
+    std::vector<uint32_t> order_;
+
+    /** A lookup table for the data offsets of components. */
     std::vector<size_t> component_offsets_;
 
+    /** For every component, where its next and its current value are,
+     *  relative to offset().  Both are 0 for components that aren't
+     *  buffered. */
+    std::vector<size_t> write_shift_;
+    std::vector<size_t> read_shift_;
+
     /** A bitmask to quickly determine whether a certain combination of
     * * components has a flat memory layout or not. */
-    std::bitset<64> flat_mask_;
+    component_mask flat_mask_;
+
+    /** The components that are kept in a sparse set. */
+    component_mask sparse_mask_;
+
+    /** The components whose values are shared between copies. */
+    component_mask shared_mask_;
+
+    /** The components that have no data, see register_component(). */
+    component_mask tag_mask_;
+
+    /** Finds a component by name, see find_component(). */
+    std::unordered_map<std::string, component_id> names_;
+
+    /** The values of the sparse components, null for packed ones. */
+    std::vector<std::unique_ptr<sparse_set>> sparse_;
+
+    /** See stats(). */
+    struct counters
+    {
+        stat_counter calls;
+        stat_counter visited;
+        stat_counter matched;
+        stat_counter nanoseconds;
+        stat_counter relayouts;
+        stat_counter bytes_moved;
+    };
+
+    counters counters_;
 };
 
 } // namespace es
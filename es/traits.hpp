@@ -6,6 +6,7 @@
 //---------------------------------------------------------------------------
 #pragma once
 
+#include <cstddef>
 #include <type_traits>
 
 namespace es
@@ -23,4 +24,82 @@ struct is_flat
     static const bool value = std::is_trivial<T>::value;
 };
 
+/** Marks a component as optional in a for_each.  The callback is passed
+ *  a pointer to the value, which is null for entities that don't have
+ *  the component.
+ * @code
+ * s.for_each<vec, optional<vec>>(pos, vel,
+ *     [](storage::iterator, vec& p, vec* v) { if (v) p += *v; });
+ * @endcode */
+template <typename T>
+struct optional
+{
+};
+
+/** Reads the current value of a buffered component in a for_each,
+ *  instead of the next one.  The callback gets a const reference, and
+ *  the component is never marked dirty.  For a component without
+ *  buffers, the current and the next value are the same.
+ * @code
+ * s.for_each<current<vec>, vec, vec>(pos, pos, vel,
+ *     [](storage::iterator, const vec& now, vec& next, vec& v) {
+ *         next = now + v;
+ *     });
+ * @endcode */
+template <typename T>
+struct current
+{
+};
+
+/** Strips the optional and current markers off a component type, and
+ *  tells how a for_each passes the component to its callback. */
+template <typename T>
+struct component_type
+{
+    typedef T type;
+    typedef T& param;
+    typedef std::false_type is_optional;
+    typedef std::false_type is_current;
+};
+
+template <typename T>
+struct component_type<optional<T>>
+{
+    typedef T type;
+    typedef T* param;
+    typedef std::true_type is_optional;
+    typedef std::false_type is_current;
+};
+
+template <typename T>
+struct component_type<current<T>>
+{
+    typedef T type;
+    typedef const T& param;
+    typedef std::false_type is_optional;
+    typedef std::true_type is_current;
+};
+
+/** A compile-time list of indices, used to walk over several parameter
+ *  packs in lockstep.  (This is std::index_sequence from C++14.) */
+template <size_t... I>
+struct index_sequence
+{
+};
+
+template <size_t N, size_t... I>
+struct make_index_sequence_impl : make_index_sequence_impl<N - 1, N - 1, I...>
+{
+};
+
+template <size_t... I>
+struct make_index_sequence_impl<0, I...>
+{
+    typedef index_sequence<I...> type;
+};
+
+/** Builds index_sequence<0, 1, ..., N-1>. */
+template <size_t N>
+using make_index_sequence = typename make_index_sequence_impl<N>::type;
+
 } // namespace es
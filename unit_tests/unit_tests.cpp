@@ -2,10 +2,20 @@
 #define BOOST_TEST_MODULE es_unittests test
 #include <boost/test/unit_test.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "../es/traits.hpp"
 #include "../es/storage.hpp"
+#include "../es/archetype_storage.hpp"
+#include "../es/command_buffer.hpp"
+#include "../es/scheduler.hpp"
+#include "../es/replication.hpp"
+#include "../es/snapshot.hpp"
 
 using namespace es;
 
@@ -58,6 +68,24 @@ deserialize<std::string>(std::string& obj, std::vector<char>::const_iterator fir
     return last;
 }
 
+template<>
+void serialize<std::vector<uint16_t>>(const std::vector<uint16_t>& v,
+                                      std::vector<char>& buf)
+{
+    uint32_t size (v.size());
+    auto ptr (reinterpret_cast<const char*>(&size));
+    buf.insert(buf.end(), ptr, ptr + sizeof(size));
+    ptr = reinterpret_cast<const char*>(v.data());
+    buf.insert(buf.end(), ptr, ptr + size * sizeof(uint16_t));
+}
+
+template<>
+void deserialize<std::vector<uint16_t>>(std::vector<uint16_t>& v, reader& in)
+{
+    v.resize(in.read<uint32_t>());
+    in.read(v.data(), v.size() * sizeof(uint16_t));
+}
+
 } // namespace es
 
 //------------------------------------------------------------------------
@@ -270,7 +298,7 @@ BOOST_AUTO_TEST_CASE (system_test_1)
     s.set(2, pos, vector{2, 4, 8});
     s.set(3, pos, vector{5, 12, 23});
 
-    s.for_each<int>(health, [](storage::iterator i, int& var)
+    s.for_each<int>(health, [](storage::iterator, int& var)
         {
             var += 3;
             return true;
@@ -279,7 +307,7 @@ BOOST_AUTO_TEST_CASE (system_test_1)
     BOOST_CHECK_EQUAL(s.get<int>(0, health), 13);
     BOOST_CHECK_EQUAL(s.get<int>(1, health), 23);
 
-    s.for_each<vector>(pos, [](storage::iterator i, vector& var)
+    s.for_each<vector>(pos, [](storage::iterator, vector& var)
         {
             var.x += 1;
             return true;
@@ -307,17 +335,19 @@ BOOST_AUTO_TEST_CASE (serialization_test)
     s.set(2, name, std::string("abcdefg"));
 
     std::vector<char> buf1, buf2, buf3;
+    const size_t mask_size (mask_words * 8);
 
     s.serialize(s.find(0), buf1);
-    BOOST_CHECK_EQUAL(buf1.size(), 8 + sizeof(int));
+    BOOST_CHECK_EQUAL(buf1.size(), mask_size + sizeof(int));
     //std::vector<char> expected1 {{1, 0, 0, 0, 0, 0, 0, 0, 10, 0, 0, 0}};
     //BOOST_CHECK_EQUAL(buf1, expected1);
 
     s.serialize(s.find(1), buf2);
-    BOOST_CHECK_EQUAL(buf2.size(), 8 + sizeof(int) + sizeof(vector));
+    BOOST_CHECK_EQUAL(buf2.size(), mask_size + sizeof(int) + sizeof(vector));
 
     s.serialize(s.find(2), buf3);
-    BOOST_CHECK_EQUAL(buf3.size(), 8 + sizeof(int) + sizeof(vector) + 9);
+    BOOST_CHECK_EQUAL(buf3.size(),
+                      mask_size + sizeof(int) + sizeof(vector) + 9);
 
     auto check1 (s.new_entity());
     auto c1i (s.find(check1));
@@ -346,3 +376,2060 @@ BOOST_AUTO_TEST_CASE (serialization_test)
     BOOST_CHECK_EQUAL(s.get<vector>(c3i, pos).z, 9.f);
     BOOST_CHECK_EQUAL(s.get<std::string>(c3i, name), std::string("abcdefg"));
 }
+
+BOOST_AUTO_TEST_CASE (archetype_basic_test)
+{
+    archetype_storage s;
+
+    auto health (s.register_component<float>("health"));
+    auto pos    (s.register_component<vector>("position"));
+    auto name   (s.register_component<std::string>("name"));
+
+    entity player (s.new_entity());
+    entity bullet (s.new_entity());
+    entity deity  (s.new_entity());
+
+    s.set(player, health, 20.0f);
+    s.set(player, name,   std::string("Timmy"));
+    s.set(player, pos,    vector{2, 3, 4});
+    s.set(bullet, pos,    vector{5, 6, 7});
+    s.set(deity, name,    std::string("FSM"));
+
+    BOOST_CHECK_EQUAL(s.size(), 3);
+    BOOST_CHECK_EQUAL(s.get<float>(player, health), 20.0f);
+    BOOST_CHECK_EQUAL(s.get<std::string>(player, name), "Timmy");
+    BOOST_CHECK_EQUAL(s.get<vector>(player, pos).z, 4.0f);
+    BOOST_CHECK_EQUAL(s.get<vector>(bullet, pos).x, 5.0f);
+    BOOST_CHECK_EQUAL(s.get<std::string>(deity, name), "FSM");
+    BOOST_CHECK_THROW(s.get<float>(bullet, health), std::logic_error);
+
+    s.remove_component_from_entity(player, health);
+    BOOST_CHECK(!s.entity_has_component(player, health));
+    BOOST_CHECK_EQUAL(s.get<std::string>(player, name), "Timmy");
+
+    BOOST_CHECK(s.delete_entity(bullet));
+    BOOST_CHECK(!s.exists(bullet));
+    BOOST_CHECK(!s.delete_entity(bullet));
+    BOOST_CHECK_EQUAL(s.size(), 2);
+    BOOST_CHECK_EQUAL(s.get<vector>(player, pos).y, 3.0f);
+}
+
+BOOST_AUTO_TEST_CASE (archetype_for_each_test)
+{
+    archetype_storage s;
+
+    auto pos (s.register_component<vector>("position"));
+    auto vel (s.register_component<vector>("velocity"));
+    auto name (s.register_component<std::string>("name"));
+
+    // Enough entities to fill several chunks.
+    const int count = 5000;
+    auto range (s.new_entities(count));
+    BOOST_CHECK_EQUAL(range.second - range.first, count);
+    for (entity e (range.first); e != range.second; ++e)
+    {
+        s.set(e, pos, vector{float(e), 0, 0});
+        if (e % 2 == 0)
+            s.set(e, vel, vector{1, 2, 3});
+        if (e % 3 == 0)
+            s.set(e, name, std::to_string(e));
+    }
+    BOOST_CHECK_EQUAL(s.archetype_count(), 5);
+
+    // Swap-removal from the middle of an archetype.
+    for (entity e (range.first); e < range.first + 100; ++e)
+        s.delete_entity(e);
+
+    int visited (0);
+    s.for_each<vector, vector>(pos, vel, [&](entity, vector& p, vector& v)
+        {
+            p.y += v.y;
+            ++visited;
+        });
+    BOOST_CHECK_EQUAL(visited, (count - 100) / 2);
+
+    for (entity e (range.first + 100); e != range.second; ++e)
+    {
+        BOOST_CHECK_EQUAL(s.get<vector>(e, pos).x, float(e));
+        BOOST_CHECK_EQUAL(s.get<vector>(e, pos).y, e % 2 == 0 ? 2.f : 0.f);
+        if (e % 3 == 0)
+            BOOST_CHECK_EQUAL(s.get<std::string>(e, name), std::to_string(e));
+    }
+
+    int named (0);
+    s.for_each<std::string>(name, [&](entity e, std::string& n)
+        {
+            BOOST_CHECK_EQUAL(n, std::to_string(e));
+            ++named;
+        });
+    BOOST_CHECK_EQUAL(named, (count - 1) / 3 - 33);
+}
+
+BOOST_AUTO_TEST_CASE (archetype_chunk_test)
+{
+    archetype_storage s;
+
+    auto pos (s.register_component<vector>("position"));
+    auto vel (s.register_component<vector>("velocity"));
+    auto name (s.register_component<std::string>("name"));
+
+    const int count = 5000;
+    auto range (s.new_entities(count));
+    for (entity e (range.first); e != range.second; ++e)
+    {
+        s.set(e, pos, vector{float(e), 0, 0});
+        if (e % 2 == 0)
+            s.set(e, vel, vector{1, 2, 3});
+        if (e % 3 == 0)
+            s.set(e, name, std::to_string(e));
+    }
+
+    int visited (0), chunks (0);
+    s.for_each_chunk<vector, vector>(pos, vel,
+        [&](size_t n, const entity* ids, vector* p, vector* v)
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                BOOST_CHECK_EQUAL(p[i].x, float(ids[i]));
+                p[i].y += v[i].y;
+            }
+            visited += n;
+            ++chunks;
+        });
+    BOOST_CHECK_EQUAL(visited, count / 2);
+    BOOST_CHECK(chunks > 2);
+
+    job_system jobs (4);
+    s.parallel_for_each_chunk<vector>(jobs, pos,
+        [&](size_t n, const entity*, vector* p)
+        {
+            for (size_t i = 0; i < n; ++i)
+                p[i].z += 1;
+        });
+
+    for (entity e (range.first); e != range.second; ++e)
+    {
+        BOOST_CHECK_EQUAL(s.get<vector>(e, pos).y, e % 2 == 0 ? 2.f : 0.f);
+        BOOST_CHECK_EQUAL(s.get<vector>(e, pos).z, 1.f);
+    }
+}
+
+BOOST_AUTO_TEST_CASE (recycle_test)
+{
+    storage s;
+
+    auto name (s.register_component<std::string>("name"));
+
+    entity first  (s.new_entity());
+    entity second (s.new_entity());
+    s.set(first, name, std::string("first"));
+    s.set(second, name, std::string("second"));
+
+    BOOST_CHECK(s.delete_entity(first));
+    BOOST_CHECK(!s.exists(first));
+    BOOST_CHECK(!s.delete_entity(first));
+    BOOST_CHECK_THROW(s.find(first), std::logic_error);
+
+    // The index is re-used, with a new generation.
+    entity third (s.new_entity());
+    BOOST_CHECK_EQUAL(entity_index(third), entity_index(first));
+    BOOST_CHECK_NE(third, first);
+    BOOST_CHECK(s.exists(third));
+    BOOST_CHECK(!s.exists(first));
+    BOOST_CHECK(!s.entity_has_component(s.find(third), name));
+    BOOST_CHECK_EQUAL(s.size(), 2);
+
+    // Claiming a free index with make().
+    s.delete_entity(second);
+    entity fourth (make_entity(entity_index(second), 7));
+    s.make(fourth);
+    BOOST_CHECK(s.exists(fourth));
+    BOOST_CHECK(!s.exists(second));
+    BOOST_CHECK_THROW(s.make(make_entity(entity_index(second), 8)),
+                      std::logic_error);
+
+    int count (0);
+    for (auto i (s.begin()); i != s.end(); ++i)
+        ++count;
+    BOOST_CHECK_EQUAL(count, 2);
+
+    // The stale entry on the free list is skipped.
+    entity fifth (s.new_entity());
+    BOOST_CHECK_EQUAL(entity_index(fifth), 2);
+}
+
+BOOST_AUTO_TEST_CASE (variadic_for_each_test)
+{
+    storage s;
+
+    auto c1 (s.register_component<int>("c1"));
+    auto c2 (s.register_component<float>("c2"));
+    auto c3 (s.register_component<std::string>("c3"));
+    auto c4 (s.register_component<vector>("c4"));
+
+    s.new_entities(3);
+    for (entity e (0); e < 3; ++e)
+    {
+        s.set(e, c1, int(e));
+        s.set(e, c2, 1.5f);
+        s.set(e, c3, std::string("x"));
+    }
+    s.set(1, c4, vector{1, 2, 3});
+
+    for (auto i (s.begin()); i != s.end(); ++i)
+        s.check_dirty_and_clear(i);
+
+    // A callback returning void marks all components as dirty.
+    int count (0);
+    s.for_each<int, float, std::string, vector>(c1, c2, c3, c4,
+        [&](storage::iterator, int& a, float& b, std::string& c, vector& d)
+        {
+            c += std::to_string(a);
+            d.x += b;
+            ++count;
+        });
+
+    BOOST_CHECK_EQUAL(count, 1);
+    BOOST_CHECK_EQUAL(s.get<std::string>(1, c3), "x1");
+    BOOST_CHECK_EQUAL(s.get<vector>(1, c4).x, 2.5f);
+    BOOST_CHECK(s.check_dirty(s.find(1), c1));
+    BOOST_CHECK(s.check_dirty(s.find(1), c4));
+    BOOST_CHECK(!s.check_dirty(s.find(0)));
+
+    // A callback can also report exactly what it changed.
+    s.for_each<int, float>(c1, c2, [&](storage::iterator, int& a, const float&)
+        {
+            ++a;
+            return uint64_t(1) << c1;
+        });
+
+    BOOST_CHECK_EQUAL(s.get<int>(2, c1), 3);
+    BOOST_CHECK(s.check_dirty(s.find(0), c1));
+    BOOST_CHECK(!s.check_dirty(s.find(0), c2));
+}
+
+BOOST_AUTO_TEST_CASE (job_system_test)
+{
+    job_system jobs (4);
+    BOOST_CHECK_EQUAL(jobs.size(), 4);
+
+    std::atomic<int> sum (0);
+    jobs.parallel_for(1000, 7, [&](size_t first, size_t last)
+        {
+            // Nested parallelism must not deadlock.
+            jobs.parallel_for(last - first, 2, [&](size_t f, size_t l)
+                {
+                    sum += int(l - f);
+                });
+        });
+    BOOST_CHECK_EQUAL(sum, 1000);
+
+    job_system::group g;
+    jobs.submit([]{ throw std::runtime_error("oops"); }, g);
+    BOOST_CHECK_THROW(jobs.wait(g), std::runtime_error);
+
+    // Tasks outside a group don't take the worker down with them.
+    jobs.submit([]{ throw std::logic_error("ungrouped"); });
+    bool caught (false);
+    for (int i = 0; i < 1000 && !caught; ++i) {
+        try {
+            jobs.wait(g);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        } catch (std::logic_error&) {
+            caught = true;
+        }
+    }
+    BOOST_CHECK(caught);
+    jobs.wait(g);
+    jobs.parallel_for(100, 1, [&](size_t, size_t) { ++sum; });
+    BOOST_CHECK_EQUAL(sum, 1100);
+}
+
+BOOST_AUTO_TEST_CASE (parallel_for_each_test)
+{
+    job_system jobs (4);
+    storage s;
+
+    auto pos (s.register_component<vector>("position"));
+    auto vel (s.register_component<vector>("velocity"));
+
+    const entity count = 20000;
+    s.new_entities(count);
+    for (entity e (0); e < count; ++e)
+    {
+        s.set(e, pos, vector{0, 0, 0});
+        if (e % 4 != 0)
+            s.set(e, vel, vector{float(e), 1, 0});
+    }
+    for (auto i (s.begin()); i != s.end(); ++i)
+        s.check_dirty_and_clear(i);
+
+    std::atomic<int> visited (0);
+    s.parallel_for_each<vector, const vector>(jobs, pos, vel,
+        [&](storage::iterator, vector& p, const vector& v)
+        {
+            p.x += v.x;
+            ++visited;
+            return uint64_t(1) << pos;
+        });
+
+    BOOST_CHECK_EQUAL(visited, count - count / 4);
+    for (entity e (0); e < count; ++e)
+    {
+        BOOST_CHECK_EQUAL(s.get<vector>(e, pos).x, e % 4 ? float(e) : 0.f);
+        BOOST_CHECK_EQUAL(s.check_dirty(s.find(e), pos), e % 4 != 0);
+        BOOST_CHECK(!s.check_dirty(s.find(e), vel));
+    }
+
+    archetype_storage a;
+    auto apos (a.register_component<vector>("position"));
+    auto range (a.new_entities(count));
+    for (entity e (range.first); e != range.second; ++e)
+        a.set(e, apos, vector{float(e), 0, 0});
+
+    a.parallel_for_each<vector>(jobs, apos, [](entity, vector& p)
+        {
+            p.y = p.x * 2;
+        });
+    for (entity e (range.first); e != range.second; ++e)
+        BOOST_CHECK_EQUAL(a.get<vector>(e, apos).y, e * 2.f);
+}
+
+BOOST_AUTO_TEST_CASE (scheduler_test)
+{
+    job_system jobs (4);
+    storage s;
+
+    auto health (s.register_component<int>("health"));
+    auto pos    (s.register_component<vector>("position"));
+    auto vel    (s.register_component<vector>("velocity"));
+
+    s.new_entities(100);
+    for (entity e (0); e < 100; ++e)
+    {
+        s.set(e, health, 1);
+        s.set(e, pos, vector{0, 0, 0});
+        s.set(e, vel, vector{1, 0, 0});
+    }
+
+    scheduler sched (s, jobs);
+    std::atomic<int> moved (0);
+
+    auto move (sched.add(es::system("move", {vel}, {pos}, [&](storage& st)
+        {
+            st.for_each<vector, vector>(pos, vel,
+                [](storage::iterator, vector& p, vector& v) { p.x += v.x; });
+            moved = 1;
+        })));
+
+    auto regen (sched.add(es::system("regen", {}, {health}, [&](storage& st)
+        {
+            st.parallel_for_each<int>(jobs, health,
+                [](storage::iterator, int& h) { ++h; });
+        })));
+
+    std::atomic<bool> saw_move (false);
+    auto render (sched.add(es::system("render", {pos}, {}, [&](storage&)
+        {
+            saw_move = moved == 1;
+        })));
+
+    auto spawn (sched.add(es::system("spawn", {}, {}, [&](storage& st)
+        {
+            st.new_entity();
+        }, true)));
+
+    BOOST_CHECK(sched.dependencies(move).empty());
+    BOOST_CHECK(sched.dependencies(regen).empty());
+    BOOST_CHECK_EQUAL(sched.dependencies(render).size(), 1);
+    BOOST_CHECK_EQUAL(sched.dependencies(render)[0], move);
+    BOOST_CHECK_EQUAL(sched.dependencies(spawn).size(), 3);
+
+    sched.run();
+    sched.run();
+
+    BOOST_CHECK(saw_move);
+    BOOST_CHECK_EQUAL(s.size(), 102);
+    BOOST_CHECK_EQUAL(s.get<int>(50, health), 3);
+    BOOST_CHECK_EQUAL(s.get<vector>(50, pos).x, 2.f);
+}
+
+BOOST_AUTO_TEST_CASE (scheduler_lock_test)
+{
+    // Systems that wait for a parallel_for_each while they hold their
+    // locks, and another thread that keeps asking for the structure lock.
+    job_system jobs (4);
+    storage s;
+    std::vector<storage::component_id> counters;
+    for (int c = 0; c < 9; ++c)
+        counters.push_back(s.register_component<int>("counter"));
+
+    auto range (s.new_entities(20000));
+    for (auto e (range.first); e != range.second; ++e) {
+        for (auto c : counters)
+            s.set(e, c, 0);
+    }
+
+    scheduler sched (s, jobs);
+    for (auto c : counters) {
+        sched.add(es::system("count", {}, {c}, [&jobs, c](storage& st) {
+            st.parallel_for_each<int>(jobs, c,
+                [](storage::iterator, int& n) { ++n; });
+        }));
+    }
+
+    std::atomic<bool> stop (false);
+    std::thread outside ([&] {
+        while (!stop) {
+            auto guard (s.lock_structure());
+            std::this_thread::yield();
+        }
+    });
+
+    const int frames (200);
+    for (int f = 0; f < frames; ++f)
+        sched.run();
+
+    stop = true;
+    outside.join();
+    for (auto c : counters)
+        BOOST_CHECK_EQUAL(s.get<int>(range.first + 123, c), frames);
+}
+
+BOOST_AUTO_TEST_CASE (offset_cache_test)
+{
+    storage s;
+
+    // Lots of different component masks, so the cache has to evict.
+    std::vector<storage::component_id> ci;
+    for (int i (0); i < 8; ++i)
+        ci.push_back(s.register_component<uint16_t>(std::to_string(i)));
+
+    auto a (s.register_component<uint32_t>("a"));
+    auto b (s.register_component<std::string>("b"));
+
+    const entity count = 1000;
+    s.new_entities(count);
+    for (entity e (0); e < count; ++e)
+    {
+        for (int i (0); i < 8; ++i)
+            if (e & (1 << i))
+                s.set(e, ci[i], uint16_t(i));
+
+        s.set(e, a, uint32_t(e));
+        s.set(e, b, std::to_string(e));
+    }
+
+    int visited (0);
+    s.for_each<uint32_t, std::string>(a, b,
+        [&](storage::iterator i, uint32_t& x, std::string& y)
+        {
+            BOOST_CHECK_EQUAL(x, i->first);
+            BOOST_CHECK_EQUAL(y, std::to_string(i->first));
+            ++visited;
+        });
+    BOOST_CHECK_EQUAL(visited, count);
+}
+
+BOOST_AUTO_TEST_CASE (prototype_test)
+{
+    storage s;
+
+    auto health (s.register_component<int>("health"));
+    auto pos    (s.register_component<vector>("position"));
+    auto name   (s.register_component<std::string>("name"));
+
+    s.new_entity();
+    std::pair<entity, entity> range;
+    {
+        storage::prototype bullet (s);
+        bullet.set(pos, vector{1, 2, 3})
+              .set(name, std::string("a rather long name, to avoid SSO"))
+              .set(health, 5);
+        BOOST_CHECK_EQUAL(bullet.get<int>(health), 5);
+
+        range = s.new_entities(1000, bullet);
+    }
+    BOOST_CHECK_EQUAL(range.first, 1);
+    BOOST_CHECK_EQUAL(range.second, 1001);
+    BOOST_CHECK_EQUAL(s.size(), 1001);
+
+    s.get<std::string>(range.first, name) = "changed";
+    for (entity e (range.first + 1); e != range.second; ++e)
+    {
+        BOOST_CHECK_EQUAL(s.get<int>(e, health), 5);
+        BOOST_CHECK_EQUAL(s.get<vector>(e, pos).z, 3.f);
+        BOOST_CHECK_EQUAL(s.get<std::string>(e, name),
+                          "a rather long name, to avoid SSO");
+        BOOST_CHECK(s.check_dirty(s.find(e), pos));
+    }
+    BOOST_CHECK_EQUAL(s.get<std::string>(range.first, name), "changed");
+}
+
+BOOST_AUTO_TEST_CASE (small_buffer_test)
+{
+    small_buffer a (8);
+    BOOST_CHECK(a.is_inline());
+    BOOST_CHECK_EQUAL(a.size(), 8);
+    BOOST_CHECK_EQUAL(a[7], 0);
+
+    a[0] = 42;
+    a.resize(100);
+    BOOST_CHECK(!a.is_inline());
+    BOOST_CHECK_EQUAL(a[0], 42);
+    BOOST_CHECK_EQUAL(a[99], 0);
+
+    small_buffer b (4, true);
+    BOOST_CHECK(!b.is_inline());
+    small_buffer c (b);
+    BOOST_CHECK(!c.is_inline());
+
+    const char text[] = "hello";
+    small_buffer d;
+    d.append(text, text + 5);
+    BOOST_CHECK(d.is_inline());
+    BOOST_CHECK_EQUAL(std::string(d.begin(), d.end()), "hello");
+
+    c = std::move(d);
+    BOOST_CHECK_EQUAL(std::string(c.begin(), c.end()), "hello");
+}
+
+BOOST_AUTO_TEST_CASE (set_components_test)
+{
+    storage s;
+
+    auto health (s.register_component<int>("health"));
+    auto pos    (s.register_component<vector>("position"));
+    auto name   (s.register_component<std::string>("name"));
+    auto vel    (s.register_component<vector>("velocity"));
+
+    entity e (s.new_entity());
+    s.set(e, pos, vector{9, 9, 9});
+    s.set_components<std::string, vector, int>(e, name, pos, health,
+        std::string("a long name, long enough to avoid SSO"),
+        vector{1, 2, 3}, 12);
+
+    BOOST_CHECK_EQUAL(s.get<int>(e, health), 12);
+    BOOST_CHECK_EQUAL(s.get<vector>(e, pos).x, 1.f);
+    BOOST_CHECK_EQUAL(s.get<std::string>(e, name),
+                      "a long name, long enough to avoid SSO");
+
+    s.set(e, vel, vector{4, 5, 6});
+    component_mask mask;
+    mask.set(health).set(pos);
+    s.remove_components_from_entity(s.find(e), mask);
+
+    BOOST_CHECK(!s.entity_has_component(s.find(e), health));
+    BOOST_CHECK(!s.entity_has_component(s.find(e), pos));
+    BOOST_CHECK_EQUAL(s.get<std::string>(e, name),
+                      "a long name, long enough to avoid SSO");
+    BOOST_CHECK_EQUAL(s.get<vector>(e, vel).z, 6.f);
+}
+
+BOOST_AUTO_TEST_CASE (pool_allocator_test)
+{
+    pool_allocator pool;
+
+    auto a = pool.allocate(24);
+    auto b = pool.allocate(24);
+    BOOST_CHECK(a != b);
+    BOOST_CHECK_EQUAL(pool.allocated(), 64);
+
+    pool.deallocate(a, 24);
+    BOOST_CHECK_EQUAL(pool.allocate(20), a);
+
+    auto large = pool.allocate(10000);
+    BOOST_CHECK_EQUAL(pool.allocated(), 64 + 10000);
+    pool.deallocate(large, 10000);
+    pool.deallocate(a, 20);
+    pool.deallocate(b, 24);
+    BOOST_CHECK_EQUAL(pool.allocated(), 0);
+
+    storage s (&pool);
+    auto pos  (s.register_component<vector>("position"));
+    auto vel  (s.register_component<vector>("velocity"));
+    auto name (s.register_component<std::string>("name"));
+
+    for (int i = 0; i < 1000; ++i) {
+        auto e (s.new_entity());
+        s.set(e, pos, vector{float(i), 0, 0});
+        s.set(e, vel, vector{0, float(i), 0});
+        if (i % 2)
+            s.set(e, name, std::string(100, 'x'));
+    }
+    BOOST_CHECK(pool.allocated() > 0);
+    BOOST_CHECK(pool.reserved() >= pool.allocated());
+
+    auto clone (s.clone_entity(s.find(1)));
+    BOOST_CHECK_EQUAL(s.get<std::string>(clone, name), std::string(100, 'x'));
+
+    s.clear();
+    BOOST_CHECK_EQUAL(s.size(), 0);
+    BOOST_CHECK_EQUAL(pool.allocated(), 0);
+    pool.reset();
+
+    auto e (s.new_entity());
+    BOOST_CHECK_EQUAL(entity_index(e), 0);
+    s.set(e, name, std::string("level two"));
+    BOOST_CHECK_EQUAL(s.get<std::string>(e, name), "level two");
+}
+
+BOOST_AUTO_TEST_CASE (snapshot_test)
+{
+    storage s;
+    auto pos  (s.register_component<vector>("position"));
+    auto name (s.register_component<std::string>("name"));
+    auto hp   (s.register_component<int>("health"));
+
+    std::vector<entity> ids;
+    for (int i = 0; i < 100; ++i) {
+        auto e (s.new_entity());
+        s.set(e, pos, vector{float(i), 1, 2});
+        if (i % 3 == 0)
+            s.set(e, name, std::string("entity ") + std::to_string(i));
+        if (i % 2 == 0)
+            s.set(e, hp, i * 10);
+        ids.push_back(e);
+    }
+    s.delete_entity(ids[5]);
+    s.delete_entity(ids[6]);
+    ids[6] = s.new_entity();
+
+    std::vector<char> buffer;
+    s.write_snapshot(buffer);
+
+    snapshot_view view (buffer.data(), buffer.size());
+    BOOST_CHECK_EQUAL(view.entity_count(), 99);
+    BOOST_CHECK_EQUAL(view.slot_count(), 100);
+    auto col (view.find("position"));
+    BOOST_REQUIRE(col != nullptr);
+    BOOST_CHECK_EQUAL(col->count, 98);
+    // Slots 5 and 6 have no position.
+    BOOST_CHECK_EQUAL(col->as<vector>()[10].x, 12.f);
+
+    // Register the components in a different order.
+    storage t;
+    auto t_hp   (t.register_component<int>("health"));
+    t.register_component<float>("unused");
+    auto t_name (t.register_component<std::string>("name"));
+    auto t_pos  (t.register_component<vector>("position"));
+    t.new_entity();
+
+    t.read_snapshot(buffer.data(), buffer.size());
+    BOOST_CHECK_EQUAL(t.size(), 99);
+    BOOST_CHECK(!t.exists(ids[5]));
+    BOOST_CHECK(t.exists(ids[6]));
+    BOOST_CHECK(!t.entity_has_component(t.find(ids[6]), t_pos));
+
+    for (int i = 0; i < 100; ++i) {
+        if (i == 5 || i == 6)
+            continue;
+
+        BOOST_CHECK_EQUAL(t.get<vector>(ids[i], t_pos).x, float(i));
+        BOOST_CHECK_EQUAL(t.entity_has_component(t.find(ids[i]), t_name),
+                          i % 3 == 0);
+        if (i % 3 == 0)
+            BOOST_CHECK_EQUAL(t.get<std::string>(ids[i], t_name),
+                              std::string("entity ") + std::to_string(i));
+        if (i % 2 == 0)
+            BOOST_CHECK_EQUAL(t.get<int>(ids[i], t_hp), i * 10);
+    }
+    BOOST_CHECK_EQUAL(entity_index(t.new_entity()), 5);
+    BOOST_CHECK_EQUAL(entity_index(t.new_entity()), 100);
+
+    // Loading a smaller world only lists the slots it has as changed.
+    storage w;
+    w.register_component<vector>("position");
+    w.register_component<int>("health");
+    w.register_component<std::string>("name");
+    w.new_entities(300);
+    w.read_snapshot(buffer.data(), buffer.size());
+    size_t changed (0);
+    w.for_each_changed([&](storage::iterator i) {
+        BOOST_CHECK(entity_index(i->first) < 100);
+        ++changed;
+    });
+    BOOST_CHECK_EQUAL(changed, 99);
+
+    storage u;
+    u.register_component<float>("position");
+    BOOST_CHECK_THROW(u.read_snapshot(buffer.data(), buffer.size()),
+                      std::logic_error);
+
+    buffer[0] = 'x';
+    BOOST_CHECK_THROW(snapshot_view(buffer.data(), buffer.size()),
+                      std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE (replication_test)
+{
+    for (bool use_xor : {false, true}) {
+        storage s, t;
+        auto pos  (s.register_component<vector>("position"));
+        auto name (s.register_component<std::string>("name"));
+        auto hp   (s.register_component<int>("health"));
+        t.register_component<vector>("position");
+        t.register_component<std::string>("name");
+        t.register_component<int>("health");
+
+        std::vector<entity> ids;
+        for (int i = 0; i < 50; ++i) {
+            auto e (s.new_entity());
+            s.set(e, pos, vector{float(i), 0, 0});
+            s.set(e, hp, i);
+            ids.push_back(e);
+        }
+        s.set(ids[3], name, std::string("three"));
+
+        delta_encoder encoder (s, use_xor);
+        delta_decoder decoder (t);
+
+        std::vector<char> delta;
+        encoder.encode(delta);
+        s.clear_changes();
+        decoder.apply(delta);
+        BOOST_CHECK_EQUAL(t.size(), 50);
+        BOOST_CHECK_EQUAL(t.get<vector>(ids[7], pos).x, 7.f);
+        BOOST_CHECK_EQUAL(t.get<std::string>(ids[3], name), "three");
+
+        // Nothing changed, so only the header is written.
+        delta.clear();
+        encoder.encode(delta);
+        BOOST_CHECK_EQUAL(delta.size(), 1);
+        decoder.apply(delta);
+
+        s.set(ids[8], hp, 1000);
+        s.set(ids[9], name, std::string("nine"));
+        s.remove_component_from_entity(s.find(ids[3]), name);
+        s.delete_entity(ids[10]);
+        auto fresh (s.new_entity());
+        s.set(fresh, pos, vector{1, 2, 3});
+
+        s.for_each<vector>(pos, [&](storage::iterator i, vector& v) {
+            if (i->first != ids[7])
+                return uint64_t(0);
+
+            v.y = 5;
+            return ~uint64_t(0);
+        });
+
+        delta.clear();
+        encoder.encode(delta);
+        BOOST_CHECK(delta.size() < 100);
+        decoder.apply(delta);
+
+        BOOST_CHECK_EQUAL(t.size(), 50);
+        BOOST_CHECK_EQUAL(t.get<vector>(ids[7], pos).y, 5.f);
+        BOOST_CHECK_EQUAL(t.get<int>(ids[8], hp), 1000);
+        BOOST_CHECK_EQUAL(t.get<std::string>(ids[9], name), "nine");
+        BOOST_CHECK(!t.entity_has_component(t.find(ids[3]), name));
+        BOOST_CHECK(!t.exists(ids[10]));
+        BOOST_CHECK_EQUAL(t.get<vector>(fresh, pos).z, 3.f);
+        BOOST_CHECK(t.check_dirty(t.find(ids[8]), hp));
+    }
+
+    // Broken packets are rejected with a runtime_error.
+    storage r;
+    auto hp (r.register_component<int>("health"));
+    auto known (r.new_entity());
+    r.set(known, hp, 7);
+    delta_decoder decoder (r);
+
+    auto number = [](std::vector<char>& buf, uint64_t value) {
+        for (; value >= 0x80; value >>= 7)
+            buf.push_back(char((value & 0x7f) | 0x80));
+        buf.push_back(char(value));
+    };
+    auto update = [&](entity id, std::vector<uint64_t> runs) {
+        std::vector<char> buf {1};
+        number(buf, id);
+        buf.push_back(0);
+        if (mask_words > 1)
+            number(buf, 1);
+        number(buf, uint64_t(1) << hp);
+        number(buf, 0);
+        for (auto n : runs)
+            number(buf, n);
+        buf.insert(buf.end(), 4, char(0xff));
+        return buf;
+    };
+
+    // A well-formed XOR update goes through.
+    decoder.apply(update(known, {0, 4}));
+    BOOST_CHECK_EQUAL(r.get<int>(known, hp), ~7);
+
+    // A skip that wraps around when the run length is added.
+    BOOST_CHECK_THROW(decoder.apply(update(known, {~uint64_t(0), 2})),
+                      std::runtime_error);
+    BOOST_CHECK_THROW(decoder.apply(update(known, {5, 0})),
+                      std::runtime_error);
+    BOOST_CHECK_THROW(decoder.apply(update(known, {2, 3})),
+                      std::runtime_error);
+    BOOST_CHECK_THROW(decoder.apply(update(known, {0, 0})),
+                      std::runtime_error);
+    BOOST_CHECK_THROW(decoder.apply(update(known + 1, {0, 4})),
+                      std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE (change_list_test)
+{
+    storage s;
+    auto pos (s.register_component<vector>("position"));
+    auto hp  (s.register_component<int>("health"));
+
+    std::vector<entity> ids;
+    for (int i = 0; i < 100; ++i) {
+        auto e (s.new_entity());
+        s.set(e, pos, vector{0, 0, 0});
+        ids.push_back(e);
+    }
+
+    size_t count = 0;
+    s.for_each_changed([&](storage::iterator) { ++count; });
+    BOOST_CHECK_EQUAL(count, 100);
+
+    s.clear_changes();
+    count = 0;
+    s.for_each_changed([&](storage::iterator) { ++count; });
+    BOOST_CHECK_EQUAL(count, 0);
+    BOOST_CHECK(!s.check_dirty(s.find(ids[0])));
+
+    s.set(ids[3], hp, 5);
+    s.set(ids[3], pos, vector{1, 1, 1});
+    s.remove_component_from_entity(s.find(ids[4]), pos);
+    s.for_each<vector>(pos, [&](storage::iterator i, vector&) {
+        return i->first == ids[50] ? ~uint64_t(0) : uint64_t(0);
+    });
+
+    job_system jobs (2);
+    s.parallel_for_each<vector>(jobs, pos, [&](storage::iterator i, vector&) {
+        return i->first == ids[60] ? ~uint64_t(0) : uint64_t(0);
+    });
+
+    std::vector<entity> changed;
+    s.for_each_changed([&](storage::iterator i) {
+        changed.push_back(i->first);
+    });
+    std::sort(changed.begin(), changed.end());
+    BOOST_REQUIRE_EQUAL(changed.size(), 4);
+    BOOST_CHECK_EQUAL(changed[0], ids[3]);
+    BOOST_CHECK_EQUAL(changed[1], ids[4]);
+    BOOST_CHECK_EQUAL(changed[2], ids[50]);
+    BOOST_CHECK_EQUAL(changed[3], ids[60]);
+
+    changed.clear();
+    s.for_each_changed(hp, [&](storage::iterator i) {
+        changed.push_back(i->first);
+    });
+    BOOST_REQUIRE_EQUAL(changed.size(), 1);
+    BOOST_CHECK_EQUAL(changed[0], ids[3]);
+
+    s.clear_changes();
+    s.delete_entity(ids[5]);
+    count = 0;
+    s.for_each_changed([&](storage::iterator) { ++count; });
+    BOOST_CHECK_EQUAL(count, 0);
+}
+
+BOOST_AUTO_TEST_CASE (reader_test)
+{
+    storage s;
+    auto pos  (s.register_component<vector>("position"));
+    auto name (s.register_component<std::string>("name"));
+    auto tags (s.register_component<std::vector<uint16_t>>("tags"));
+
+    std::vector<char> buffer;
+    for (int i = 0; i < 3; ++i) {
+        auto e (s.new_entity());
+        s.set(e, pos, vector{float(i), 2, 3});
+        s.set(e, name, std::string("entity ") + std::to_string(i));
+        s.set(e, tags, std::vector<uint16_t>(i + 1, 7));
+
+        std::vector<char> one;
+        s.serialize(s.find(e), one);
+        buffer.insert(buffer.end(), one.begin(), one.end());
+    }
+
+    // Read all three entities from a single buffer.
+    reader in (buffer.data(), buffer.size());
+    for (int i = 0; i < 3; ++i) {
+        auto e (s.new_entity());
+        s.deserialize(s.find(e), in);
+        BOOST_CHECK_EQUAL(s.get<vector>(e, pos).x, float(i));
+        BOOST_CHECK_EQUAL(s.get<std::string>(e, name),
+                          std::string("entity ") + std::to_string(i));
+        BOOST_CHECK_EQUAL(s.get<std::vector<uint16_t>>(e, tags).size(), i + 1);
+    }
+    BOOST_CHECK(in.empty());
+
+    std::vector<char> one;
+    s.serialize(s.find(0), one);
+    auto e (s.new_entity());
+    s.deserialize(s.find(e), one.data(), one.size());
+    BOOST_CHECK_EQUAL(s.get<std::string>(e, name), "entity 0");
+
+    one.resize(one.size() - 1);
+    BOOST_CHECK_THROW(s.deserialize(s.find(e), one.data(), one.size()),
+                      std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE (query_test)
+{
+    storage s;
+    auto pos  (s.register_component<vector>("position"));
+    auto fire (s.register_component<float>("burning"));
+    auto wet  (s.register_component<char>("wet"));
+
+    std::vector<entity> ids;
+    for (int i = 0; i < 1000; ++i) {
+        auto e (s.new_entity());
+        s.set(e, pos, vector{float(i), 0, 0});
+        ids.push_back(e);
+    }
+    s.set(ids[10], fire, 1.f);
+
+    auto burning (s.register_query(component_mask().set(fire),
+                                   component_mask().set(wet)));
+    BOOST_CHECK_EQUAL(s.query_size(burning), 1);
+
+    s.set(ids[20], fire, 2.f);
+    s.set_components<float, char>(ids[30], fire, wet, 3.f, 1);
+    s.set(ids[40], wet, char(1));
+    s.set(ids[40], fire, 4.f);
+    BOOST_CHECK_EQUAL(s.query_size(burning), 2);
+
+    s.remove_component_from_entity(s.find(ids[40]), wet);
+    BOOST_CHECK_EQUAL(s.query_size(burning), 3);
+
+    // Remove members from within the loop, including ones that have not
+    // been visited yet.
+    int visited = 0;
+    s.for_each<float, vector>(burning, fire, pos,
+        [&](storage::iterator i, float& f, vector& p) {
+        ++visited;
+        BOOST_CHECK(f > 0);
+        BOOST_CHECK_EQUAL(p.x, float(entity_index(i->first)));
+        if (i->first == ids[10]) {
+            s.delete_entity(ids[20]);
+            s.delete_entity(i);
+        }
+    });
+    BOOST_CHECK_EQUAL(visited, 2);
+    BOOST_CHECK_EQUAL(s.query_size(burning), 1);
+
+    auto clone (s.clone_entity(s.find(ids[40])));
+    BOOST_CHECK_EQUAL(s.query_size(burning), 2);
+    s.delete_entity(clone);
+
+    visited = 0;
+    s.for_each<>(burning, [&](storage::iterator i) {
+        ++visited;
+        BOOST_CHECK_EQUAL(i->first, ids[40]);
+    });
+    BOOST_CHECK_EQUAL(visited, 1);
+
+    s.clear();
+    BOOST_CHECK_EQUAL(s.query_size(burning), 0);
+
+    s.unregister_query(burning);
+    BOOST_CHECK_THROW(s.query_size(burning), std::logic_error);
+}
+
+BOOST_AUTO_TEST_CASE (exclude_optional_test)
+{
+    storage s;
+    auto pos    (s.register_component<vector>("position"));
+    auto vel    (s.register_component<vector>("velocity"));
+    auto frozen (s.register_component<char>("frozen"));
+    auto name   (s.register_component<std::string>("name"));
+
+    for (int i = 0; i < 30; ++i) {
+        auto e (s.new_entity());
+        s.set(e, pos, vector{0, 0, 0});
+        if (i % 2 == 0)
+            s.set(e, vel, vector{1, 1, 1});
+        if (i % 3 == 0)
+            s.set(e, frozen, char(1));
+        if (i % 5 == 0)
+            s.set(e, name, std::string("named"));
+    }
+    auto bare (s.new_entity());
+    s.clear_changes();
+
+    // Moving: has a velocity, and isn't frozen.
+    int count = 0;
+    s.for_each<vector, vector>(component_mask().set(frozen), pos, vel,
+        [&](storage::iterator i, vector& p, vector& v) {
+        BOOST_CHECK(!s.entity_has_component(i, frozen));
+        p.x += v.x;
+        ++count;
+    });
+    BOOST_CHECK_EQUAL(count, 10);
+
+    // Everything with a position, with or without a velocity and name.
+    int with_vel = 0, with_name = 0;
+    count = 0;
+    s.for_each<vector, optional<vector>, optional<std::string>>(pos, vel, name,
+        [&](storage::iterator, vector& p, vector* v, std::string* n) {
+        ++count;
+        if (v) {
+            ++with_vel;
+            p.y += v->y;
+        }
+        if (n) {
+            ++with_name;
+            BOOST_CHECK_EQUAL(*n, "named");
+        }
+    });
+    BOOST_CHECK_EQUAL(count, 30);
+    BOOST_CHECK_EQUAL(with_vel, 15);
+    BOOST_CHECK_EQUAL(with_name, 6);
+
+    // Missing optional components are not marked dirty.
+    BOOST_CHECK(s.check_dirty(s.find(0), name));
+    BOOST_CHECK(!s.check_dirty(s.find(1), name));
+    BOOST_CHECK(!s.check_dirty(s.find(1), vel));
+
+    // With only optional components, every entity is visited.
+    count = 0;
+    s.for_each<optional<std::string>>(name,
+        [&](storage::iterator i, std::string* n) {
+        ++count;
+        if (i->first == bare)
+            BOOST_CHECK(n == nullptr);
+    });
+    BOOST_CHECK_EQUAL(count, 31);
+}
+
+BOOST_AUTO_TEST_CASE (mask_width_test)
+{
+    // Fill up the storage, so the last components are in the highest
+    // word of the mask.
+    storage s;
+    std::vector<storage::component_id> ids;
+    for (size_t i = 0; i + 2 < max_components; ++i)
+        ids.push_back(s.register_component<char>("c" + std::to_string(i)));
+
+    auto last_flat (s.register_component<int>("last_flat"));
+    auto last      (s.register_component<std::string>("last"));
+    BOOST_CHECK_EQUAL(last, max_components - 1);
+    BOOST_CHECK_THROW(s.register_component<int>("too_many"),
+                      std::logic_error);
+
+    auto e (s.new_entity());
+    s.set(e, ids[0], char(1));
+    s.set(e, ids[ids.size() / 2], char(2));
+    s.set(e, last_flat, 42);
+    s.set(e, last, std::string("last one"));
+    BOOST_CHECK_EQUAL(s.get<char>(e, ids[ids.size() / 2]), 2);
+    BOOST_CHECK_EQUAL(s.get<int>(e, last_flat), 42);
+
+    int count = 0;
+    s.for_each<char, int, std::string>(ids[0], last_flat, last,
+        [&](storage::iterator, char& c, int& i, std::string& str) {
+        BOOST_CHECK_EQUAL(c, 1);
+        BOOST_CHECK_EQUAL(i, 42);
+        BOOST_CHECK_EQUAL(str, "last one");
+        ++count;
+    });
+    BOOST_CHECK_EQUAL(count, 1);
+
+    std::vector<char> buffer;
+    s.serialize(s.find(e), buffer);
+    auto copy (s.new_entity());
+    s.deserialize(s.find(copy), buffer);
+    BOOST_CHECK_EQUAL(s.get<int>(copy, last_flat), 42);
+    BOOST_CHECK_EQUAL(s.get<std::string>(copy, last), "last one");
+    BOOST_CHECK(!s.entity_has_component(s.find(copy), ids[1]));
+}
+
+BOOST_AUTO_TEST_CASE (command_buffer_test)
+{
+    storage s;
+    auto hp   (s.register_component<int>("health"));
+    auto pos  (s.register_component<vector>("position"));
+    auto name (s.register_component<std::string>("name"));
+    auto dead (s.register_component<char>("dead"));
+
+    for (int i = 0; i < 20; ++i) {
+        auto e (s.new_entity());
+        s.set(e, hp, i % 4 == 0 ? 0 : i);
+        s.set(e, pos, vector{float(i), 0, 0});
+    }
+    auto burning (s.register_query(component_mask().set(dead)));
+
+    // Structural changes from inside a loop are only recorded.
+    command_buffer cmds (s);
+    s.for_each<int>(hp, [&](storage::iterator i, int& h) {
+        if (h == 0) {
+            cmds.delete_entity(i->first);
+        } else if (h % 2 == 1) {
+            cmds.set(i->first, name, std::string("odd"));
+            cmds.add_component(i->first, dead);
+            cmds.remove_component(i->first, pos);
+            cmds.set(i->first, name, std::to_string(h));
+        }
+    });
+    BOOST_CHECK_EQUAL(s.size(), 20);
+    BOOST_CHECK_EQUAL(cmds.size(), 5 + 10 * 4);
+
+    auto spawned (cmds.create());
+    cmds.set(spawned, hp, 100);
+    cmds.set(spawned, name, std::string("spawned"));
+    cmds.delete_entity(0); // Already deleted by the loop.
+
+    cmds.play_back();
+    BOOST_CHECK(cmds.empty());
+    BOOST_CHECK_EQUAL(s.size(), 16);
+    BOOST_CHECK_EQUAL(s.query_size(burning), 10);
+
+    auto e (cmds.created(spawned));
+    BOOST_CHECK_EQUAL(s.get<int>(e, hp), 100);
+    BOOST_CHECK_EQUAL(s.get<std::string>(e, name), "spawned");
+
+    for (auto i = s.begin(); i != s.end(); ++i) {
+        if (i->first == e)
+            continue;
+
+        auto h (s.get<int>(i, hp));
+        BOOST_CHECK(h != 0);
+        BOOST_CHECK_EQUAL(s.entity_has_component(i, pos), h % 2 == 0);
+        BOOST_CHECK_EQUAL(s.entity_has_component(i, dead), h % 2 == 1);
+        if (h % 2 == 1)
+            BOOST_CHECK_EQUAL(s.get<std::string>(i, name), std::to_string(h));
+    }
+
+    // Recorded changes can be thrown away.
+    cmds.set(e, hp, 1);
+    cmds.clear();
+    cmds.play_back();
+    BOOST_CHECK_EQUAL(s.get<int>(e, hp), 100);
+}
+
+BOOST_AUTO_TEST_CASE (instrumentation_test)
+{
+    storage s;
+    auto pos  (s.register_component<vector>("position"));
+    auto vel  (s.register_component<vector>("velocity"));
+    auto name (s.register_component<std::string>("name"));
+
+    for (int i = 0; i < 10; ++i) {
+        auto e (s.new_entity());
+        s.set(e, pos, vector{0, 0, 0});
+        if (i % 2 == 0)
+            s.set(e, vel, vector{1, 1, 1});
+    }
+    s.set(0, name, std::string("first"));
+
+    auto usage (s.footprint());
+    BOOST_CHECK_EQUAL(usage.size(), 3);
+    BOOST_CHECK_EQUAL(usage[pos].name, "position");
+    BOOST_CHECK_EQUAL(usage[pos].entities, 10);
+    BOOST_CHECK_EQUAL(usage[pos].bytes, 10 * sizeof(vector));
+    BOOST_CHECK_EQUAL(usage[vel].entities, 5);
+    BOOST_CHECK_EQUAL(usage[name].entities, 1);
+
+    s.reset_stats();
+    s.for_each<vector, vector>(pos, vel,
+        [](storage::iterator, vector& p, vector& v) { p.x += v.x; });
+    s.remove_component_from_entity(s.find(0), vel);
+
+    job_system jobs (2);
+    scheduler sched (s, jobs);
+    sched.add(es::system("move", {vel}, {pos}, [&](storage& data) {
+        data.for_each<vector>(pos, [](storage::iterator, vector& p) {
+            p.y += 1;
+        });
+    }));
+    sched.run();
+
+    auto stats (s.stats());
+    if (storage_stats::enabled) {
+        BOOST_CHECK_EQUAL(stats.for_each.calls, 2);
+        BOOST_CHECK_EQUAL(stats.for_each.visited, 20);
+        BOOST_CHECK_EQUAL(stats.for_each.matched, 15);
+        BOOST_CHECK_EQUAL(stats.relayouts, 1);
+        BOOST_CHECK_EQUAL(stats.bytes_moved, sizeof(vector)
+                                             + s[name].size());
+        BOOST_CHECK_EQUAL(sched.stats()[0].runs, 1);
+    } else {
+        BOOST_CHECK_EQUAL(stats.for_each.calls, 0);
+        BOOST_CHECK_EQUAL(stats.relayouts, 0);
+        BOOST_CHECK_EQUAL(sched.stats()[0].runs, 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE (compact_test)
+{
+    storage s;
+    auto pos  (s.register_component<vector>("position"));
+    auto vel  (s.register_component<vector>("velocity"));
+    auto name (s.register_component<std::string>("name"));
+    auto tag  (s.register_component<char>("tag"));
+
+    // Churn, so the slots and the heap are all mixed up.
+    for (int i = 0; i < 100; ++i) {
+        auto e (s.new_entity());
+        s.set(e, pos, vector{float(i % 10), float(i), 0});
+        s.set(e, vel, vector{1, 0, 0});
+        if (i % 3 == 0)
+            s.set(e, name, std::to_string(i));
+    }
+    for (entity e = 0; e < 100; e += 4)
+        s.delete_entity(e);
+    auto small (s.new_entity());
+    s.set(small, tag, char(1));
+
+    s.compact();
+    BOOST_CHECK_EQUAL(s.size(), 76);
+    for (auto i = s.begin(); i != s.end(); ++i) {
+        if (i->first == small)
+            continue;
+
+        auto& p (s.get<vector>(i, pos));
+        if (int(p.y) % 3 == 0)
+            BOOST_CHECK_EQUAL(s.get<std::string>(i, name),
+                              std::to_string(int(p.y)));
+    }
+
+    // Order by x, then by slot.
+    s.compact([&](storage::const_iterator i) {
+        return s.entity_has_component(i, pos) ? s.get<vector>(i, pos).x
+                                              : -1.f;
+    });
+    auto late (s.new_entity());
+    s.set(late, pos, vector{-5, 0, 0});
+
+    float last_x = -1;
+    int count = 0;
+    bool late_seen = false;
+    s.for_each_ordered<vector, optional<std::string>>(pos, name,
+        [&](storage::iterator i, vector& p, std::string* n) {
+        ++count;
+        if (i->first == late) {
+            late_seen = true;
+            return;
+        }
+        BOOST_CHECK(!late_seen);
+        BOOST_CHECK(p.x >= last_x);
+        last_x = p.x;
+        if (n)
+            BOOST_CHECK_EQUAL(*n, std::to_string(int(p.y)));
+    });
+    BOOST_CHECK_EQUAL(count, 76);
+    BOOST_CHECK(late_seen);
+
+    // A slot that was free during the compact is still visited.
+    s.delete_entity(small);
+    auto reused (s.new_entity());
+    s.set(reused, tag, char(2));
+    count = 0;
+    s.for_each_ordered<char>(tag, [&](storage::iterator, char& t) {
+        BOOST_CHECK_EQUAL(t, 2);
+        ++count;
+    });
+    BOOST_CHECK_EQUAL(count, 1);
+}
+
+BOOST_AUTO_TEST_CASE (concurrency_test)
+{
+    storage s;
+    auto pos  (s.register_component<vector>("position"));
+    auto vel  (s.register_component<vector>("velocity"));
+
+    for (int i = 0; i < 100; ++i) {
+        auto e (s.new_entity());
+        s.set(e, pos, vector{float(i), float(i), 0});
+        s.set(e, vel, vector{1, 1, 0});
+    }
+
+    component_mask pos_mask, vel_mask;
+    pos_mask.set(pos);
+    vel_mask.set(vel);
+
+    // The writer keeps x and y equal, but only while it holds the lock.
+    std::thread writer([&] {
+        for (int k = 0; k < 200; ++k) {
+            auto guard (s.lock(vel_mask, pos_mask));
+            s.for_each<vector, vector>(pos, vel,
+                [](storage::iterator, vector& p, vector& v) {
+                p.x += v.x;
+                std::this_thread::yield();
+                p.y += v.y;
+            });
+        }
+    });
+
+    std::atomic<int> bad (0);
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 3; ++r) {
+        readers.emplace_back([&] {
+            for (int k = 0; k < 200; ++k) {
+                auto guard (s.lock(pos_mask));
+                s.for_each<vector>(pos, [&](storage::iterator, vector& p) {
+                    if (p.x != p.y)
+                        ++bad;
+                });
+            }
+        });
+    }
+
+    std::thread structure([&] {
+        for (int k = 0; k < 50; ++k) {
+            auto guard (s.lock_structure());
+            auto e (s.new_entity());
+            s.set(e, pos, vector{-1, -1, 0});
+            s.delete_entity(e);
+        }
+    });
+
+    writer.join();
+    for (auto& t : readers)
+        t.join();
+    structure.join();
+
+    BOOST_CHECK_EQUAL(bad, 0);
+    BOOST_CHECK_EQUAL(s.size(), 100);
+    s.for_each<vector>(pos, [&](storage::iterator, vector& p) {
+        BOOST_CHECK_EQUAL(p.x, p.y);
+        BOOST_CHECK(p.x >= 200);
+    });
+
+    // The scheduler takes the same locks, so an outside reader can run
+    // alongside it.
+    job_system jobs (2);
+    scheduler sched (s, jobs);
+    sched.add(es::system("move", {vel}, {pos}, [&](storage& data) {
+        data.for_each<vector, vector>(pos, vel,
+            [](storage::iterator, vector& p, vector& v) {
+            p.x += v.x;
+            p.y += v.y;
+        });
+    }));
+    std::thread outside([&] {
+        for (int k = 0; k < 20; ++k) {
+            auto guard (s.lock(pos_mask));
+            s.for_each<vector>(pos, [&](storage::iterator, vector& p) {
+                if (p.x != p.y)
+                    ++bad;
+            });
+        }
+    });
+    for (int k = 0; k < 20; ++k)
+        sched.run();
+    outside.join();
+    BOOST_CHECK_EQUAL(bad, 0);
+}
+
+BOOST_AUTO_TEST_CASE (buffered_component_test)
+{
+    storage s;
+    auto pos  (s.register_buffered_component<vector>("position"));
+    auto vel  (s.register_component<vector>("velocity"));
+    auto hist (s.register_buffered_component<int>("history", 3));
+    BOOST_CHECK_THROW(s.register_buffered_component<int>("one", 1),
+                      std::logic_error);
+    BOOST_CHECK_EQUAL(s[pos].buffers(), 2);
+    BOOST_CHECK_EQUAL(s[pos].size(), 2 * sizeof(vector));
+    BOOST_CHECK_EQUAL(s[pos].value_size(), sizeof(vector));
+
+    // A new value goes into all buffers.
+    auto e (s.new_entity());
+    s.set(e, pos, vector{1, 0, 0});
+    s.set(e, vel, vector{1, 0, 0});
+    s.set(e, hist, 7);
+    BOOST_CHECK_EQUAL(s.get<vector>(e, pos).x, 1);
+    BOOST_CHECK_EQUAL(s.get_current<vector>(e, pos).x, 1);
+    BOOST_CHECK_EQUAL(s.get_current<vector>(e, vel).x, 1);
+
+    // Write the next values from the current ones.
+    s.clear_changes();
+    auto step = [&] {
+        s.for_each<current<vector>, vector, vector>(pos, pos, vel,
+            [](storage::iterator, const vector& now, vector& next,
+               vector& v) {
+            next.x = now.x + v.x;
+        });
+    };
+    step();
+    step();
+    BOOST_CHECK_EQUAL(s.get<vector>(e, pos).x, 2);
+    BOOST_CHECK_EQUAL(s.get_current<vector>(e, pos).x, 1);
+    BOOST_CHECK(s.check_dirty(s.find(e), pos));
+
+    // Reading only the current value doesn't mark anything.
+    s.clear_changes();
+    s.for_each<current<vector>>(pos, [](storage::iterator, const vector&) {});
+    BOOST_CHECK(!s.check_dirty(s.find(e), pos));
+
+    s.swap_buffers();
+    BOOST_CHECK_EQUAL(s.get_current<vector>(e, pos).x, 2);
+    BOOST_CHECK_EQUAL(s.get<vector>(e, pos).x, 1);
+    step();
+    BOOST_CHECK_EQUAL(s.get<vector>(e, pos).x, 3);
+
+    // With three buffers, the next buffer is the oldest one.
+    s.get<int>(e, hist) = 8;
+    s.swap_buffers();
+    s.get<int>(e, hist) = 9;
+    s.swap_buffers();
+    BOOST_CHECK_EQUAL(s.get_current<int>(e, hist), 9);
+    BOOST_CHECK_EQUAL(s.get<int>(e, hist), 7);
+
+    // Clones, command buffers, and serialization keep every buffer.
+    auto copy (s.clone_entity(s.find(e)));
+    BOOST_CHECK_EQUAL(s.get_current<int>(copy, hist), 9);
+    BOOST_CHECK_EQUAL(s.get<int>(copy, hist), 7);
+
+    command_buffer cmds (s);
+    auto made (cmds.create());
+    cmds.set(made, pos, vector{5, 0, 0});
+    cmds.set(e, pos, vector{6, 0, 0});
+    cmds.play_back();
+    BOOST_CHECK_EQUAL(s.get_current<vector>(cmds.created(made), pos).x, 5);
+    BOOST_CHECK_EQUAL(s.get<vector>(cmds.created(made), pos).x, 5);
+    BOOST_CHECK_EQUAL(s.get_current<vector>(e, pos).x, 2);
+    BOOST_CHECK_EQUAL(s.get<vector>(e, pos).x, 6);
+
+    std::vector<char> buf;
+    s.serialize(s.find(e), buf);
+    auto restored (s.new_entity());
+    s.deserialize(s.find(restored), buf);
+    BOOST_CHECK_EQUAL(s.get_current<vector>(restored, pos).x, 2);
+    BOOST_CHECK_EQUAL(s.get<vector>(restored, pos).x, 6);
+
+    // Another storage sees the same next and current values, even if
+    // its buffers were swapped a different number of times.
+    auto receiver = [](size_t swaps) {
+        std::unique_ptr<storage> to (new storage);
+        to->register_buffered_component<vector>("position");
+        to->register_component<vector>("velocity");
+        to->register_buffered_component<int>("history", 3);
+        for (size_t i = 0; i < swaps; ++i)
+            to->swap_buffers();
+        return to;
+    };
+    auto check = [&](storage& to, entity en, float next) {
+        BOOST_CHECK_EQUAL(to.get_current<vector>(en, pos).x, 2);
+        BOOST_CHECK_EQUAL(to.get<vector>(en, pos).x, next);
+        BOOST_CHECK_EQUAL(to.get_current<int>(en, hist), 9);
+        BOOST_CHECK_EQUAL(to.get<int>(en, hist), 7);
+    };
+
+    auto t (receiver(2));
+    auto other (t->new_entity());
+    t->deserialize(t->find(other), buf);
+    check(*t, other, 6);
+
+    std::vector<char> snap;
+    s.write_snapshot(snap);
+    t = receiver(2);
+    t->read_snapshot(snap.data(), snap.size());
+    check(*t, e, 6);
+
+    for (bool use_xor : {false, true}) {
+        s.set(e, pos, vector{6, 0, 0});
+        t = receiver(2);
+        delta_encoder encoder (s, use_xor);
+        delta_decoder decoder (*t);
+        std::vector<char> delta;
+        encoder.encode(delta);
+        decoder.apply(delta);
+        check(*t, e, 6);
+
+        s.set(e, pos, vector{4, 0, 0});
+        delta.clear();
+        encoder.encode(delta);
+        decoder.apply(delta);
+        check(*t, e, 4);
+    }
+
+    // A reader that only needs the current values doesn't wait for the
+    // writer, and always sees a complete frame.
+    for (auto i = s.begin(); i != s.end(); ++i) {
+        if (s.entity_has_component(i, pos))
+            s.get<vector>(i, pos) = s.get_current<vector>(i, pos);
+    }
+    s.swap_buffers();
+    std::atomic<bool> done (false);
+    std::atomic<int> bad (0);
+    std::thread reader([&] {
+        while (!done) {
+            auto guard (s.lock(component_mask()));
+            float first (-1);
+            s.for_each<current<vector>>(pos,
+                [&](storage::iterator, const vector& p) {
+                if (first < 0)
+                    first = p.y;
+                else if (p.y != first)
+                    ++bad;
+            });
+        }
+    });
+    for (int frame = 1; frame <= 50; ++frame) {
+        {
+            component_mask writes;
+            writes.set(pos);
+            auto guard (s.lock(component_mask(), writes));
+            s.for_each<vector>(pos, [&](storage::iterator, vector& p) {
+                p.y = float(frame);
+            });
+        }
+        auto guard (s.lock_structure());
+        s.swap_buffers();
+    }
+    done = true;
+    reader.join();
+    BOOST_CHECK_EQUAL(bad, 0);
+    BOOST_CHECK_EQUAL(s.get_current<vector>(e, pos).y, 50);
+}
+
+BOOST_AUTO_TEST_CASE (sparse_component_test)
+{
+    storage s;
+    auto pos  (s.register_component<vector>("position"));
+    auto name (s.register_component<std::string>("name"));
+    auto stun (s.register_component<int>("stunned", storage::sparse));
+    BOOST_CHECK_THROW(s.register_component<std::string>("bad",
+                                                        storage::sparse),
+                      std::logic_error);
+
+    for (int i = 0; i < 100; ++i) {
+        auto e (s.new_entity());
+        s.set(e, pos, vector{float(i), 0, 0});
+        if (i % 10 == 0)
+            s.set(e, stun, i);
+    }
+    s.set(0, name, std::string("zero"));
+
+    // Toggling a sparse component leaves the entity data where it is.
+    auto before (&s.get<vector>(5, pos));
+    s.set(5, stun, 55);
+    BOOST_CHECK_EQUAL(s.get<int>(5, stun), 55);
+    s.remove_component_from_entity(s.find(5), stun);
+    BOOST_CHECK(!s.entity_has_component(s.find(5), stun));
+    BOOST_CHECK_THROW(s.get<int>(5, stun), std::logic_error);
+    BOOST_CHECK_EQUAL(&s.get<vector>(5, pos), before);
+
+    // Only the entities in the set are visited.
+    int count (0);
+    s.for_each<vector, int>(pos, stun,
+        [&](storage::iterator i, vector& p, int& t) {
+        BOOST_CHECK_EQUAL(int(p.x), t);
+        BOOST_CHECK_EQUAL(entity_index(i->first), t);
+        ++count;
+    });
+    BOOST_CHECK_EQUAL(count, 10);
+
+    count = 0;
+    s.for_each<vector, optional<int>>(pos, stun,
+        [&](storage::iterator, vector& p, int* t) {
+        if (t) {
+            BOOST_CHECK_EQUAL(int(p.x), *t);
+            ++count;
+        }
+    });
+    BOOST_CHECK_EQUAL(count, 10);
+    BOOST_CHECK_EQUAL(s.get<std::string>(0, name), "zero");
+
+    // Removing the component from other entities during the loop
+    // doesn't make it visit anything twice.
+    std::vector<int> visits (100, 0);
+    s.for_each<int>(stun, [&](storage::iterator i, int&) {
+        ++visits[entity_index(i->first)];
+        for (entity other : {entity(0), entity(90)}) {
+            if (other != i->first)
+                s.remove_component_from_entity(s.find(other), stun);
+        }
+    });
+    BOOST_CHECK(*std::max_element(visits.begin(), visits.end()) == 1);
+    s.set(0, stun, 0);
+    s.set(90, stun, 90);
+
+    // Copies keep the value.
+    auto copy (s.clone_entity(s.find(20)));
+    BOOST_CHECK_EQUAL(s.get<int>(copy, stun), 20);
+
+    std::vector<char> buf;
+    s.serialize(s.find(0), buf);
+    auto restored (s.new_entity());
+    s.deserialize(s.find(restored), buf);
+    BOOST_CHECK_EQUAL(s.get<int>(restored, stun), 0);
+    BOOST_CHECK_EQUAL(s.get<std::string>(restored, name), "zero");
+
+    command_buffer cmds (s);
+    cmds.set(30, stun, 33);
+    cmds.remove_component(40, stun);
+    cmds.set(41, stun, 44);
+    cmds.play_back();
+    BOOST_CHECK_EQUAL(s.get<int>(30, stun), 33);
+    BOOST_CHECK(!s.entity_has_component(s.find(40), stun));
+    BOOST_CHECK_EQUAL(s.get<int>(41, stun), 44);
+
+    storage::prototype proto (s);
+    BOOST_CHECK_THROW(proto.set(stun, 1), std::logic_error);
+
+    // Snapshots and replication see the same entities.
+    storage u;
+    u.register_component<vector>("position");
+    u.register_component<std::string>("name");
+    u.register_component<int>("stunned", storage::sparse);
+    delta_encoder encoder (s, true);
+    delta_decoder decoder (u);
+    std::vector<char> delta;
+    encoder.encode(delta);
+    decoder.apply(delta);
+    s.set(50, stun, 500);
+    s.set(60, stun, 600);
+    s.remove_component_from_entity(s.find(70), stun);
+    delta.clear();
+    encoder.encode(delta);
+    decoder.apply(delta);
+
+    std::vector<char> snap;
+    s.write_snapshot(snap);
+    storage t;
+    t.register_component<vector>("position");
+    t.register_component<std::string>("name");
+    t.register_component<int>("stunned", storage::sparse);
+    t.read_snapshot(snap.data(), snap.size());
+
+    for (auto other : {&t, &u}) {
+        BOOST_CHECK_EQUAL(other->size(), s.size());
+        for (auto i = s.begin(); i != s.end(); ++i) {
+            auto j (other->find(i->first));
+            BOOST_CHECK(j->second.components == i->second.components);
+            if (s.entity_has_component(i, stun))
+                BOOST_CHECK_EQUAL(other->get<int>(j, stun),
+                                  s.get<int>(i, stun));
+        }
+    }
+
+    // The callback can delete the entity it is visiting.
+    std::vector<entity> seen;
+    s.for_each<int>(stun, [&](storage::iterator i, int&) {
+        seen.push_back(i->first);
+        s.delete_entity(i);
+    });
+    std::sort(seen.begin(), seen.end());
+    BOOST_CHECK(std::adjacent_find(seen.begin(), seen.end()) == seen.end());
+    BOOST_CHECK_EQUAL(seen.size(), 11);
+    count = 0;
+    s.for_each<int>(stun, [&](storage::iterator, int&) { ++count; });
+    BOOST_CHECK_EQUAL(count, 0);
+}
+
+struct frozen {};
+
+BOOST_AUTO_TEST_CASE (tag_component_test)
+{
+    storage s;
+    auto pos  (s.register_component<vector>("position"));
+    auto tag  (s.register_component<frozen>("frozen"));
+    auto name (s.register_component<std::string>("name"));
+    BOOST_CHECK_EQUAL(s[tag].size(), 0);
+
+    auto e (s.new_entity());
+    s.set(e, pos, vector{1, 2, 3});
+    s.set(e, name, std::string("ice"));
+    auto size (s.find(e)->second.data.size());
+
+    // Tags are only a bit, the data stays where it is.
+    auto before (&s.get<vector>(e, pos));
+    s.set(e, tag, frozen());
+    BOOST_CHECK(s.entity_has_component(s.find(e), tag));
+    BOOST_CHECK_EQUAL(s.find(e)->second.data.size(), size);
+    BOOST_CHECK_EQUAL(&s.get<vector>(e, pos), before);
+    BOOST_CHECK_EQUAL(s.get<std::string>(e, name), "ice");
+
+    auto other (s.new_entity());
+    s.set_components<vector, frozen>(other, pos, tag, vector{4, 5, 6},
+                                     frozen());
+    s.new_entity();
+
+    int count (0);
+    s.for_each<vector, frozen>(pos, tag,
+        [&](storage::iterator, vector&, frozen&) { ++count; });
+    BOOST_CHECK_EQUAL(count, 2);
+
+    // Only the mask bit is serialized.
+    std::vector<char> with, without;
+    s.serialize(s.find(e), with);
+    s.remove_component_from_entity(s.find(e), tag);
+    BOOST_CHECK_EQUAL(&s.get<vector>(e, pos), before);
+    s.serialize(s.find(e), without);
+    BOOST_CHECK_EQUAL(with.size(), without.size());
+
+    auto copy (s.new_entity());
+    s.deserialize(s.find(copy), with);
+    BOOST_CHECK(s.entity_has_component(s.find(copy), tag));
+    BOOST_CHECK_EQUAL(s.get<vector>(copy, pos).z, 3);
+    BOOST_CHECK_EQUAL(s.get<std::string>(copy, name), "ice");
+
+    command_buffer cmds (s);
+    cmds.add_component(e, tag);
+    cmds.remove_component(other, tag);
+    cmds.play_back();
+    BOOST_CHECK(s.entity_has_component(s.find(e), tag));
+    BOOST_CHECK(!s.entity_has_component(s.find(other), tag));
+    BOOST_CHECK_EQUAL(s.get<vector>(other, pos).x, 4);
+}
+
+struct counted
+{
+    static int live;
+    static int copies;
+
+    counted() : value("counted") { ++live; }
+    counted(const counted& c) : value(c.value) { ++live; ++copies; }
+    counted(counted&& c) : value(std::move(c.value)) { ++live; }
+    ~counted() { --live; }
+
+    counted& operator=(const counted&) = default;
+    counted& operator=(counted&&) = default;
+
+    std::string value;
+};
+
+int counted::live = 0;
+int counted::copies = 0;
+
+BOOST_AUTO_TEST_CASE (value_ops_test)
+{
+    {
+    storage s;
+    auto pos (s.register_component<vector>("position"));
+    auto obj (s.register_component<counted>("counted"));
+    auto hp  (s.register_component<int>("health"));
+    // The default value the storage keeps around.
+    BOOST_CHECK_EQUAL(counted::live, 1);
+
+    auto e (s.new_entity());
+    s.set(e, obj, counted());
+    s.set(e, pos, vector{1, 2, 3});
+    s.set(e, hp, 10);
+    s.remove_component_from_entity(s.find(e), pos);
+    BOOST_CHECK_EQUAL(counted::live, 2);
+    BOOST_CHECK_EQUAL(s.get<counted>(e, obj).value, "counted");
+
+    // A clone makes exactly one copy, and nothing is left behind.
+    counted::copies = 0;
+    auto copy (s.clone_entity(s.find(e)));
+    BOOST_CHECK_EQUAL(counted::copies, 1);
+    BOOST_CHECK_EQUAL(counted::live, 3);
+    BOOST_CHECK_EQUAL(s.get<counted>(copy, obj).value, "counted");
+
+    s.delete_entity(e);
+    s.compact();
+    BOOST_CHECK_EQUAL(counted::live, 2);
+    BOOST_CHECK_EQUAL(s.get<counted>(copy, obj).value, "counted");
+    BOOST_CHECK_EQUAL(s.get<int>(copy, hp), 10);
+    }
+    BOOST_CHECK_EQUAL(counted::live, 0);
+}
+
+BOOST_AUTO_TEST_CASE (component_handle_test)
+{
+    storage s;
+    auto pos  (s.register_component<vector>("position"));
+    auto name (s.register_component<std::string>("name"));
+    auto stun (s.register_component<int>("stunned", storage::sparse));
+    static_assert(std::is_same<decltype(pos),
+                               component_handle<vector>>::value,
+                  "register_component returns a typed handle");
+
+    // The type comes from the handle.
+    auto e (s.new_entity());
+    s.set(e, pos, vector{1, 2, 3});
+    s.set(e, name, std::string("handle"));
+    s.set(s.find(e), stun, 4);
+    s.get(e, pos).y = 5;
+    BOOST_CHECK_EQUAL(s.get(e, pos).y, 5);
+    BOOST_CHECK_EQUAL(s.get(s.find(e), name), "handle");
+    BOOST_CHECK_EQUAL(s.get(e, stun), 4);
+    const storage& cs (s);
+    BOOST_CHECK_EQUAL(cs.get(cs.find(e), pos).z, 3);
+
+    // Handles still work wherever a plain ID does.
+    storage::component_id id (name);
+    BOOST_CHECK_EQUAL(s.get<std::string>(e, id), "handle");
+    BOOST_CHECK(s.entity_has_component(s.find(e), pos));
+
+    BOOST_CHECK_EQUAL(s.find_component("stunned"), stun.id());
+    BOOST_CHECK_EQUAL(s.find_component<vector>("position").id(), pos.id());
+    BOOST_CHECK_THROW(s.find_component("speed"), std::logic_error);
+    BOOST_CHECK_THROW(s.find_component<int>("name"), std::logic_error);
+
+    // The first component with a name wins.
+    s.register_component<int>("name");
+    BOOST_CHECK_EQUAL(s.find_component("name"), name.id());
+}
+
+struct stat_table
+{
+    int values[32];
+};
+
+BOOST_AUTO_TEST_CASE (shared_component_test)
+{
+    {
+    storage s;
+    auto pos   (s.register_component<vector>("position"));
+    auto obj   (s.register_component<counted>("counted", storage::shared));
+    auto stats (s.register_component<stat_table>("stats", storage::shared));
+    const storage& cs (s);
+    // The default value.
+    BOOST_CHECK_EQUAL(counted::live, 1);
+
+    stat_table table;
+    for (int i = 0; i < 32; ++i)
+        table.values[i] = i;
+
+    storage::prototype proto (s);
+    proto.set(obj, counted());
+    proto.set(stats, table);
+    proto.set(pos, vector{0, 0, 0});
+    counted::copies = 0;
+    auto range (s.new_entities(100, proto));
+    auto first (range.first);
+
+    // Spawning only shares the prototype's values.
+    BOOST_CHECK_EQUAL(counted::live, 2);
+    BOOST_CHECK_EQUAL(counted::copies, 0);
+    BOOST_CHECK_EQUAL(&cs.get(first + 1, obj), &cs.get(first, obj));
+    BOOST_CHECK_EQUAL(&cs.get(first + 1, stats), &cs.get(first, stats));
+    BOOST_CHECK_EQUAL(cs.get(first + 99, stats).values[31], 31);
+
+    // Writing gives the entity a copy of its own.
+    s.get(first, stats).values[0] = 100;
+    BOOST_CHECK_EQUAL(cs.get(first, stats).values[0], 100);
+    BOOST_CHECK_EQUAL(cs.get(first + 1, stats).values[0], 0);
+    s.get(first, obj).value = "mine";
+    BOOST_CHECK_EQUAL(counted::copies, 1);
+    BOOST_CHECK_EQUAL(cs.get(first + 1, obj).value, "counted");
+
+    counted mine;
+    mine.value = "set";
+    s.set(first + 2, obj, mine);
+    BOOST_CHECK_EQUAL(cs.get(first + 2, obj).value, "set");
+    BOOST_CHECK_EQUAL(cs.get(first + 3, obj).value, "counted");
+
+    // A value that isn't shared anymore is written in place.
+    auto before (&cs.get(first, stats));
+    s.get(first, stats).values[1] = 101;
+    BOOST_CHECK_EQUAL(&cs.get(first, stats), before);
+
+    // Clones share until they are written to.
+    auto copy (s.clone_entity(s.find(first)));
+    BOOST_CHECK_EQUAL(&cs.get(copy, stats), before);
+    BOOST_CHECK_EQUAL(s.get_current<stat_table>(copy, stats).values[1], 101);
+    BOOST_CHECK_EQUAL(&cs.get(copy, stats), before);
+
+    // Reading the current value doesn't make a copy, writing does.
+    auto shared_value (&cs.get(first + 10, stats));
+    int total (0);
+    s.for_each<current<stat_table>>(stats,
+        [&](storage::iterator, const stat_table& t) { total += t.values[2]; });
+    BOOST_CHECK_EQUAL(total, 2 * 101);
+    BOOST_CHECK_EQUAL(&cs.get(first + 10, stats), shared_value);
+
+    s.for_each<vector, stat_table>(pos, stats,
+        [&](storage::iterator, vector&, stat_table& t) { ++t.values[3]; });
+    BOOST_CHECK_EQUAL(cs.get(first + 10, stats).values[3], 4);
+    BOOST_CHECK_EQUAL(cs.get(first + 11, stats).values[3], 4);
+    BOOST_CHECK(&cs.get(first + 10, stats) != &cs.get(first + 11, stats));
+
+    // Serialization writes the value itself.
+    auto plain (s.new_entity());
+    s.set(plain, stats, cs.get(first, stats));
+    std::vector<char> buf;
+    s.serialize(s.find(plain), buf);
+    auto restored (s.new_entity());
+    s.deserialize(s.find(restored), buf);
+    BOOST_CHECK_EQUAL(cs.get(restored, stats).values[1], 101);
+    BOOST_CHECK_EQUAL(cs.get(restored, stats).values[31], 31);
+
+    command_buffer cmds (s);
+    cmds.set(first + 4, obj, mine);
+    cmds.play_back();
+    BOOST_CHECK_EQUAL(cs.get(first + 4, obj).value, "set");
+    BOOST_CHECK_EQUAL(cs.get(first + 5, obj).value, "counted");
+    }
+    BOOST_CHECK_EQUAL(counted::live, 0);
+}
+
+BOOST_AUTO_TEST_CASE (observer_test)
+{
+    storage s;
+    auto pos (s.register_component<vector>("position"));
+    auto hp  (s.register_component<int>("health"));
+    auto before (s.new_entity());
+    s.set(before, pos, vector{0, 0, 0});
+    s.clear_changes();
+
+    std::vector<entity> added, removed, changed;
+    size_t batches (0);
+    auto obs (s.observe(pos, storage::on_add | storage::on_remove
+                                 | storage::on_change,
+                        [&](const storage::event_batch& b) {
+        BOOST_CHECK_EQUAL(b.component, pos);
+        ++batches;
+        auto& list (b.kind == storage::on_add      ? added
+                    : b.kind == storage::on_remove ? removed
+                                                   : changed);
+        list.insert(list.end(), b.begin(), b.end());
+    }));
+
+    // Entities that had the component before are not added.
+    s.dispatch_events();
+    BOOST_CHECK_EQUAL(batches, 0);
+
+    storage::prototype proto (s);
+    proto.set(pos, vector{1, 2, 3});
+    auto range (s.new_entities(100, proto));
+    s.set(range.first, pos, vector{2, 2, 2});
+    s.set(range.first + 1, hp, 10);
+    s.dispatch_events();
+    BOOST_CHECK_EQUAL(batches, 1);
+    BOOST_CHECK_EQUAL(added.size(), 100);
+    BOOST_CHECK(changed.empty());
+    BOOST_CHECK_EQUAL(s.size(), 101);
+
+    // Changes are listed once, no matter how often they happen.
+    added.clear();
+    s.set(range.first + 2, pos, vector{3, 3, 3});
+    s.set(range.first + 2, pos, vector{4, 4, 4});
+    s.for_each<vector>(pos, [&](storage::iterator i, vector&) {
+        return i->first == before ? ~uint64_t(0) : uint64_t(0);
+    });
+    s.set(range.first + 3, hp, 10);
+    s.remove_component_from_entity(s.find(range.first + 4), pos);
+    s.delete_entity(range.first + 5);
+    auto reused (s.new_entity());
+    s.set(reused, pos, vector{0, 0, 0});
+    s.dispatch_events();
+
+    std::sort(changed.begin(), changed.end());
+    BOOST_REQUIRE_EQUAL(changed.size(), 2);
+    BOOST_CHECK_EQUAL(changed[0], before);
+    BOOST_CHECK_EQUAL(changed[1], range.first + 2);
+    std::sort(removed.begin(), removed.end());
+    BOOST_REQUIRE_EQUAL(removed.size(), 2);
+    BOOST_CHECK_EQUAL(removed[0], range.first + 4);
+    BOOST_CHECK_EQUAL(removed[1], range.first + 5);
+    BOOST_REQUIRE_EQUAL(added.size(), 1);
+    BOOST_CHECK_EQUAL(added[0], reused);
+
+    // The dirty flags are cleared by the dispatch.
+    size_t count (0);
+    s.for_each_changed([&](storage::iterator) { ++count; });
+    BOOST_CHECK_EQUAL(count, 0);
+
+    // Observers only get the kinds of events they asked for.
+    size_t health_changes (0);
+    s.observe(hp, storage::on_change, [&](const storage::event_batch& b) {
+        BOOST_CHECK_EQUAL(b.kind, storage::on_change);
+        health_changes += b.size();
+    });
+    s.unobserve(obs);
+    s.set(range.first + 1, hp, 5);
+    s.set(range.first + 6, hp, 5);
+    s.set(range.first + 6, pos, vector{0, 0, 0});
+    s.clear();
+    s.dispatch_events();
+    BOOST_CHECK_EQUAL(health_changes, 0);
+    s.set(s.new_entity(), hp, 5);
+    auto hurt (s.new_entity());
+    s.set(hurt, hp, 5);
+    s.dispatch_events();
+    s.set(hurt, hp, 4);
+    s.dispatch_events();
+    BOOST_CHECK_EQUAL(health_changes, 1);
+    BOOST_CHECK_THROW(s.unobserve(obs), std::logic_error);
+
+    // A smaller world from a snapshot leaves no stale slots behind.
+    storage small;
+    small.register_component<vector>("position");
+    small.register_component<int>("health");
+    small.set(small.new_entity(), pos, vector{1, 1, 1});
+    std::vector<char> snap;
+    small.write_snapshot(snap);
+    s.new_entities(100);
+    changed.clear();
+    s.observe(pos, storage::on_change, [&](const storage::event_batch& b) {
+        changed.insert(changed.end(), b.begin(), b.end());
+    });
+    s.read_snapshot(snap.data(), snap.size());
+    s.dispatch_events();
+    BOOST_CHECK(changed.empty());
+    s.set(0, pos, vector{2, 2, 2});
+    s.dispatch_events();
+    BOOST_REQUIRE_EQUAL(changed.size(), 1);
+    BOOST_CHECK_EQUAL(changed[0], 0);
+
+    // new_entities calls on_new_entity as well.
+    count = 0;
+    s.on_new_entity = [&](storage::iterator) { ++count; };
+    s.new_entities(10);
+    s.new_entities(10, proto);
+    BOOST_CHECK_EQUAL(count, 20);
+}
+
+BOOST_AUTO_TEST_CASE (memory_stats_test)
+{
+    storage s;
+    auto pos  (s.register_component<vector>("position"));
+    auto name (s.register_component<std::string>("name"));
+
+    for (int i = 0; i < 100; ++i) {
+        auto e (s.new_entity());
+        s.set(e, pos, vector{0, 0, 0});
+        if (i % 10 == 0)
+            s.set(e, name, std::string("tenth"));
+    }
+    s.delete_entity(5);
+
+    auto usage (s.memory_stats());
+    BOOST_CHECK_EQUAL(usage.entities, 99);
+    BOOST_CHECK_EQUAL(usage.slots, 100);
+    BOOST_CHECK(usage.slot_bytes >= 100 * (sizeof(entity)
+                                           + sizeof(component_mask)
+                                           + sizeof(small_buffer)));
+    BOOST_CHECK(usage.change_bytes >= 100 * sizeof(component_mask));
+    BOOST_CHECK(usage.index_bytes >= sizeof(uint32_t));
+    BOOST_CHECK_EQUAL(usage.components.size(), 2);
+    BOOST_CHECK_EQUAL(usage.components[pos].entities, 99);
+    BOOST_CHECK_EQUAL(usage.components[name].entities, 10);
+
+    // A vector fits inline, the entities with a name are on the heap.
+    BOOST_CHECK(usage.heap_bytes >= 10 * (sizeof(vector) + s[name].size()));
+    BOOST_CHECK(usage.slack_bytes < usage.heap_bytes);
+    BOOST_CHECK(usage.overhead_per_entity() > 0);
+
+    // Without change tracking, the dirty flags are gone.
+    s.track_changes(false);
+    BOOST_CHECK(!s.tracks_changes());
+    auto untracked (s.memory_stats());
+    BOOST_CHECK_EQUAL(untracked.change_bytes, 0);
+    BOOST_CHECK(untracked.overhead_per_entity()
+                < usage.overhead_per_entity());
+
+    s.set(0, pos, vector{1, 1, 1});
+    s.remove_component_from_entity(s.find(10), name);
+    s.new_entity();
+    BOOST_CHECK(!s.check_dirty(s.find(0)));
+    size_t count (0);
+    s.for_each_changed([&](storage::iterator) { ++count; });
+    BOOST_CHECK_EQUAL(count, 0);
+    delta_encoder enc (s);
+    std::vector<char> buf;
+    BOOST_CHECK_THROW(enc.encode(buf), std::logic_error);
+
+    // Turning it on again starts with a clean slate.
+    s.track_changes(true);
+    BOOST_CHECK(!s.check_dirty(s.find(0)));
+    s.set(0, pos, vector{2, 2, 2});
+    BOOST_CHECK(s.check_dirty(s.find(0), pos));
+    s.for_each_changed([&](storage::iterator) { ++count; });
+    BOOST_CHECK_EQUAL(count, 1);
+}